@@ -1,5 +1,765 @@
+
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
 \echo Use "CREATE EXTENSION all_hooks or LOAD 'all_hooks';" to load this file. \quit
 
 load 'all_hooks';
 
+-- drain the shared ring buffer of hook events
+CREATE FUNCTION all_hooks_events(
+	OUT hook text,
+	OUT pid integer,
+	OUT ts timestamptz,
+	OUT queryid bigint,
+	OUT objid oid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_events'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- events overwritten before being drained
+CREATE FUNCTION all_hooks_events_dropped()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'all_hooks_events_dropped'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_events() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION all_hooks_events() TO pg_read_all_stats;
+REVOKE ALL ON FUNCTION all_hooks_events_dropped() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION all_hooks_events_dropped() TO pg_read_all_stats;
+
+-- latency of the wrapped calls, in milliseconds
+CREATE FUNCTION all_hooks_stats(
+	OUT hook text,
+	OUT calls bigint,
+	OUT total_time double precision,
+	OUT mean_time double precision,
+	OUT p50_time double precision,
+	OUT p95_time double precision,
+	OUT p99_time double precision,
+	OUT max_time double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION all_hooks_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_stats_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_stats_reset() FROM PUBLIC;
+
+-- function profiler, times in milliseconds
+CREATE FUNCTION all_hooks_functions(
+	OUT dbid oid,
+	OUT funcid oid,
+	OUT calls bigint,
+	OUT aborts bigint,
+	OUT total_time double precision,
+	OUT self_time double precision,
+	OUT min_time double precision,
+	OUT max_time double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_functions'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION all_hooks_functions_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_functions_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_functions_reset() FROM PUBLIC;
+
+-- same shape as pg_stat_user_functions, for the current database
+CREATE VIEW all_hooks_function_stats AS
+	SELECT f.funcid,
+		   n.nspname AS schemaname,
+		   p.proname AS funcname,
+		   l.lanname AS language,
+		   p.prosecdef AS security_definer,
+		   f.calls,
+		   f.aborts,
+		   f.total_time,
+		   f.self_time,
+		   f.total_time / f.calls AS mean_time,
+		   f.min_time,
+		   f.max_time
+	FROM all_hooks_functions() f
+		LEFT JOIN pg_proc p ON p.oid = f.funcid
+		LEFT JOIN pg_namespace n ON n.oid = p.pronamespace
+		LEFT JOIN pg_language l ON l.oid = p.prolang
+	WHERE f.dbid = (SELECT oid FROM pg_database WHERE datname = current_database());
+
+-- PL/pgSQL statement profiler, times in milliseconds
+CREATE FUNCTION all_hooks_plpgsql_statements(
+	OUT dbid oid,
+	OUT funcid oid,
+	OUT lineno integer,
+	OUT stmt_type text,
+	OUT calls bigint,
+	OUT total_time double precision,
+	OUT max_time double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_plpgsql_statements'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION all_hooks_plpgsql_statements_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_plpgsql_statements_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_plpgsql_statements_reset() FROM PUBLIC;
+
+CREATE VIEW all_hooks_plpgsql_stats AS
+	SELECT s.funcid,
+		   n.nspname AS schemaname,
+		   p.proname AS funcname,
+		   s.lineno,
+		   s.stmt_type,
+		   s.calls,
+		   s.total_time,
+		   s.total_time / s.calls AS mean_time,
+		   s.max_time
+	FROM all_hooks_plpgsql_statements() s
+		LEFT JOIN pg_proc p ON p.oid = s.funcid
+		LEFT JOIN pg_namespace n ON n.oid = p.pronamespace
+	WHERE s.dbid = (SELECT oid FROM pg_database WHERE datname = current_database());
+
+-- query statistics, times in milliseconds
+CREATE FUNCTION all_hooks_queries(
+	OUT queryid bigint,
+	OUT userid oid,
+	OUT dbid oid,
+	OUT calls bigint,
+	OUT rows bigint,
+	OUT total_time double precision,
+	OUT min_time double precision,
+	OUT max_time double precision,
+	OUT shared_blks_hit bigint,
+	OUT shared_blks_read bigint,
+	OUT shared_blks_dirtied bigint,
+	OUT shared_blks_written bigint,
+	OUT local_blks_hit bigint,
+	OUT local_blks_read bigint,
+	OUT temp_blks_read bigint,
+	OUT temp_blks_written bigint,
+	OUT wal_records bigint,
+	OUT wal_fpi bigint,
+	OUT wal_bytes numeric,
+	OUT plans bigint,
+	OUT custom_plans bigint,
+	OUT total_plan_time double precision,
+	OUT min_plan_time double precision,
+	OUT max_plan_time double precision,
+	OUT scan_time double precision,
+	OUT join_time double precision,
+	OUT upper_time double precision,
+	OUT create_time double precision,
+	OUT join_searches bigint,
+	OUT geqo_searches bigint,
+	OUT joinrels bigint,
+	OUT join_pairs bigint,
+	OUT base_paths bigint,
+	OUT join_paths bigint,
+	OUT upper_paths bigint,
+	OUT parallel_workers bigint,
+	OUT worker_time double precision,
+	OUT worker_function_calls bigint,
+	OUT worker_plpgsql_statements bigint,
+	OUT total_cost double precision,
+	OUT jit_calls bigint,
+	OUT jit_inlined_calls bigint,
+	OUT jit_optimized_calls bigint,
+	OUT jit_functions bigint,
+	OUT jit_generation_time double precision,
+	OUT jit_inlining_time double precision,
+	OUT jit_optimization_time double precision,
+	OUT jit_emission_time double precision,
+	OUT jit_exec_time double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_queries'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION all_hooks_queries_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_queries_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_queries_reset() FROM PUBLIC;
+
+CREATE VIEW all_hooks_query_stats AS
+	SELECT q.queryid,
+		   r.rolname,
+		   d.datname,
+		   q.calls,
+		   q.rows,
+		   q.total_time,
+		   q.total_time / q.calls AS mean_time,
+		   q.min_time,
+		   q.max_time,
+		   q.shared_blks_hit,
+		   q.shared_blks_read,
+		   q.shared_blks_dirtied,
+		   q.shared_blks_written,
+		   q.local_blks_hit,
+		   q.local_blks_read,
+		   q.temp_blks_read,
+		   q.temp_blks_written,
+		   q.wal_records,
+		   q.wal_fpi,
+		   q.wal_bytes,
+		   q.plans,
+		   q.custom_plans,
+		   q.total_plan_time,
+		   q.min_plan_time,
+		   q.max_plan_time,
+		   q.scan_time,
+		   q.join_time,
+		   q.upper_time,
+		   q.create_time,
+		   q.join_searches,
+		   q.geqo_searches,
+		   q.joinrels,
+		   q.join_pairs,
+		   q.base_paths,
+		   q.join_paths,
+		   q.upper_paths,
+		   q.parallel_workers,
+		   q.worker_time,
+		   q.worker_function_calls,
+		   q.worker_plpgsql_statements,
+		   q.total_cost / q.calls AS mean_cost,
+		   q.jit_calls,
+		   q.jit_functions,
+		   q.jit_generation_time + q.jit_inlining_time +
+			   q.jit_optimization_time + q.jit_emission_time AS jit_time
+	FROM all_hooks_queries() q
+		LEFT JOIN pg_roles r ON r.oid = q.userid
+		LEFT JOIN pg_database d ON d.oid = q.dbid;
+
+-- statements spending more time in the planner than in the executor; the
+-- plan cache tries 5 custom plans before considering a generic one, past that
+-- a statement still replanned each time is a replan storm
+CREATE VIEW all_hooks_planner_stats AS
+	SELECT q.queryid,
+		   q.rolname,
+		   q.datname,
+		   q.plans,
+		   q.custom_plans,
+		   q.calls,
+		   q.total_plan_time,
+		   q.total_plan_time / nullif(q.plans, 0) AS mean_plan_time,
+		   q.max_plan_time,
+		   q.total_time AS total_exec_time,
+		   q.total_plan_time / nullif(q.total_time, 0) AS plan_exec_ratio,
+		   q.custom_plans > 5 AND q.custom_plans >= 0.9 * q.plans AS replanning,
+		   CASE
+			   WHEN q.custom_plans > 5 AND q.custom_plans >= 0.9 * q.plans
+				AND q.total_plan_time > q.total_time
+			   THEN 'plan_cache_mode = force_generic_plan'
+		   END AS suggestion
+	FROM all_hooks_query_stats q
+	WHERE q.plans > 0;
+
+-- where the planning time goes, per plan: a join search taking most of it
+-- over many joinrels calls for a lower join_collapse_limit or geqo_threshold,
+-- a cheap GEQO search for a higher geqo_threshold and exhaustive searches
+CREATE VIEW all_hooks_planner_phases AS
+	SELECT q.queryid,
+		   q.rolname,
+		   q.datname,
+		   q.plans,
+		   q.total_plan_time / q.plans AS mean_plan_time,
+		   q.scan_time / q.plans AS mean_scan_time,
+		   q.join_time / q.plans AS mean_join_time,
+		   q.upper_time / q.plans AS mean_upper_time,
+		   q.create_time / q.plans AS mean_create_time,
+		   q.join_searches::float8 / q.plans AS join_searches,
+		   q.geqo_searches::float8 / q.plans AS geqo_searches,
+		   q.joinrels::float8 / q.plans AS joinrels,
+		   q.join_pairs::float8 / q.plans AS join_pairs,
+		   q.base_paths::float8 / q.plans AS base_paths,
+		   q.join_paths::float8 / q.plans AS join_paths,
+		   q.upper_paths::float8 / q.plans AS upper_paths,
+		   CASE
+			   WHEN q.geqo_searches = 0 AND q.joinrels >= 1000 * q.plans
+				AND q.join_time >= 0.5 * q.total_plan_time
+			   THEN 'lower join_collapse_limit or geqo_threshold'
+			   WHEN q.geqo_searches > 0
+				AND q.join_time >= 0.5 * q.total_plan_time
+			   THEN 'lower geqo_effort or join_collapse_limit'
+			   WHEN q.geqo_searches > 0
+			   THEN 'raise geqo_threshold'
+		   END AS suggestion
+	FROM all_hooks_query_stats q
+	WHERE q.plans > 0;
+
+-- row estimates against actual rows, per plan node
+CREATE FUNCTION all_hooks_estimates(
+	OUT queryid bigint,
+	OUT dbid oid,
+	OUT plan_node_id integer,
+	OUT node_type text,
+	OUT relid oid,
+	OUT executions bigint,
+	OUT plan_rows double precision,
+	OUT actual_rows double precision,
+	OUT mean_qerror double precision,
+	OUT max_qerror double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_estimates'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION all_hooks_estimates_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_estimates_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_estimates_reset() FROM PUBLIC;
+
+-- worst estimates first, for the current database
+CREATE VIEW all_hooks_misestimates AS
+	SELECT e.queryid,
+		   e.plan_node_id,
+		   e.node_type,
+		   e.relid::regclass AS relation,
+		   e.executions,
+		   e.plan_rows,
+		   e.actual_rows,
+		   e.mean_qerror,
+		   e.max_qerror
+	FROM all_hooks_estimates() e
+	WHERE e.dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+	ORDER BY e.mean_qerror DESC;
+
+-- filters and joins per table column, for the index advisor
+CREATE FUNCTION all_hooks_columns(
+	OUT dbid oid,
+	OUT relid oid,
+	OUT attnum smallint,
+	OUT eq_filters bigint,
+	OUT range_filters bigint,
+	OUT joins bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_columns'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION all_hooks_columns_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_columns_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_columns_reset() FROM PUBLIC;
+
+CREATE VIEW all_hooks_column_stats AS
+	SELECT c.relid::regclass AS relation,
+		   a.attname,
+		   c.eq_filters,
+		   c.range_filters,
+		   c.joins
+	FROM all_hooks_columns() c
+		JOIN pg_attribute a ON a.attrelid = c.relid AND a.attnum = c.attnum
+	WHERE c.dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+	ORDER BY c.eq_filters + c.range_filters + c.joins DESC;
+
+-- cost of a statement with a hypothetical index on each candidate column
+CREATE FUNCTION all_hooks_index_advice(
+	query text,
+	OUT relid regclass,
+	OUT attname text,
+	OUT filters bigint,
+	OUT joins bigint,
+	OUT base_cost double precision,
+	OUT index_cost double precision,
+	OUT reduction double precision,
+	OUT used boolean,
+	OUT index_def text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_index_advice'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_index_advice(text) FROM PUBLIC;
+
+-- the same for the statements of the current database taking the most
+-- execution time; the query statistics keep no text, it comes from
+-- pg_stat_statements, which shares the queryIds
+CREATE FUNCTION all_hooks_index_advice_top(
+	n integer DEFAULT 10,
+	OUT queryid bigint,
+	OUT relid regclass,
+	OUT attname text,
+	OUT filters bigint,
+	OUT joins bigint,
+	OUT base_cost double precision,
+	OUT index_cost double precision,
+	OUT reduction double precision,
+	OUT used boolean,
+	OUT index_def text
+)
+RETURNS SETOF record
+LANGUAGE plpgsql VOLATILE PARALLEL UNSAFE
+AS $$
+DECLARE
+	q record;
+BEGIN
+	IF to_regclass('pg_stat_statements') IS NULL THEN
+		RAISE EXCEPTION 'all_hooks_index_advice_top needs pg_stat_statements for the query texts';
+	END IF;
+
+	FOR q IN EXECUTE
+		'SELECT s.queryid, min(p.query) AS query
+		 FROM all_hooks_query_stats s
+			 JOIN pg_stat_statements p ON p.queryid = s.queryid
+				AND p.dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+		 WHERE s.datname = current_database()
+		 GROUP BY s.queryid
+		 ORDER BY sum(s.total_time) DESC
+		 LIMIT $1'
+		USING n
+	LOOP
+		BEGIN
+			RETURN QUERY
+				SELECT q.queryid, a.*
+				FROM all_hooks_index_advice(q.query) a;
+		EXCEPTION WHEN OTHERS THEN
+			RAISE NOTICE 'query % skipped: %', q.queryid, SQLERRM;
+		END;
+	END LOOP;
+END
+$$;
+
+REVOKE ALL ON FUNCTION all_hooks_index_advice_top(integer) FROM PUBLIC;
+
+-- shared plan cache
+CREATE FUNCTION all_hooks_plan_cache(
+	OUT queryid bigint,
+	OUT userid oid,
+	OUT dbid oid,
+	OUT hits bigint,
+	OUT plan_time double precision,
+	OUT plan_size bigint,
+	OUT valid boolean,
+	OUT query text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_plan_cache'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- query texts of every user, with their literal values
+REVOKE ALL ON FUNCTION all_hooks_plan_cache() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION all_hooks_plan_cache() TO pg_read_all_stats;
+
+CREATE FUNCTION all_hooks_plan_cache_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_plan_cache_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_plan_cache_reset() FROM PUBLIC;
+
+-- planning time saved first
+CREATE VIEW all_hooks_cached_plans AS
+	SELECT p.queryid,
+		   r.rolname,
+		   d.datname,
+		   p.hits,
+		   p.plan_time,
+		   p.hits * p.plan_time AS saved_time,
+		   p.plan_size,
+		   p.valid,
+		   p.query
+	FROM all_hooks_plan_cache() p
+		LEFT JOIN pg_roles r ON r.oid = p.userid
+		LEFT JOIN pg_database d ON d.oid = p.dbid
+	ORDER BY p.hits * p.plan_time DESC;
+
+-- client authentication
+CREATE FUNCTION all_hooks_clients(
+	OUT client_addr inet,
+	OUT attempts bigint,
+	OUT failures bigint,
+	OUT rejected bigint,
+	OUT total_auth_time double precision,
+	OUT max_auth_time double precision,
+	OUT last_failure timestamptz,
+	OUT failures_in_row integer,
+	OUT backoff_until timestamptz,
+	OUT privileged boolean
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_clients'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- client addresses are not for everyone
+REVOKE ALL ON FUNCTION all_hooks_clients() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION all_hooks_clients() TO pg_read_all_stats;
+
+CREATE FUNCTION all_hooks_clients_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_clients_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_clients_reset() FROM PUBLIC;
+
+-- noisiest addresses first
+CREATE VIEW all_hooks_client_stats AS
+	SELECT c.client_addr,
+		   c.attempts,
+		   c.failures,
+		   c.rejected,
+		   c.total_auth_time / nullif(c.attempts, 0) AS mean_auth_time,
+		   c.max_auth_time,
+		   c.last_failure,
+		   c.failures_in_row,
+		   c.backoff_until,
+		   c.privileged
+	FROM all_hooks_clients() c
+	ORDER BY c.failures + c.rejected DESC, c.attempts DESC;
+
+-- utility statements
+CREATE FUNCTION all_hooks_utility(
+	OUT dbid oid,
+	OUT command text,
+	OUT relid oid,
+	OUT calls bigint,
+	OUT toplevel_calls bigint,
+	OUT subcommand_calls bigint,
+	OUT nested_calls bigint,
+	OUT total_time double precision,
+	OUT min_time double precision,
+	OUT max_time double precision,
+	OUT lock_wait_time double precision,
+	OUT lock_waited_calls bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_utility'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION all_hooks_utility_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_utility_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_utility_reset() FROM PUBLIC;
+
+-- relation is NULL for the statements naming no single table
+CREATE VIEW all_hooks_utility_stats AS
+	SELECT d.datname,
+		   u.command,
+		   u.relid::regclass AS relation,
+		   u.calls,
+		   u.toplevel_calls,
+		   u.subcommand_calls,
+		   u.nested_calls,
+		   u.total_time,
+		   u.total_time / nullif(u.calls, 0) AS mean_time,
+		   u.min_time,
+		   u.max_time,
+		   u.lock_wait_time,
+		   100 * u.lock_wait_time / nullif(u.total_time, 0) AS lock_wait_pct,
+		   u.lock_waited_calls
+	FROM all_hooks_utility() u
+		LEFT JOIN pg_database d ON d.oid = u.dbid
+	ORDER BY u.total_time DESC;
+
+-- node statistics
+CREATE FUNCTION all_hooks_plan_nodes(
+	OUT queryid bigint,
+	OUT dbid oid,
+	OUT node_type text,
+	OUT nodes bigint,
+	OUT shared_blks_hit bigint,
+	OUT shared_blks_read bigint,
+	OUT local_blks_hit bigint,
+	OUT local_blks_read bigint,
+	OUT temp_blks_read bigint,
+	OUT temp_blks_written bigint,
+	OUT wal_bytes numeric,
+	OUT spills bigint,
+	OUT sort_methods text,
+	OUT max_batches bigint,
+	OUT peak_memory bigint,
+	OUT disk_used bigint,
+	OUT work_mem_needed bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_plan_nodes'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION all_hooks_plan_nodes_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_plan_nodes_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_plan_nodes_reset() FROM PUBLIC;
+
+CREATE VIEW all_hooks_node_stats AS
+	SELECT n.queryid,
+		   d.datname,
+		   n.node_type,
+		   n.nodes,
+		   n.shared_blks_hit,
+		   n.shared_blks_read,
+		   n.local_blks_hit,
+		   n.local_blks_read,
+		   n.temp_blks_read,
+		   n.temp_blks_written,
+		   n.wal_bytes,
+		   n.spills,
+		   n.sort_methods,
+		   n.max_batches,
+		   n.peak_memory,
+		   n.disk_used
+	FROM all_hooks_plan_nodes() n
+		LEFT JOIN pg_database d ON d.oid = n.dbid;
+
+-- nodes spilling to disk, memory in kB, most temporary blocks first
+CREATE VIEW all_hooks_spills AS
+	SELECT n.queryid,
+		   d.datname,
+		   n.node_type,
+		   n.nodes,
+		   n.spills,
+		   n.sort_methods,
+		   n.max_batches,
+		   n.peak_memory,
+		   n.disk_used,
+		   n.temp_blks_written,
+		   n.work_mem_needed,
+		   format('SET work_mem = %L',
+				  ceil(n.work_mem_needed / 1024.0)::bigint || 'MB') AS suggestion
+	FROM all_hooks_plan_nodes() n
+		LEFT JOIN pg_database d ON d.oid = n.dbid
+	WHERE n.spills > 0
+	ORDER BY n.temp_blks_written DESC;
+
+-- query memory, in kB
+CREATE FUNCTION all_hooks_memory(
+	OUT queryid bigint,
+	OUT dbid oid,
+	OUT executions bigint,
+	OUT mean_peak double precision,
+	OUT p50_peak bigint,
+	OUT p95_peak bigint,
+	OUT p99_peak bigint,
+	OUT max_peak bigint,
+	OUT mean_final double precision,
+	OUT max_final bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'all_hooks_memory'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION all_hooks_memory_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'all_hooks_memory_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION all_hooks_memory_reset() FROM PUBLIC;
+
+-- largest peaks first
+CREATE VIEW all_hooks_memory_stats AS
+	SELECT m.queryid,
+		   d.datname,
+		   m.executions,
+		   m.mean_peak,
+		   m.p50_peak,
+		   m.p95_peak,
+		   m.p99_peak,
+		   m.max_peak,
+		   m.mean_final,
+		   m.max_final
+	FROM all_hooks_memory() m
+		LEFT JOIN pg_database d ON d.oid = m.dbid
+	ORDER BY m.max_peak DESC;
+
+-- JIT: executions with it against those without it, when the plan cost
+-- varies around jit_above_cost; otherwise JIT is known to cost time only
+-- when compiling took longer than executing the compiled code
+CREATE VIEW all_hooks_jit_stats AS
+	SELECT j.queryid,
+		   j.rolname,
+		   j.datname,
+		   j.calls,
+		   j.jit_calls,
+		   j.jit_inlined_calls,
+		   j.jit_optimized_calls,
+		   j.mean_cost,
+		   j.jit_functions::float8 / j.jit_calls AS mean_functions,
+		   j.jit_time / j.jit_calls AS mean_jit_time,
+		   j.jit_exec_time / j.jit_calls AS mean_time_with_jit,
+		   j.mean_time_without_jit,
+		   CASE
+			   WHEN j.mean_time_without_jit IS NOT NULL THEN
+				   CASE WHEN j.jit_exec_time / j.jit_calls < j.mean_time_without_jit
+						THEN 'saved' ELSE 'cost' END
+			   WHEN 2 * j.jit_time > j.jit_exec_time THEN 'cost'
+		   END AS verdict
+	FROM (
+		SELECT q.queryid,
+			   r.rolname,
+			   d.datname,
+			   q.calls,
+			   q.jit_calls,
+			   q.jit_inlined_calls,
+			   q.jit_optimized_calls,
+			   q.jit_functions,
+			   q.total_cost / q.calls AS mean_cost,
+			   q.jit_generation_time + q.jit_inlining_time +
+				   q.jit_optimization_time + q.jit_emission_time AS jit_time,
+			   q.jit_exec_time,
+			   (q.total_time - q.jit_exec_time) / nullif(q.calls - q.jit_calls, 0)
+				   AS mean_time_without_jit
+		FROM all_hooks_queries() q
+			LEFT JOIN pg_roles r ON r.oid = q.userid
+			LEFT JOIN pg_database d ON d.oid = q.dbid
+		WHERE q.jit_calls > 0
+	) j
+	ORDER BY j.jit_time DESC;
+
+-- raise the thresholds above the plan cost of the queries JIT slowed down
+CREATE FUNCTION all_hooks_jit_suggestion(
+	OUT setting text,
+	OUT current_value text,
+	OUT suggested_value text,
+	OUT reason text
+)
+RETURNS SETOF record
+LANGUAGE sql
+AS $$
+	WITH s AS (
+		SELECT 'jit_above_cost' AS setting,
+			   max(mean_cost) FILTER (WHERE verdict = 'cost') AS lost_cost,
+			   count(*) FILTER (WHERE verdict = 'cost') AS lost,
+			   min(mean_cost) FILTER (WHERE verdict = 'saved') AS saved_cost,
+			   count(*) FILTER (WHERE verdict = 'saved') AS saved
+		FROM all_hooks_jit_stats
+		UNION ALL
+		SELECT 'jit_inline_above_cost',
+			   max(mean_cost) FILTER (WHERE verdict = 'cost'),
+			   count(*) FILTER (WHERE verdict = 'cost'),
+			   min(mean_cost) FILTER (WHERE verdict = 'saved'),
+			   count(*) FILTER (WHERE verdict = 'saved')
+		FROM all_hooks_jit_stats
+		WHERE jit_inlined_calls > 0
+	)
+	SELECT s.setting,
+		   current_setting(s.setting),
+		   CASE WHEN s.lost = 0 THEN current_setting(s.setting)
+				ELSE greatest(current_setting(s.setting)::float8,
+							  ceil(s.lost_cost * 1.1))::text
+		   END,
+		   CASE WHEN s.lost = 0 THEN 'no query lost time to JIT'
+				WHEN s.saved_cost <= s.lost_cost THEN
+					format('%s queries lost time up to plan cost %s, but %s saved time from cost %s',
+						   s.lost, round(s.lost_cost), s.saved, round(s.saved_cost))
+				ELSE format('%s queries lost time up to plan cost %s, %s saved time',
+							s.lost, round(s.lost_cost), s.saved)
+		   END
+	FROM s;
+$$;
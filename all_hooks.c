@@ -70,10 +70,329 @@
 // explain_validate_options
 #if PG_VERSION_NUM >= 180000
 #include "commands/explain_state.h"
+
+// EXPLAIN (HOOKS)
+#include "commands/defrem.h"
+#endif
+
+// latency histograms
+#include <math.h>
+#include "port/pg_bitutils.h"
+#include "portability/instr_time.h"
+
+// event ring buffer
+#include "funcapi.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "utils/backend_status.h"
+#include "utils/timestamp.h"
+
+// all_hooks.enabled
+#include "utils/varlena.h"
+
+// needs_fmgr_hook filter
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/pg_proc.h"
+#include "utils/hsearch.h"
+#include "utils/guc_tables.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+
+// function profiler
+#include "storage/spin.h"
+
+// query statistics
+#include "executor/instrument.h"
+#if PG_VERSION_NUM >= 160000
+#include "nodes/queryjumble.h"
+#else
+#include "utils/queryjumble.h"
+#endif
+
+// estimates
+#include "nodes/nodeFuncs.h"
+#include "parser/parsetree.h"
+
+// log shipping
+#include <fcntl.h>
+#include <unistd.h>
+#include "common/file_perm.h"
+#include "mb/pg_wchar.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/json.h"
+
+// binary trace
+#include <sys/mman.h>
+#include "all_hooks_trace.h"
+
+// sampling
+#include "common/pg_prng.h"
+
+// cost threshold
+#include <float.h>
+
+// planning phases
+#include "optimizer/geqo.h"
+#include "optimizer/paths.h"
+
+// index advisor
+#include "access/amapi.h"
+#include "access/nbtree.h"
+#include "access/table.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_index.h"
+#include "commands/defrem.h"
+#include "nodes/makefuncs.h"
+#include "optimizer/plancat.h"
+#include "tcop/tcopprot.h"
+#include "utils/fmgroids.h"
+#include "utils/rel.h"
+
+// shared plan cache
+#include "catalog/pg_type.h"
+#include "common/hashfn.h"
+#include "storage/lmgr.h"
+#include "utils/dsa.h"
+
+// client authentication
+#include "catalog/pg_authid.h"
+#include "common/ip.h"
+#include "replication/walsender.h"
+#include "utils/inet.h"
+
+// utility statistics
+#include "utils/timeout.h"
+#include "utils/wait_event.h"
+
+// node statistics
+#include "utils/tuplesort.h"
+
+// parallel workers
+#include "access/parallel.h"
+
+// JIT
+#include "jit/jit.h"
+
+// statistics file
+#include <sys/stat.h>
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+
+#if PG_VERSION_NUM < 160000
+#define InitMaterializedSRF(fcinfo, flags) SetSingleFuncCall(fcinfo, flags)
 #endif
 
 // ----------
 
+// hook identifiers, used to tag the records written in shared memory
+typedef enum AHHookId
+{
+	AH_HOOK_PLANNER = 0,
+	AH_HOOK_PROCESS_UTILITY,
+	AH_HOOK_EXECUTOR_CHECK_PERMS,
+	AH_HOOK_EXECUTOR_START,
+	AH_HOOK_EXECUTOR_RUN,
+	AH_HOOK_EXECUTOR_FINISH,
+	AH_HOOK_EXECUTOR_END,
+	AH_HOOK_FMGR,
+	AH_HOOK_NEEDS_FMGR,
+	AH_HOOK_PLPGSQL_FUNC_SETUP,
+	AH_HOOK_PLPGSQL_FUNC_BEG,
+	AH_HOOK_PLPGSQL_FUNC_END,
+	AH_HOOK_PLPGSQL_STMT_BEG,
+	AH_HOOK_PLPGSQL_STMT_END,
+	AH_HOOK_EMIT_LOG,
+	AH_HOOK_CHECK_PASSWORD,
+	AH_HOOK_CLIENT_AUTHENTICATION,
+	AH_HOOK_SHMEM_STARTUP,
+	AH_HOOK_EXPLAIN_PER_NODE,
+	AH_HOOK_EXPLAIN_PER_PLAN,
+	AH_HOOK_SET_REL_PATHLIST,
+	AH_HOOK_OBJECT_ACCESS,
+	AH_HOOK_OBJECT_ACCESS_STR,
+	AH_HOOK_EXPLAIN_GET_INDEX_NAME,
+	AH_HOOK_EXPLAIN_VALIDATE_OPTIONS,
+	AH_HOOK_JOIN_SEARCH,
+	AH_HOOK_SET_JOIN_PATHLIST,
+	AH_HOOK_CREATE_UPPER_PATHS,
+	AH_NUM_HOOKS
+} AHHookId;
+
+static const char *const ah_hook_names[AH_NUM_HOOKS] =
+{
+	"planner_hook",
+	"ProcessUtility_hook",
+	"ExecutorCheckPerms_hook",
+	"ExecutorStart_hook",
+	"ExecutorRun_hook",
+	"ExecutorFinish_hook",
+	"ExecutorEnd_hook",
+	"fmgr_hook",
+	"needs_fmgr_hook",
+	"plpgsql_func_setup",
+	"plpgsql_func_beg",
+	"plpgsql_func_end",
+	"plpgsql_stmt_beg",
+	"plpgsql_stmt_end",
+	"emit_log_hook",
+	"check_password_hook",
+	"ClientAuthentication_hook",
+	"shmem_startup_hook",
+	"explain_per_node_hook",
+	"explain_per_plan_hook",
+	"set_rel_pathlist_hook",
+	"object_access_hook",
+	"object_access_hook_str",
+	"explain_get_index_name_hook",
+	"explain_validate_options_hook",
+	"join_search_hook",
+	"set_join_pathlist_hook",
+	"create_upper_paths_hook"
+};
+
+/*
+ * Hooks are linked and unlinked by group, following all_hooks.enabled.  A
+ * disabled hook is removed from its chain, so it costs nothing at all.
+ */
+typedef enum AHHookGroup
+{
+	AH_GROUP_PLANNER = 0,
+	AH_GROUP_EXECUTOR,
+	AH_GROUP_UTILITY,
+	AH_GROUP_FMGR,
+	AH_GROUP_PLPGSQL,
+	AH_GROUP_AUTH,
+	AH_GROUP_EXPLAIN,
+	AH_GROUP_OBJECT_ACCESS,
+	AH_GROUP_EMIT_LOG,
+	AH_NUM_GROUPS
+} AHHookGroup;
+
+static const char *const ah_group_names[AH_NUM_GROUPS] =
+{
+	"planner",
+	"executor",
+	"utility",
+	"fmgr",
+	"plpgsql",
+	"auth",
+	"explain",
+	"object_access",
+	"emit_log"
+};
+
+#define AH_ALL_GROUPS	((1 << AH_NUM_GROUPS) - 1)
+
+static char *ah_enabled_string = NULL;
+// true while our function is linked in the given hook chain
+static bool ah_linked[AH_NUM_HOOKS];
+// groups to link at the end of the transaction, -1 if none
+static int	ah_pending_groups = -1;
+
+static bool ah_check_enabled(char **newval, void **extra, GucSource source);
+static void ah_assign_enabled(const char *newval, void *extra);
+static void ah_switch_group(int group, bool enable);
+static void ah_enabled_xact_callback(XactEvent event, void *arg);
+
+// named LWLock tranche, one lock per shared structure
+#define AH_LWLOCK_TRANCHE	"all_hooks"
+#define AH_LWLOCK_EVENTS	0
+#define AH_LWLOCK_FUNCTIONS	1
+#define AH_LWLOCK_STATEMENTS	2
+#define AH_LWLOCK_QUERIES	3
+#define AH_LWLOCK_ESTIMATES	4
+#define AH_LWLOCK_COLUMNS	5
+#define AH_LWLOCK_PLANS		6
+#define AH_LWLOCK_CLIENTS	7
+#define AH_LWLOCK_UTILITY	8
+#define AH_LWLOCK_NODES		9
+#define AH_LWLOCK_MEMORY	10
+#define AH_NUM_LWLOCKS		11
+
+// true when loaded through shared_preload_libraries
+static bool ah_shmem_enabled = false;
+
+// shmem_request
+static shmem_request_hook_type ah_original_shmem_request_hook = NULL;
+static void ah_shmem_request_hook(void);
+
+/*
+ * Event ring buffer.
+ *
+ * Every hook appends a fixed-size record to a multi-producer ring buffer in
+ * shared memory: a producer claims a position with a single atomic increment
+ * of head, then publishes its slot seqlock-style through the slot's seq
+ * (0 while written, position + 1 once complete).  Readers drain from tail
+ * under the ring lock and discard slots overwritten in the meantime, so a
+ * slow reader only loses the oldest events.
+ */
+typedef struct AHEvent
+{
+	pg_atomic_uint64 seq;
+	TimestampTz ts;
+	uint64		queryid;
+	int32		pid;
+	Oid			objid;
+	uint16		hook;
+} AHEvent;
+
+typedef struct AHEventRing
+{
+	pg_atomic_uint64 head;		// next position to claim
+	uint64		tail;			// next position to drain, under lock
+	uint64		dropped;		// events lost to overwrite, under lock
+	LWLock	   *lock;
+	AHEvent		events[FLEXIBLE_ARRAY_MEMBER];
+} AHEventRing;
+
+static int	ah_event_buffer_size = 65536;
+static AHEventRing *ah_events = NULL;
+
+PG_FUNCTION_INFO_V1(all_hooks_events);
+PG_FUNCTION_INFO_V1(all_hooks_events_dropped);
+
+/*
+ * Latency histograms.
+ *
+ * One log-linear histogram per hook, in nanoseconds: values below
+ * AH_HIST_SUB_COUNT get their own bucket, larger ones are split into
+ * AH_HIST_SUB_COUNT linear sub-buckets per power of two, which bounds the
+ * relative error of a percentile to 1 / AH_HIST_SUB_COUNT.  Every counter is
+ * an atomic, so concurrent backends never wait on each other.
+ */
+#define AH_HIST_SUB_BITS	5
+#define AH_HIST_SUB_COUNT	(1 << AH_HIST_SUB_BITS)
+#define AH_HIST_BUCKETS		((64 - AH_HIST_SUB_BITS + 1) * AH_HIST_SUB_COUNT)
+
+typedef struct AHHistogram
+{
+	pg_atomic_uint64 sum;
+	pg_atomic_uint64 max;
+	pg_atomic_uint64 buckets[AH_HIST_BUCKETS];
+} AHHistogram;
+
+typedef struct AHLatencyStats
+{
+	AHHistogram hist[AH_NUM_HOOKS];
+} AHLatencyStats;
+
+static AHLatencyStats *ah_latency = NULL;
+
+#if PG_VERSION_NUM >= 160000
+#define AH_INSTR_TIME_GET_NANOSEC(t) INSTR_TIME_GET_NANOSEC(t)
+#else
+#define AH_INSTR_TIME_GET_NANOSEC(t) (INSTR_TIME_GET_MICROSEC(t) * 1000)
+#endif
+
+PG_FUNCTION_INFO_V1(all_hooks_stats);
+PG_FUNCTION_INFO_V1(all_hooks_stats_reset);
+
 
 // ExecutorEnd_hook
 static ExecutorEnd_hook_type ah_original_ExecutorEnd_hook = NULL;
@@ -87,6 +406,862 @@ void ah_fmgr_hook(FmgrHookEventType event, FmgrInfo * flinfo, Datum *arg) ;
 static needs_fmgr_hook_type ah_original_needs_fmgr_hook = NULL;
 bool ah_needs_fmgr_hook (Oid fn_oid);
 
+/*
+ * Functions routed through fmgr_hook, selected by all_hooks.trace_functions
+ * (names, schema-qualified names or oids), all_hooks.trace_schemas and
+ * all_hooks.trace_languages.  The decision is cached per backend by function
+ * oid, and the cache is dropped on any pg_proc, pg_namespace or pg_language
+ * invalidation.
+ */
+static char *ah_trace_functions = NULL;
+static char *ah_trace_schemas = NULL;
+static char *ah_trace_languages = NULL;
+
+typedef struct AHTracedFunction
+{
+	Oid			fn_oid;			// hash key
+	bool		traced;
+} AHTracedFunction;
+
+static HTAB *ah_traced_functions = NULL;
+static bool ah_traced_functions_stale = true;
+static bool ah_trace_any = false;
+
+static void ah_assign_trace(const char *newval, void *extra);
+static void ah_traced_functions_invalidate(Datum arg, int cacheid, uint32 hashvalue);
+
+/*
+ * Function profiler.
+ *
+ * fmgr_hook keeps a backend-local stack of the traced calls in progress, so
+ * that the time of a nested traced call can be taken off its caller's self
+ * time.  Results are accumulated per (database, function) in a shared hash;
+ * the lock is only taken exclusively to add a function, counters are updated
+ * under the entry's spinlock.
+ */
+#define AH_FN_MAX_DEPTH		64
+
+typedef struct AHFunctionFrame
+{
+	uint64		start;			// ns
+	uint64		child;			// ns spent in nested traced calls
+} AHFunctionFrame;
+
+static AHFunctionFrame ah_fn_stack[AH_FN_MAX_DEPTH];
+static int	ah_fn_depth = 0;
+
+typedef struct AHFunctionKey
+{
+	Oid			dbid;
+	Oid			funcid;
+} AHFunctionKey;
+
+typedef struct AHFunctionEntry
+{
+	AHFunctionKey key;			// hash key
+	slock_t		mutex;
+	int64		calls;
+	int64		aborts;
+	uint64		total;			// ns
+	uint64		self;			// ns
+	uint64		min;			// ns
+	uint64		max;			// ns
+} AHFunctionEntry;
+
+static int	ah_max_functions = 1000;
+static LWLock *ah_functions_lock = NULL;
+static HTAB *ah_functions = NULL;
+
+PG_FUNCTION_INFO_V1(all_hooks_functions);
+PG_FUNCTION_INFO_V1(all_hooks_functions_reset);
+
+/*
+ * PL/pgSQL statement profiler.
+ *
+ * func_setup allocates one slot per statement of the function in
+ * estate->plugin_info; stmt_beg/stmt_end only touch that backend-local array,
+ * and func_end flushes it into a shared hash keyed by function, line and
+ * statement type.  The array lives in the memory context of the function
+ * call: when an error ends it, a reset callback flushes the statements that
+ * had completed.  A function already running when the PL/pgSQL group was
+ * linked has no array, or the plugin_info of another plugin.
+ */
+typedef struct AHPlpgsqlStmtStats
+{
+	int32		lineno;
+	int32		cmd_type;
+	uint64		start;			// ns, 0 when not running
+	int64		calls;
+	uint64		total;			// ns
+	uint64		max;			// ns
+} AHPlpgsqlStmtStats;
+
+typedef struct AHPlpgsqlInfo
+{
+	PLpgSQL_execstate *estate;	// owner, tells our plugin_info from another's
+	void	   *chained_info;	// plugin_info of the chained plugin
+	Oid			funcid;
+	bool		ended;			// flushed by func_end
+	MemoryContextCallback abort_flush;
+	unsigned int nstatements;
+	AHPlpgsqlStmtStats stmts[FLEXIBLE_ARRAY_MEMBER];
+} AHPlpgsqlInfo;
+
+typedef struct AHStatementKey
+{
+	Oid			dbid;
+	Oid			funcid;
+	int32		lineno;
+	int32		cmd_type;
+} AHStatementKey;
+
+typedef struct AHStatementEntry
+{
+	AHStatementKey key;			// hash key
+	slock_t		mutex;
+	int64		calls;
+	uint64		total;			// ns
+	uint64		max;			// ns
+} AHStatementEntry;
+
+static int	ah_max_statements = 5000;
+static LWLock *ah_statements_lock = NULL;
+static HTAB *ah_statements = NULL;
+
+PG_FUNCTION_INFO_V1(all_hooks_plpgsql_statements);
+PG_FUNCTION_INFO_V1(all_hooks_plpgsql_statements_reset);
+
+/*
+ * Query statistics.
+ *
+ * ExecutorStart enables queryDesc->totaltime instrumentation and ExecutorEnd
+ * adds the execution to a shared hash keyed by (queryId, user, database);
+ * the planner hook adds the planning time to the same entry.
+ * As for the other tables, the lock is only taken exclusively to add an
+ * entry, and each entry has its own spinlock.
+ */
+typedef struct AHQueryKey
+{
+	uint64		queryid;
+	Oid			userid;
+	Oid			dbid;
+} AHQueryKey;
+
+typedef struct AHQueryEntry
+{
+	AHQueryKey	key;			// hash key
+	slock_t		mutex;
+	int64		calls;
+	int64		rows;
+	double		total_time;		// ms
+	double		min_time;		// ms
+	double		max_time;		// ms
+	int64		shared_blks_hit;
+	int64		shared_blks_read;
+	int64		shared_blks_dirtied;
+	int64		shared_blks_written;
+	int64		local_blks_hit;
+	int64		local_blks_read;
+	int64		temp_blks_read;
+	int64		temp_blks_written;
+	int64		wal_records;
+	int64		wal_fpi;
+	uint64		wal_bytes;
+	int64		plans;
+	int64		custom_plans;	// planned with bound parameter values
+	double		total_plan_time;	// ms
+	double		min_plan_time;	// ms
+	double		max_plan_time;	// ms
+	double		scan_time;		// ms, planning phases, see AHPlanPhases
+	double		join_time;		// ms
+	double		upper_time;		// ms
+	double		create_time;	// ms
+	int64		join_searches;
+	int64		geqo_searches;
+	int64		joinrels;
+	int64		join_pairs;
+	int64		base_paths;
+	int64		join_paths;
+	int64		upper_paths;
+	int64		parallel_workers;	// reported by the workers, see AHParallelSlot
+	double		worker_time;	// ms
+	int64		worker_function_calls;
+	int64		worker_plpgsql_statements;
+	double		total_cost;		// of the plans executed
+	int64		jit_calls;		// executions with JIT-compiled functions
+	int64		jit_inlined_calls;
+	int64		jit_optimized_calls;
+	int64		jit_functions;
+	double		jit_generation_time;	// ms
+	double		jit_inlining_time;	// ms
+	double		jit_optimization_time;	// ms
+	double		jit_emission_time;	// ms
+	double		jit_exec_time;	// ms, of the executions with JIT
+} AHQueryEntry;
+
+static int	ah_max_queries = 5000;
+static LWLock *ah_queries_lock = NULL;
+static HTAB *ah_queries = NULL;
+
+PG_FUNCTION_INFO_V1(all_hooks_queries);
+PG_FUNCTION_INFO_V1(all_hooks_queries_reset);
+
+/*
+ * Parallel workers.
+ *
+ * The library is loaded in every parallel worker too.  Core adds the buffer
+ * and WAL usage and the node instrumentation of the workers to the leader's
+ * at the end of the parallel query, so a worker does not add its execution
+ * to the query statistics.  Each leader has a slot in shared memory, indexed
+ * by its proc number: it publishes there the queryId and sampling decision
+ * of the parallel query it starts, its workers follow that decision and add
+ * their own counters to the slot when they end, and the leader moves them to
+ * its query entry in ExecutorEnd.
+ */
+typedef struct AHParallelSlot
+{
+	slock_t		mutex;
+	uint64		queryid;		// parallel query run by the leader
+	bool		sampled;		// the leader's sampling decision
+	int64		workers;
+	double		worker_time;	// ms
+	int64		function_calls;
+	int64		plpgsql_statements;
+} AHParallelSlot;
+
+#if PG_VERSION_NUM >= 170000
+#define AH_PARALLEL_MY_SLOT		MyProcNumber
+#define AH_PARALLEL_LEADER_SLOT	ParallelLeaderProcNumber
+#else
+#define AH_PARALLEL_MY_SLOT		(MyBackendId - 1)
+#define AH_PARALLEL_LEADER_SLOT	(ParallelLeaderBackendId - 1)
+#endif
+
+static AHParallelSlot *ah_parallel = NULL;	// MaxBackends slots
+
+// counters of a parallel worker, for its only query
+static uint64 ah_worker_start = 0;	// ns
+static int64 ah_worker_function_calls = 0;
+static int64 ah_worker_plpgsql_statements = 0;
+
+/*
+ * Query memory.
+ *
+ * With all_hooks.track_memory, the executor hooks read the memory allocated
+ * in the query context tree (es_query_cxt and its children) of each running
+ * query, keeping its peak: when an executor hook of any nesting level starts
+ * or ends, so that the queries run by a function sample the ones calling it.
+ * ExecutorEnd reads it a last time, before the tree is freed.  Peak and final
+ * memory are added per (queryId, database), the peaks to a log-linear
+ * histogram in kB with AH_MEM_SUB_COUNT sub-buckets per power of two.  A
+ * query whose peak reaches all_hooks.log_memory_min logs the memory of each
+ * child context.  The all_hooks.max_memory_queries entries take about 1.3 kB
+ * of shared memory each, whether tracking is on or not.
+ */
+#define AH_MEM_SUB_BITS		2
+#define AH_MEM_SUB_COUNT	(1 << AH_MEM_SUB_BITS)
+#define AH_MEM_BUCKETS		(40 * AH_MEM_SUB_COUNT)	// up to 2^40 kB
+#define AH_MEM_MAX_RUNNING	16
+
+typedef struct AHMemoryKey
+{
+	uint64		queryid;
+	Oid			dbid;
+} AHMemoryKey;
+
+typedef struct AHMemoryEntry
+{
+	AHMemoryKey key;			// hash key
+	slock_t		mutex;
+	int64		executions;
+	double		sum_peak;		// kB
+	int64		max_peak;		// kB
+	double		sum_final;		// kB
+	int64		max_final;		// kB
+	int64		buckets[AH_MEM_BUCKETS];	// peaks
+} AHMemoryEntry;
+
+// peak memory of a query running in this backend
+typedef struct AHMemoryPeak
+{
+	EState	   *estate;
+	Size		peak;
+	SubTransactionId subid;		// started in, its abort frees the query
+} AHMemoryPeak;
+
+static bool ah_track_memory = false;
+static int	ah_max_memory_queries = 1000;
+static int	ah_log_memory_min = -1;	// kB
+static LWLock *ah_memory_lock = NULL;
+static HTAB *ah_memory = NULL;
+static AHMemoryPeak ah_memory_peaks[AH_MEM_MAX_RUNNING];
+
+PG_FUNCTION_INFO_V1(all_hooks_memory);
+PG_FUNCTION_INFO_V1(all_hooks_memory_reset);
+
+/*
+ * Row estimates.
+ *
+ * With all_hooks.track_estimates, ExecutorStart asks for row counts on every
+ * plan node, and ExecutorEnd compares each node's estimate (plan_rows, per
+ * loop) with the rows it actually returned per loop.  The q-error,
+ * max(estimate / actual, actual / estimate), is accumulated per
+ * (queryId, database, plan node).
+ */
+typedef struct AHEstimateKey
+{
+	uint64		queryid;
+	Oid			dbid;
+	int32		plan_node_id;
+} AHEstimateKey;
+
+typedef struct AHEstimateEntry
+{
+	AHEstimateKey key;			// hash key
+	slock_t		mutex;
+	int32		node_tag;
+	Oid			relid;			// scanned relation, if any
+	int64		executions;
+	double		plan_rows;		// last estimate
+	double		actual_rows;	// last rows per loop
+	double		sum_qerror;
+	double		max_qerror;
+} AHEstimateEntry;
+
+static bool ah_track_estimates = false;
+static int	ah_max_plan_nodes = 10000;
+static LWLock *ah_estimates_lock = NULL;
+static HTAB *ah_estimates = NULL;
+
+PG_FUNCTION_INFO_V1(all_hooks_estimates);
+PG_FUNCTION_INFO_V1(all_hooks_estimates_reset);
+
+/*
+ * Node statistics.
+ *
+ * With all_hooks.track_nodes, ExecutorStart asks for buffer and WAL usage on
+ * every plan node, and ExecutorEnd adds each node's own usage (its counters
+ * minus its children's) per (queryId, database, node type), along with what
+ * EXPLAIN shows for sorts, hashes and hash aggregates: sort method, batches,
+ * peak memory and disk used.  For a node spilling to disk, work_mem_needed
+ * estimates the work_mem that would have kept it in memory.
+ */
+typedef struct AHNodeKey
+{
+	uint64		queryid;
+	Oid			dbid;
+	int32		node_tag;
+} AHNodeKey;
+
+typedef struct AHNodeEntry
+{
+	AHNodeKey	key;			// hash key
+	slock_t		mutex;
+	int64		nodes;			// executions of nodes of this type
+	int64		shared_blks_hit;
+	int64		shared_blks_read;
+	int64		local_blks_hit;
+	int64		local_blks_read;
+	int64		temp_blks_read;
+	int64		temp_blks_written;
+	uint64		wal_bytes;
+	int64		spills;			// executions on disk or in several batches
+	int32		sort_methods;	// TuplesortMethod flags seen
+	int64		max_batches;
+	int64		peak_memory;	// kB, max
+	int64		disk_used;		// kB, max
+	int64		work_mem_needed;	// kB, max
+} AHNodeEntry;
+
+// what a node reports on its memory use, for one execution
+typedef struct AHNodeSpill
+{
+	int32		sort_method;
+	int64		batches;
+	int64		memory;			// kB
+	int64		disk;			// kB
+	int64		needed;			// kB, work_mem to stay in memory, 0 if it did
+} AHNodeSpill;
+
+static bool ah_track_nodes = false;
+static LWLock *ah_nodes_lock = NULL;
+static HTAB *ah_nodes = NULL;
+
+PG_FUNCTION_INFO_V1(all_hooks_plan_nodes);
+PG_FUNCTION_INFO_V1(all_hooks_plan_nodes_reset);
+
+/*
+ * Index advisor.
+ *
+ * With all_hooks.track_columns, set_rel_pathlist_hook counts, per column of
+ * each table planned, the equality and range filters and the joins it takes
+ * part in.  all_hooks_index_advice() plans a statement once as is, then once
+ * per filtered or joined column of its tables not leading an index yet, with
+ * get_relation_info_hook adding a hypothetical single-column btree index on
+ * it.  A table OID is the OID of no index, so the hypothetical index takes
+ * the OID of its table.
+ */
+typedef struct AHColumnKey
+{
+	Oid			dbid;
+	Oid			relid;
+	AttrNumber	attnum;
+} AHColumnKey;
+
+typedef struct AHColumnEntry
+{
+	AHColumnKey key;			// hash key
+	slock_t		mutex;
+	int64		eq_filters;
+	int64		range_filters;
+	int64		joins;
+} AHColumnEntry;
+
+typedef struct AHHypoIndex
+{
+	Oid			relid;
+	AttrNumber	attnum;
+	int64		filters;
+	int64		joins;
+} AHHypoIndex;
+
+static bool ah_track_columns = false;
+static int	ah_max_columns = 10000;
+static LWLock *ah_columns_lock = NULL;
+static HTAB *ah_columns = NULL;
+
+// index added by get_relation_info_hook while the advisor plans
+static AHHypoIndex *ah_hypo_index = NULL;
+static get_relation_info_hook_type ah_original_get_relation_info_hook = NULL;
+
+PG_FUNCTION_INFO_V1(all_hooks_columns);
+PG_FUNCTION_INFO_V1(all_hooks_columns_reset);
+PG_FUNCTION_INFO_V1(all_hooks_index_advice);
+
+/*
+ * Shared plan cache.
+ *
+ * With all_hooks.plan_cache, the planner hook keeps the plans of top-level
+ * statements in a DSA area, serialized by nodeToString(), and a backend
+ * planning the same statement reads them back instead.  The same statement
+ * means the same queryId, text, cursor options, user and database, and the
+ * same search_path and planner settings.  Only plans made without parameter
+ * values are shared: a custom plan is left to the core plan cache.
+ *
+ * An entry is invalidated when a relation of its plan, or a function or type
+ * it depends on, changes: by the relcache and syscache callbacks of every
+ * backend, and by object_access_hook in the backend running the DDL.  The
+ * callbacks only flag the entry, its memory is freed by the next insert.
+ * The objects the entries depend on are summed up in a bitmap, so that the
+ * callbacks skip the other ones, and they do nothing while no backend uses
+ * the cache; the first one to use it again drops what it holds.  A full
+ * cache evicts its least used entries, as pg_stat_statements does.
+ */
+#define AH_PLAN_MAX_RELATIONS	16
+#define AH_PLAN_MAX_ITEMS		8
+#define AH_PLAN_AREA_SIZE		(1024 * 1024)	// in shared memory, grows in DSM
+#define AH_PLAN_DEPENDS_BITS	4096
+#define AH_PLAN_DEALLOC_PERCENT	5
+
+typedef struct AHPlanKey
+{
+	Oid			dbid;
+	Oid			userid;
+	uint64		queryid;
+	uint32		text_hash;
+	uint32		settings_hash;	// search_path and planner settings
+	int32		cursor_options;
+} AHPlanKey;
+
+typedef struct AHPlanEntry
+{
+	AHPlanKey	key;			// hash key
+	slock_t		mutex;
+	bool		valid;			// under the spinlock
+	dsa_pointer text;			// query text
+	dsa_pointer plan;			// nodeToString() of the PlannedStmt
+	Size		plan_size;
+	double		plan_time;		// ms, planning it
+	int64		hits;
+	int			nrelations;
+	Oid			relations[AH_PLAN_MAX_RELATIONS];
+	int			nitems;			// PlanInvalItems, functions and domains
+	int			item_cache[AH_PLAN_MAX_ITEMS];
+	uint32		item_hash[AH_PLAN_MAX_ITEMS];
+} AHPlanEntry;
+
+typedef struct AHPlanCache
+{
+	int			tranche_id;		// of the DSA area
+	pg_atomic_uint32 nentries;	// lets the callbacks skip an empty cache
+	pg_atomic_uint32 ninvalid;
+	pg_atomic_uint32 nbackends;	// with all_hooks.plan_cache on
+	// relations and PlanInvalItems of the entries, under ah_plans_lock
+	uint64		depends[AH_PLAN_DEPENDS_BITS / 64];
+	char		area[FLEXIBLE_ARRAY_MEMBER];	// dsa_create_in_place()
+} AHPlanCache;
+
+static bool ah_plan_cache = false;
+static int	ah_max_cached_plans = 1000;
+static int	ah_plan_cache_size = 64;	// MB
+static LWLock *ah_plans_lock = NULL;
+static HTAB *ah_plans = NULL;
+static AHPlanCache *ah_plan_cache_shared = NULL;
+static dsa_area *ah_plan_area = NULL;	// attached on first use
+static bool ah_plan_cache_joined = false;	// counted in nbackends
+
+static void ah_assign_plan_cache(bool newval, void *extra);
+static void ah_plan_cache_leave(int code, Datum arg);
+
+PG_FUNCTION_INFO_V1(all_hooks_plan_cache);
+PG_FUNCTION_INFO_V1(all_hooks_plan_cache_reset);
+
+/*
+ * Client authentication.
+ *
+ * ClientAuthentication_hook accounts each authentication per client address:
+ * time since the backend started, failures, and connections it rejected.
+ * Each address has a token bucket, refilled at all_hooks.auth_rate tokens
+ * per second up to all_hooks.auth_burst, and every authentication takes a
+ * token.  Each failure in a row also closes the address for a backoff,
+ * doubling from all_hooks.auth_backoff up to all_hooks.auth_backoff_max.  An
+ * address out of tokens or in backoff gets a FATAL error before the session
+ * starts.  The hook runs after the authentication exchange: a rejected
+ * client still costs a backend start, but no more.
+ *
+ * Unix socket and replication connections are counted but never rejected.
+ * Superuser and replication roles have entries of their own, so that a
+ * flood of other logins from their address does not lock them out.  A full
+ * table evicts the addresses seen least recently, those in backoff last.
+ */
+#define AH_CLIENTS_DEALLOC_PERCENT	5
+
+typedef struct AHClientKey
+{
+	char		addr[64];		// numeric host, "[local]" for Unix sockets
+	bool		privileged;		// superuser or replication role
+} AHClientKey;
+
+typedef struct AHClientEntry
+{
+	AHClientKey key;			// hash key
+	slock_t		mutex;
+	int64		attempts;
+	int64		failures;
+	int64		rejected;
+	double		total_time;		// ms, authentication latency
+	double		max_time;		// ms
+	TimestampTz last_failure;
+	int			failures_in_row;
+	TimestampTz backoff_until;
+	double		tokens;
+	TimestampTz refill_time;
+	TimestampTz last_attempt;
+} AHClientEntry;
+
+static int	ah_max_clients = 1000;
+static double ah_auth_rate = 0.0;	// tokens per second, 0 disables
+static int	ah_auth_burst = 20;
+static int	ah_auth_backoff = 0;	// ms, 0 disables
+static int	ah_auth_backoff_max = 60000;	// ms
+static LWLock *ah_clients_lock = NULL;
+static HTAB *ah_clients = NULL;
+
+PG_FUNCTION_INFO_V1(all_hooks_clients);
+PG_FUNCTION_INFO_V1(all_hooks_clients_reset);
+
+/*
+ * Utility statistics.
+ *
+ * ProcessUtility_hook accounts each utility statement per (database, command
+ * tag, relation), the relation being the one table a maintenance command
+ * (VACUUM, CREATE INDEX, ALTER TABLE, COPY...) names.  While one runs, a
+ * timeout samples the wait event of the backend every
+ * all_hooks.lock_sample_interval: the samples found waiting on a heavyweight
+ * lock make the lock wait time.  Each sample sets the latch of the backend,
+ * cutting short the naps of vacuum_cost_delay, so the sampling is off by
+ * default and no finer than AH_LOCK_SAMPLE_MIN.
+ */
+#define AH_LOCK_SAMPLE_MIN	100	// ms
+
+typedef struct AHUtilityKey
+{
+	Oid			dbid;
+	int32		tag;			// CommandTag
+	Oid			relid;
+} AHUtilityKey;
+
+typedef struct AHUtilityEntry
+{
+	AHUtilityKey key;			// hash key
+	slock_t		mutex;
+	int64		calls;
+	int64		toplevel_calls;	// PROCESS_UTILITY_TOPLEVEL
+	int64		subcommand_calls;	// PROCESS_UTILITY_SUBCOMMAND
+	int64		nested_calls;	// run by another statement
+	double		total_time;		// ms
+	double		min_time;		// ms
+	double		max_time;		// ms
+	double		lock_wait_time;	// ms, sampled
+	int64		lock_waited_calls;
+} AHUtilityEntry;
+
+static int	ah_max_utility = 1000;
+static int	ah_lock_sample_interval = 0;	// ms, 0 disables
+static LWLock *ah_utility_lock = NULL;
+static HTAB *ah_utility = NULL;
+
+static TimeoutId ah_lock_timeout = MAX_TIMEOUTS;	// registered on first use
+static int	ah_lock_sampling = 0;	// utility statements sampling
+static int	ah_lock_sampling_interval;	// ms, while sampling
+static volatile uint32 ah_lock_samples = 0;
+
+PG_FUNCTION_INFO_V1(all_hooks_utility);
+PG_FUNCTION_INFO_V1(all_hooks_utility_reset);
+
+/*
+ * Statistics file.
+ *
+ * With all_hooks.save_stats, the postmaster writes the latency histograms
+ * and the shared tables to AH_STATS_FILE when it shuts down cleanly: a
+ * header, then for each table a section header followed by its entries as
+ * they are in shared memory.  The next start maps the file, checks it and
+ * copies the entries back, then removes the file, so that a crash does not
+ * bring back older statistics.  A file of another version, with other entry
+ * sizes or a wrong checksum is ignored.  Any change to the entries must bump
+ * AH_STATS_VERSION.  The shared plan cache is not saved.  The counters of
+ * the client addresses are, but not what the limiter enforces: a restart
+ * lifts the backoffs and refills the token buckets.
+ */
+#define AH_STATS_FILE		PGSTAT_STAT_PERMANENT_DIRECTORY "/all_hooks.stat"
+#define AH_STATS_MAGIC		"AHSTATS"
+#define AH_STATS_VERSION	2
+
+typedef struct AHStatsHeader
+{
+	char		magic[8];
+	uint32		version;
+	uint32		header_size;	// sizeof(AHStatsHeader)
+	uint32		nsections;
+	pg_crc32c	crc;			// of everything after the header
+	uint64		size;			// of the file
+} AHStatsHeader;
+
+typedef struct AHStatsSection
+{
+	uint32		id;				// AHStatsTable.id
+	uint32		entry_size;
+	uint64		count;			// entries following the section header
+} AHStatsSection;
+
+// AH_STATS_LATENCY sections hold one AHHistogram per hook
+#define AH_STATS_LATENCY	1
+
+typedef struct AHStatsTable
+{
+	uint32		id;
+	HTAB	  **htab;
+	Size		entry_size;
+	Size		mutex_offset;
+	void		(*restored) (void *entry);	// fix up a loaded entry, or NULL
+} AHStatsTable;
+
+static void ah_client_restored(void *entry);
+
+static const AHStatsTable ah_stats_tables[] = {
+	{2, &ah_functions, sizeof(AHFunctionEntry), offsetof(AHFunctionEntry, mutex), NULL},
+	{3, &ah_statements, sizeof(AHStatementEntry), offsetof(AHStatementEntry, mutex), NULL},
+	{4, &ah_queries, sizeof(AHQueryEntry), offsetof(AHQueryEntry, mutex), NULL},
+	{5, &ah_estimates, sizeof(AHEstimateEntry), offsetof(AHEstimateEntry, mutex), NULL},
+	{6, &ah_nodes, sizeof(AHNodeEntry), offsetof(AHNodeEntry, mutex), NULL},
+	{7, &ah_memory, sizeof(AHMemoryEntry), offsetof(AHMemoryEntry, mutex), NULL},
+	{8, &ah_columns, sizeof(AHColumnEntry), offsetof(AHColumnEntry, mutex), NULL},
+	{9, &ah_clients, sizeof(AHClientEntry), offsetof(AHClientEntry, mutex), ah_client_restored},
+	{10, &ah_utility, sizeof(AHUtilityEntry), offsetof(AHUtilityEntry, mutex), NULL},
+};
+
+static bool ah_save_stats = true;
+
+/*
+ * Log shipping.
+ *
+ * When all_hooks.log_file is set, emit_log_hook copies a compact form of each
+ * message into a shared ring, built like the event ring, and returns.  The
+ * "all_hooks log writer" background worker drains it in batches and appends
+ * them as JSON lines to the file.  With all_hooks.log_redirect the message
+ * is not sent to the server log at all, unless the ring is full or the
+ * worker does not have the file open: it then stays in the server log.
+ * Messages the file misses are counted and the worker logs their number.
+ */
+#define AH_LOG_MESSAGE_LEN	256
+
+typedef struct AHLogRecord
+{
+	pg_atomic_uint64 seq;
+	TimestampTz ts;
+	uint64		queryid;
+	int32		pid;
+	int32		elevel;
+	int32		sqlerrcode;
+	char		message[AH_LOG_MESSAGE_LEN];
+} AHLogRecord;
+
+typedef struct AHLogRing
+{
+	pg_atomic_uint64 head;		// next position to claim
+	uint64		tail;			// next position to write, worker only
+	pg_atomic_uint64 dropped;	// records the file missed
+	pg_atomic_uint32 writing;	// 1 while the worker has the file open
+	Latch	   *worker_latch;	// set by the worker
+	AHLogRecord records[FLEXIBLE_ARRAY_MEMBER];
+} AHLogRing;
+
+static int	ah_log_buffer_size = 8192;
+static char *ah_log_file = NULL;
+static bool ah_log_redirect = false;
+static int	ah_log_flush_interval = 1000;
+static AHLogRing *ah_log = NULL;
+
+PGDLLEXPORT void all_hooks_log_worker_main(Datum main_arg);
+
+/*
+ * Binary trace.
+ *
+ * When all_hooks.trace_directory is set, each backend writes a begin and an
+ * end record around the hooks it runs to its own file, sized once from
+ * all_hooks.trace_file_size and memory-mapped, so recording is a store in
+ * memory.  The format is in all_hooks_trace.h; all_hooks_trace2json turns
+ * the files into a Chrome trace.  Recording stops when the file is full.
+ */
+#define AH_TRACE_MAX_DEPTH	64
+
+typedef struct AHTraceFrame
+{
+	AHHookId	hook;
+	int			nestlevel;		// transaction nesting level at begin
+} AHTraceFrame;
+
+static char *ah_trace_directory = NULL;
+static int	ah_trace_file_size = 32;
+static bool ah_trace_failed = false;	// open failed, until the next SET
+static AHTraceHeader *ah_trace = NULL;
+static Size ah_trace_mapped = 0;
+static uint64 ah_trace_start = 0;
+static AHTraceFrame ah_trace_stack[AH_TRACE_MAX_DEPTH];
+static int	ah_trace_depth = 0;
+
+static void ah_assign_trace_directory(const char *newval, void *extra);
+
+/*
+ * Sampling.
+ *
+ * With all_hooks.sample_rate below 1, the decision is drawn once for each
+ * top-level statement, by the first planner, utility or executor hook that
+ * runs outside any other statement, and applies to every hook nested in it.
+ * In an unsampled statement, each hook only tests ah_sampled.
+ */
+static double ah_sample_rate = 1.0;
+static bool ah_sampled = true;
+static int	ah_nesting_level = 0;
+static PlannedStmt *ah_sample_planned = NULL;	// planned by the top-level statement
+static pg_prng_state ah_sample_prng;
+static bool ah_sample_seeded = false;
+
+/*
+ * Cost threshold.
+ *
+ * A top-level statement whose plan costs less than all_hooks.min_plan_cost
+ * is handled as unsampled once planned, and the executor instruments only
+ * the queries above it.  The cost is read back from the PlannedStmt, so a
+ * cached plan gets the same decision as when it was planned.
+ */
+static double ah_min_plan_cost = 0.0;
+
+/*
+ * Planning phases of a planner call: scan paths of the base relations, join
+ * search, upper paths (grouping, sorting...) and plan creation.  The join
+ * search is timed around join_search_hook; the other phases are bounded by
+ * the first join search and the create_upper_paths_hook calls, so without a
+ * join the first upper stage counts in the scan phase.  Subqueries planned
+ * within the same call add to its phases.
+ */
+typedef struct AHPlanPhases
+{
+	uint64		start;			// ns
+	uint64		end;			// 0 while planning
+	uint64		join_start;		// first join search
+	uint64		join_end;		// last join search
+	uint64		upper_first;	// first and last create_upper_paths_hook
+	uint64		upper_last;
+	uint64		join_ns;		// time in the join searches
+	int64		join_searches;
+	int64		geqo_searches;
+	int64		joinrels;		// built by the join searches
+	int64		join_pairs;		// set_join_pathlist_hook calls
+	int64		base_paths;		// paths kept, by kind of relation
+	int64		join_paths;
+	int64		upper_paths;
+} AHPlanPhases;
+
+// phases of the innermost sampled planner call, NULL outside of planning
+static AHPlanPhases *ah_plan_phases = NULL;
+
+static join_search_hook_type ah_original_join_search_hook = NULL;
+static set_join_pathlist_hook_type ah_original_set_join_pathlist_hook = NULL;
+static create_upper_paths_hook_type ah_original_create_upper_paths_hook = NULL;
+
+/*
+ * EXPLAIN (HOOKS), PG18 and later.
+ *
+ * The option handler flags the statement being explained.  Its planning is
+ * split in phases, see AHPlanPhases, and under ANALYZE ExecutorStart puts a
+ * wrapper in front of each node's ExecProcNode to collect per-loop time and
+ * rows, and the fmgr_hook calls made while the node runs.  Those are only
+ * the calls of traced functions, see all_hooks.trace_*; untraced functions
+ * do not go through fmgr_hook.  A Hash node is run by MultiExecProcNode
+ * instead, its builds are taken from the HashJoin above it, and the calls
+ * made while hashing count for the join.  The per-node and per-plan explain
+ * hooks print them.
+ */
+#if PG_VERSION_NUM >= 180000
+typedef struct AHExplainNode
+{
+	ExecProcNodeMtd next;		// ExecProcNode we stand in front of
+	double		instr_loops;	// nloops of the node instrumentation
+	bool		in_loop;
+	double		loop_time;		// current loop, in ms
+	double		loop_rows;
+	int64		loops;
+	double		time_sum;
+	double		time_sumsq;
+	double		time_min;
+	double		time_max;
+	double		rows_sum;
+	double		rows_sumsq;
+	int64		fmgr_calls;
+} AHExplainNode;
+
+typedef struct AHExplainQuery
+{
+	EState	   *estate;
+	int			nnodes;
+	AHExplainNode nodes[FLEXIBLE_ARRAY_MEMBER];	// by plan_node_id
+} AHExplainQuery;
+
+static int	ah_explain_id = -1;
+static bool ah_explain_pending = false;	// EXPLAIN (HOOKS) parsed, not yet run
+static bool ah_explain_planning = false;
+static AHPlanPhases ah_explain_plan_phases;
+static AHExplainQuery *ah_explain_query = NULL;
+static int	ah_explain_node = -1;	// plan_node_id running
+
+static void ah_explain_hooks_handler(ExplainState *es, DefElem *opt, ParseState *pstate);
+static void ah_explain_xact_callback(XactEvent event, void *arg);
+#endif
+static void ah_trace_xact_callback(XactEvent event, void *arg);
+static void ah_trace_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+									  SubTransactionId parentSubid, void *arg);
+
 
 // PLPGSQL
 static PLpgSQL_plugin  *ah_original_plpgsql_plugin = NULL;
@@ -115,6 +1290,7 @@ static emit_log_hook_type ah_original_emit_log_hook = NULL;
 static void ah_emit_log_hook(ErrorData* );
 // antirecursion
 static bool ah_emit_log_hook_in_hook = false;
+static bool ah_emit_log_hook_warned = false;
 
 //check_password_hook
 static check_password_hook_type ah_original_check_password_hook = NULL;
@@ -189,13 +1365,10 @@ bool ah_ExecutorCheckPerms_hook (List* tableList, List* rteperminfos, bool abort
 #endif
 
 //paths_list
-#if PG_VERSION_NUM >=180000
 set_rel_pathlist_hook_type ah_original_set_rel_pathlist_hook;
 static void ah_set_rel_pathlist_hook(PlannerInfo *root, RelOptInfo *rel,
 		Index rti, RangeTblEntry *rte);
 
-#endif
-
 // ObjectAccess
 object_access_hook_type ah_original_object_access_hook ;
 static void ah_object_access_hook(ObjectAccessType access,Oid classId, Oid objectId,int subId,void *arg);
@@ -219,278 +1392,5639 @@ static void ah_explain_validate_options_hook (struct ExplainState *es,
 // ----------------------------------------
 // FUNCTIONS
 
-// planner_hook
-static PlannedStmt *
-ah_planner_hook(Query *parse, const char *query_st, int cursorOptions, ParamListInfo boundp)
+// event ring buffer
+
+static Size
+ah_events_size(void)
 {
-	PlannedStmt *result;
+	return add_size(offsetof(AHEventRing, events),
+					mul_size(ah_event_buffer_size, sizeof(AHEvent)));
+}
 
-	elog(WARNING, "planner hook called");
+/*
+ * Append one event to the shared ring buffer.  When the library was not
+ * preloaded there is no ring, and we fall back to the server log.
+ */
+static void
+ah_record_event(AHHookId hook, uint64 queryid, Oid objid)
+{
+	uint64		pos;
+	AHEvent    *ev;
 
-	if (ah_original_planner_hook){
-		result = ah_original_planner_hook(parse,query_st,cursorOptions, boundp);
-	}
-	else
+	if (ah_events == NULL)
 	{
-		result = standard_planner(parse, query_st, cursorOptions, boundp);
+		elog(WARNING, "%s called", ah_hook_names[hook]);
+		return;
 	}
-	return result;
+
+	pos = pg_atomic_fetch_add_u64(&ah_events->head, 1);
+	ev = &ah_events->events[pos % ah_event_buffer_size];
+
+	pg_atomic_write_u64(&ev->seq, 0);
+	pg_write_barrier();
+
+	ev->ts = GetCurrentTimestamp();
+	ev->queryid = queryid;
+	ev->pid = MyProcPid;
+	ev->objid = objid;
+	ev->hook = (uint16) hook;
+
+	pg_write_barrier();
+	pg_atomic_write_u64(&ev->seq, pos + 1);
 }
 
-// ProcessUtility_hook
-void ah_ProcessUtility_hook(
-	PlannedStmt *pstmt,
-	const char *queryString,
-	bool readOnlyTree,
-	ProcessUtilityContext context,
-	ParamListInfo params,
-	QueryEnvironment *queryEnv,
-	DestReceiver *dest,
-	QueryCompletion *completionTag)
+// drain the ring buffer, oldest event first
+Datum
+all_hooks_events(PG_FUNCTION_ARGS)
 {
-	elog(WARNING,"ProcessUtility hook called");
-	if (ah_original_ProcessUtility_hook)
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	uint64		head;
+	uint64		pos;
+
+	if (ah_events == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_events->lock, LW_EXCLUSIVE);
+
+	head = pg_atomic_read_u64(&ah_events->head);
+	pos = ah_events->tail;
+	if (head - pos > (uint64) ah_event_buffer_size)
 	{
-		ah_original_ProcessUtility_hook(pstmt, queryString,readOnlyTree,context,params,queryEnv,dest, completionTag);
+		ah_events->dropped += head - pos - ah_event_buffer_size;
+		pos = head - ah_event_buffer_size;
 	}
-	else
+
+	for (; pos < head; pos++)
 	{
-		standard_ProcessUtility(pstmt,queryString, readOnlyTree, context, params, queryEnv, dest, completionTag);
+		AHEvent    *ev = &ah_events->events[pos % ah_event_buffer_size];
+		AHEvent		copy;
+		uint64		seq;
+		Datum		values[5];
+		bool		nulls[5] = {0};
+
+		seq = pg_atomic_read_u64(&ev->seq);
+		pg_read_barrier();
+		copy.ts = ev->ts;
+		copy.queryid = ev->queryid;
+		copy.pid = ev->pid;
+		copy.objid = ev->objid;
+		copy.hook = ev->hook;
+		pg_read_barrier();
+
+		// still being written: stop here, the next call picks it up
+		if (seq < pos + 1)
+			break;
+		// lapped by the producers while we were reading
+		if (seq != pos + 1 || pg_atomic_read_u64(&ev->seq) != seq ||
+			copy.hook >= AH_NUM_HOOKS)
+		{
+			ah_events->dropped++;
+			continue;
+		}
+
+		values[0] = CStringGetTextDatum(ah_hook_names[copy.hook]);
+		values[1] = Int32GetDatum(copy.pid);
+		values[2] = TimestampTzGetDatum(copy.ts);
+		values[3] = Int64GetDatum((int64) copy.queryid);
+		values[4] = ObjectIdGetDatum(copy.objid);
+		if (copy.objid == InvalidOid)
+			nulls[4] = true;
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
 	}
+	ah_events->tail = pos;
+
+	LWLockRelease(ah_events->lock);
+
+	return (Datum) 0;
 }
 
-// Executor
-// executeCheckPerms_hook
-#if PG_VERSION_NUM <160000
-bool ah_ExecutorCheckPerms_hook (List* tableList, bool abort)
-#else
-bool ah_ExecutorCheckPerms_hook (List* tableList, List* rteperminfos, bool abort)
-#endif
+// number of events lost because the ring was not drained fast enough
+Datum
+all_hooks_events_dropped(PG_FUNCTION_ARGS)
 {
+	uint64		dropped;
 
-	elog(WARNING, "ExecutorCheckPerms_hook called");
+	if (ah_events == NULL)
+		PG_RETURN_NULL();
 
-	return true;
+	LWLockAcquire(ah_events->lock, LW_SHARED);
+	dropped = ah_events->dropped;
+	LWLockRelease(ah_events->lock);
+
+	PG_RETURN_INT64((int64) dropped);
 }
 
-// ExecutorStart_hook
-void ah_ExecutorStart_hook (QueryDesc *queryDesc, int eflags)
+// latency histograms
+
+static inline int
+ah_hist_bucket(uint64 value)
+{
+	int			shift;
+
+	if (value < AH_HIST_SUB_COUNT)
+		return (int) value;
+
+	shift = pg_leftmost_one_pos64(value) - AH_HIST_SUB_BITS;
+	return (shift + 1) * AH_HIST_SUB_COUNT + (int) ((value >> shift) - AH_HIST_SUB_COUNT);
+}
+
+// highest value falling in a bucket
+static uint64
+ah_hist_bucket_upper(int bucket)
+{
+	int			shift;
+
+	if (bucket < AH_HIST_SUB_COUNT)
+		return (uint64) bucket;
+
+	shift = bucket / AH_HIST_SUB_COUNT - 1;
+	return (((uint64) (AH_HIST_SUB_COUNT + bucket % AH_HIST_SUB_COUNT) + 1) << shift) - 1;
+}
+
+static void
+ah_hist_add(AHHistogram *hist, uint64 value)
 {
+	uint64		max;
 
-	elog(DEBUG1, "ExecutorStart_hook called");
+	pg_atomic_fetch_add_u64(&hist->sum, value);
+	pg_atomic_fetch_add_u64(&hist->buckets[ah_hist_bucket(value)], 1);
 
-	if (ah_original_ExecutorStart_hook)
+	max = pg_atomic_read_u64(&hist->max);
+	while (value > max)
 	{
-		ah_original_ExecutorStart_hook(queryDesc, eflags);
+		if (pg_atomic_compare_exchange_u64(&hist->max, &max, value))
+			break;
 	}
-	else
+}
+
+static void
+ah_hist_reset(AHHistogram *hist)
+{
+	pg_atomic_write_u64(&hist->sum, 0);
+	pg_atomic_write_u64(&hist->max, 0);
+	for (int i = 0; i < AH_HIST_BUCKETS; i++)
+		pg_atomic_write_u64(&hist->buckets[i], 0);
+}
+
+// value below which the given fraction of the recorded values fall
+static uint64
+ah_hist_percentile(const uint64 *buckets, uint64 count, uint64 max, double fraction)
+{
+	uint64		target = (uint64) ceil(fraction * count);
+	uint64		seen = 0;
+
+	for (int i = 0; i < AH_HIST_BUCKETS; i++)
 	{
-		standard_ExecutorStart(queryDesc, eflags);
+		seen += buckets[i];
+		if (seen >= target && seen > 0)
+			return Min(ah_hist_bucket_upper(i), max);
 	}
+	return max;
 }
 
-// ExecutorRun_hook
-void ah_ExecutorRun_hook(
-	QueryDesc *queryDesc,
-	ScanDirection direction,
-	uint64 count
-#if PG_VERSION_NUM < 180000
-	, bool execute_once
-#endif
-)
+// time elapsed since start in ns, added to the histogram of a hook
+static inline uint64
+ah_record_latency(AHHookId hook, instr_time start)
+{
+	instr_time	duration;
+	uint64		elapsed;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	elapsed = AH_INSTR_TIME_GET_NANOSEC(duration);
+
+	if (ah_latency != NULL)
+		ah_hist_add(&ah_latency->hist[hook], elapsed);
+
+	return elapsed;
+}
+
+static inline uint64
+ah_now_ns(void)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	return AH_INSTR_TIME_GET_NANOSEC(now);
+}
+
+Datum
+all_hooks_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	uint64	   *buckets;
+
+	if (ah_latency == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	buckets = palloc(sizeof(uint64) * AH_HIST_BUCKETS);
+
+	for (int hook = 0; hook < AH_NUM_HOOKS; hook++)
+	{
+		AHHistogram *hist = &ah_latency->hist[hook];
+		Datum		values[8];
+		bool		nulls[8] = {0};
+		uint64		count = 0;
+		uint64		sum;
+		uint64		max;
+
+		// the count is derived from the buckets snapshot
+		for (int i = 0; i < AH_HIST_BUCKETS; i++)
+		{
+			buckets[i] = pg_atomic_read_u64(&hist->buckets[i]);
+			count += buckets[i];
+		}
+		if (count == 0)
+			continue;
+		sum = pg_atomic_read_u64(&hist->sum);
+		max = pg_atomic_read_u64(&hist->max);
+
+		values[0] = CStringGetTextDatum(ah_hook_names[hook]);
+		values[1] = Int64GetDatum((int64) count);
+		values[2] = Float8GetDatum(sum / 1000000.0);
+		values[3] = Float8GetDatum(sum / 1000000.0 / count);
+		values[4] = Float8GetDatum(ah_hist_percentile(buckets, count, max, 0.50) / 1000000.0);
+		values[5] = Float8GetDatum(ah_hist_percentile(buckets, count, max, 0.95) / 1000000.0);
+		values[6] = Float8GetDatum(ah_hist_percentile(buckets, count, max, 0.99) / 1000000.0);
+		values[7] = Float8GetDatum(max / 1000000.0);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	pfree(buckets);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_stats_reset(PG_FUNCTION_ARGS)
+{
+	if (ah_latency == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	for (int hook = 0; hook < AH_NUM_HOOKS; hook++)
+		ah_hist_reset(&ah_latency->hist[hook]);
+
+	PG_RETURN_VOID();
+}
+
+// binary trace
+
+static void
+ah_trace_close(void)
 {
+	if (ah_trace != NULL)
+	{
+		munmap(ah_trace, ah_trace_mapped);
+		ah_trace = NULL;
+	}
+	ah_trace_depth = 0;
+}
+
+static void
+ah_trace_exit(int code, Datum arg)
+{
+	ah_trace_close();
+}
+
+// create and map the file of this backend, false if tracing is off
+static bool
+ah_trace_open(void)
+{
+	static bool exit_registered = false;
+	char	   *path;
+	Size		size;
+	uint64		capacity;
+	int			fd;
+	int			rc;
+	void	   *map;
+
+	StaticAssertStmt(AH_NUM_HOOKS <= AH_TRACE_MAX_HOOKS,
+					 "too many hooks for the trace header");
+
+	if (ah_trace_directory == NULL || ah_trace_directory[0] == '\0' ||
+		ah_trace_failed || !IsUnderPostmaster)
+		return false;
+
+	size = (Size) ah_trace_file_size * 1024 * 1024;
+	capacity = (size - sizeof(AHTraceHeader)) / sizeof(AHTraceRecord);
+	size = sizeof(AHTraceHeader) + capacity * sizeof(AHTraceRecord);
+
+	path = psprintf("%s/all_hooks_trace.%d.bin", ah_trace_directory, MyProcPid);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | PG_BINARY, pg_file_create_mode);
+	if (fd < 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not create trace file \"%s\": %m", path)));
+		ah_trace_failed = true;
+		pfree(path);
+		return false;
+	}
+
+	// allocate the blocks now, not on the first write to each page
+#ifdef HAVE_POSIX_FALLOCATE
+	rc = posix_fallocate(fd, 0, size);
+	if (rc != 0)
+		errno = rc;
+#else
+	rc = ftruncate(fd, size);
+#endif
+	map = MAP_FAILED;
+	if (rc == 0)
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not map trace file \"%s\": %m", path)));
+		close(fd);
+		ah_trace_failed = true;
+		pfree(path);
+		return false;
+	}
+	close(fd);
+	pfree(path);
+
+	ah_trace = (AHTraceHeader *) map;
+	ah_trace_mapped = size;
+	ah_trace_depth = 0;
+
+	memset(ah_trace, 0, sizeof(AHTraceHeader));
+	memcpy(ah_trace->magic, AH_TRACE_MAGIC, sizeof(AH_TRACE_MAGIC));
+	ah_trace->version = AH_TRACE_VERSION;
+	ah_trace->header_size = sizeof(AHTraceHeader);
+	ah_trace->record_size = sizeof(AHTraceRecord);
+	ah_trace->pid = MyProcPid;
+	ah_trace->capacity = capacity;
+	ah_trace->nrecords = 0;
+	ah_trace->start_time = GetCurrentTimestamp() +
+		(int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC;
+	for (int hook = 0; hook < AH_NUM_HOOKS; hook++)
+		strlcpy(ah_trace->hook_names[hook], ah_hook_names[hook], AH_TRACE_NAME_LEN);
+	ah_trace_start = ah_now_ns();
+
+	if (!exit_registered)
+	{
+		on_proc_exit(ah_trace_exit, (Datum) 0);
+		exit_registered = true;
+	}
+
+	return true;
+}
+
+static inline void
+ah_trace_write(AHHookId hook, char phase, int depth, uint64 queryid, Oid objid, int32 arg)
+{
+	uint64		n = ah_trace->nrecords;
+	AHTraceRecord *rec;
+
+	if (n >= ah_trace->capacity)
+		return;
+
+	rec = (AHTraceRecord *) ((char *) ah_trace + sizeof(AHTraceHeader)) + n;
+	rec->ts = ah_now_ns() - ah_trace_start;
+	rec->queryid = queryid;
+	rec->objid = objid;
+	rec->arg = arg;
+	rec->hook = hook;
+	rec->phase = phase;
+	rec->depth = Min(depth, PG_UINT8_MAX);
+	rec->reserved = 0;
+
+	ah_trace->nrecords = n + 1;
+}
+
+static inline void
+ah_trace_begin(AHHookId hook, uint64 queryid, Oid objid, int32 arg)
+{
+	if (ah_trace == NULL && !ah_trace_open())
+		return;
+
+	ah_trace_write(hook, AH_TRACE_BEGIN, ah_trace_depth, queryid, objid, arg);
+	if (ah_trace_depth < AH_TRACE_MAX_DEPTH)
+	{
+		ah_trace_stack[ah_trace_depth].hook = hook;
+		ah_trace_stack[ah_trace_depth].nestlevel = GetCurrentTransactionNestLevel();
+	}
+	ah_trace_depth++;
+}
+
+/*
+ * Frames left open by an error raised below them are closed here, up to
+ * the one of this hook, so that every begin record has its end.
+ */
+static inline void
+ah_trace_end(AHHookId hook, uint64 queryid, Oid objid, int32 arg)
+{
+	int			depth;
+
+	if (ah_trace == NULL)
+		return;
+
+	// no frame of this hook, its begin was not recorded
+	for (depth = Min(ah_trace_depth, AH_TRACE_MAX_DEPTH) - 1; depth >= 0; depth--)
+		if (ah_trace_stack[depth].hook == hook)
+			break;
+	if (depth < 0 && ah_trace_depth <= AH_TRACE_MAX_DEPTH)
+		return;
+
+	while (ah_trace_depth > 0)
+	{
+		AHHookId	open_hook = hook;
+
+		ah_trace_depth--;
+		if (ah_trace_depth < AH_TRACE_MAX_DEPTH)
+			open_hook = ah_trace_stack[ah_trace_depth].hook;
+		ah_trace_write(open_hook, AH_TRACE_END, ah_trace_depth, queryid, objid, arg);
+		if (open_hook == hook)
+			break;
+	}
+}
+
+// close the frames opened at nestlevel or deeper
+static void
+ah_trace_unwind(int nestlevel)
+{
+	if (ah_trace == NULL)
+		return;
+
+	while (ah_trace_depth > 0)
+	{
+		int			depth = ah_trace_depth - 1;
+
+		if (depth < AH_TRACE_MAX_DEPTH)
+		{
+			if (ah_trace_stack[depth].nestlevel < nestlevel)
+				break;
+			ah_trace_write(ah_trace_stack[depth].hook, AH_TRACE_END, depth, 0, InvalidOid, 0);
+		}
+		ah_trace_depth = depth;
+	}
+}
+
+/*
+ * The executor and utility hooks do not catch errors, their frames are
+ * closed when the (sub)transaction aborts.  A ROLLBACK run by a procedure
+ * also closes the frames of its CALL early.
+ */
+static void
+ah_trace_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+		ah_trace_unwind(0);
+}
+
+static void
+ah_trace_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						  SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		ah_trace_unwind(GetCurrentTransactionNestLevel());
+}
+
+// a new directory starts a new file
+static void
+ah_assign_trace_directory(const char *newval, void *extra)
+{
+	ah_trace_close();
+	ah_trace_failed = false;
+}
+
+// sampling
+
+// draw the decision of a new top-level statement
+static void
+ah_sample_statement(void)
+{
+	if (ah_sample_rate >= 1.0)
+		ah_sampled = true;
+	else if (ah_sample_rate <= 0.0)
+		ah_sampled = false;
+	else
+	{
+		if (!ah_sample_seeded)
+		{
+			pg_prng_seed(&ah_sample_prng,
+						 ((uint64) MyProcPid << 32) ^ (uint64) GetCurrentTimestamp());
+			ah_sample_seeded = true;
+		}
+		ah_sampled = pg_prng_double(&ah_sample_prng) < ah_sample_rate;
+	}
+}
+
+// true when the plan is worth instrumenting, utility statements always are
+static inline bool
+ah_plan_is_costly(PlannedStmt *pstmt)
+{
+	return ah_min_plan_cost <= 0.0 || pstmt == NULL || pstmt->planTree == NULL ||
+		pstmt->planTree->total_cost >= ah_min_plan_cost;
+}
+
+// query statistics
+
+/*
+ * Find or add the entry of a query for the current user and database.  It
+ * is returned with ah_queries_lock held, which the caller releases once the
+ * entry is updated; NULL when the table is full.
+ */
+static AHQueryEntry *
+ah_query_entry_lock(uint64 queryid)
+{
+	AHQueryKey	key;
+	AHQueryEntry *entry;
+	bool		found;
+
+	memset(&key, 0, sizeof(key));
+	key.queryid = queryid;
+	key.userid = GetUserId();
+	key.dbid = MyDatabaseId;
+
+	LWLockAcquire(ah_queries_lock, LW_SHARED);
+	entry = hash_search(ah_queries, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+		return entry;
+
+	LWLockRelease(ah_queries_lock);
+	LWLockAcquire(ah_queries_lock, LW_EXCLUSIVE);
+	entry = hash_search(ah_queries, &key, HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+	{
+		LWLockRelease(ah_queries_lock);
+		return NULL;
+	}
+	if (!found)
+	{
+		// zero everything but the key
+		memset((char *) entry + sizeof(AHQueryKey), 0,
+			   sizeof(AHQueryEntry) - sizeof(AHQueryKey));
+		SpinLockInit(&entry->mutex);
+	}
+
+	return entry;
+}
+
+// durations of the planning phases, in ms
+static void
+ah_plan_phases_split(const AHPlanPhases *p, double *scan, double *join,
+					 double *upper, double *create)
+{
+	uint64		scan_end;
+	uint64		upper_start;
+	uint64		upper_end;
+
+	if (p->join_searches > 0)
+		scan_end = p->join_start;
+	else if (p->upper_first != 0)
+		scan_end = p->upper_first;
+	else
+		scan_end = p->end;
+	upper_start = (p->join_searches > 0) ? p->join_end : scan_end;
+	upper_end = Max(p->upper_last, upper_start);
+
+	*scan = (scan_end - p->start) / 1000000.0;
+	*join = p->join_ns / 1000000.0;
+	*upper = (upper_end - upper_start) / 1000000.0;
+	*create = (p->end - upper_end) / 1000000.0;
+}
+
+/*
+ * The plan cache calls the planner with the parameter values for a custom
+ * plan, and without them for a generic plan or an unparameterized query.
+ */
+static void
+ah_query_plan_add(uint64 queryid, double plan_time, ParamListInfo boundParams,
+				  const AHPlanPhases *phases)
+{
+	AHQueryEntry *entry;
+	double		scan;
+	double		join;
+	double		upper;
+	double		create;
+
+	if (ah_queries == NULL || queryid == UINT64CONST(0))
+		return;
+
+	entry = ah_query_entry_lock(queryid);
+	if (entry == NULL)
+		return;
+
+	ah_plan_phases_split(phases, &scan, &join, &upper, &create);
+
+	SpinLockAcquire(&entry->mutex);
+	if (entry->plans == 0 || plan_time < entry->min_plan_time)
+		entry->min_plan_time = plan_time;
+	entry->max_plan_time = Max(entry->max_plan_time, plan_time);
+	entry->plans++;
+	if (boundParams != NULL && boundParams->numParams > 0)
+		entry->custom_plans++;
+	entry->total_plan_time += plan_time;
+	entry->scan_time += scan;
+	entry->join_time += join;
+	entry->upper_time += upper;
+	entry->create_time += create;
+	entry->join_searches += phases->join_searches;
+	entry->geqo_searches += phases->geqo_searches;
+	entry->joinrels += phases->joinrels;
+	entry->join_pairs += phases->join_pairs;
+	entry->base_paths += phases->base_paths;
+	entry->join_paths += phases->join_paths;
+	entry->upper_paths += phases->upper_paths;
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(ah_queries_lock);
+}
+
+// parallel workers
+
+// the leader starts a parallel query
+static void
+ah_parallel_begin(uint64 queryid)
+{
+	AHParallelSlot *slot;
+
+	if (ah_parallel == NULL || AH_PARALLEL_MY_SLOT < 0 || AH_PARALLEL_MY_SLOT >= MaxBackends)
+		return;
+
+	slot = &ah_parallel[AH_PARALLEL_MY_SLOT];
+	SpinLockAcquire(&slot->mutex);
+	slot->queryid = queryid;
+	slot->sampled = ah_sampled;
+	slot->workers = 0;
+	slot->worker_time = 0;
+	slot->function_calls = 0;
+	slot->plpgsql_statements = 0;
+	SpinLockRelease(&slot->mutex);
+}
+
+// a worker starts its query, sampled if its leader's is
+static bool
+ah_parallel_worker_begin(uint64 queryid)
+{
+	AHParallelSlot *slot;
+	bool		sampled;
+
+	ah_worker_start = ah_now_ns();
+	ah_worker_function_calls = 0;
+	ah_worker_plpgsql_statements = 0;
+
+	if (AH_PARALLEL_LEADER_SLOT < 0 || AH_PARALLEL_LEADER_SLOT >= MaxBackends)
+		return false;
+
+	slot = &ah_parallel[AH_PARALLEL_LEADER_SLOT];
+	SpinLockAcquire(&slot->mutex);
+	sampled = slot->sampled && slot->queryid == queryid;
+	SpinLockRelease(&slot->mutex);
+
+	return sampled;
+}
+
+static void
+ah_parallel_worker_end(uint64 queryid)
+{
+	AHParallelSlot *slot;
+
+	if (AH_PARALLEL_LEADER_SLOT < 0 || AH_PARALLEL_LEADER_SLOT >= MaxBackends)
+		return;
+
+	slot = &ah_parallel[AH_PARALLEL_LEADER_SLOT];
+	SpinLockAcquire(&slot->mutex);
+	if (slot->queryid == queryid)
+	{
+		slot->workers++;
+		slot->worker_time += (ah_now_ns() - ah_worker_start) / 1000000.0;
+		slot->function_calls += ah_worker_function_calls;
+		slot->plpgsql_statements += ah_worker_plpgsql_statements;
+	}
+	SpinLockRelease(&slot->mutex);
+}
+
+// what the workers of the leader's parallel query reported, emptying its slot
+static void
+ah_parallel_collect(uint64 queryid, AHParallelSlot *workers)
+{
+	AHParallelSlot *slot;
+
+	memset(workers, 0, sizeof(AHParallelSlot));
+	if (ah_parallel == NULL || AH_PARALLEL_MY_SLOT < 0 || AH_PARALLEL_MY_SLOT >= MaxBackends)
+		return;
+
+	slot = &ah_parallel[AH_PARALLEL_MY_SLOT];
+	SpinLockAcquire(&slot->mutex);
+	if (slot->queryid == queryid)
+	{
+		workers->workers = slot->workers;
+		workers->worker_time = slot->worker_time;
+		workers->function_calls = slot->function_calls;
+		workers->plpgsql_statements = slot->plpgsql_statements;
+		slot->queryid = UINT64CONST(0);
+	}
+	SpinLockRelease(&slot->mutex);
+}
+
+static void
+ah_query_stats_add(QueryDesc *queryDesc)
+{
+	uint64		queryid = queryDesc->plannedstmt->queryId;
+	Instrumentation *instr = queryDesc->totaltime;
+	EState	   *estate = queryDesc->estate;
+	AHQueryEntry *entry;
+	AHParallelSlot workers;
+	JitInstrumentation jit;
+	double		total_time;
+
+	if (ah_queries == NULL || queryid == UINT64CONST(0) || instr == NULL)
+		return;
+
+	// make sure the totals are up to date
+	InstrEndLoop(instr);
+	total_time = instr->total * 1000.0;
+
+	// the workers have ended, their buffers and WAL are in the totals
+	memset(&workers, 0, sizeof(workers));
+	if (queryDesc->plannedstmt->parallelModeNeeded)
+		ah_parallel_collect(queryid, &workers);
+
+	// JIT of the leader and of its workers
+	memset(&jit, 0, sizeof(jit));
+	if (estate->es_jit != NULL)
+		InstrJitAgg(&jit, &estate->es_jit->instr);
+	if (estate->es_jit_worker_instr != NULL)
+		InstrJitAgg(&jit, estate->es_jit_worker_instr);
+
+	entry = ah_query_entry_lock(queryid);
+	if (entry == NULL)
+		return;
+
+	SpinLockAcquire(&entry->mutex);
+	if (entry->calls == 0 || total_time < entry->min_time)
+		entry->min_time = total_time;
+	entry->max_time = Max(entry->max_time, total_time);
+	entry->calls++;
+	entry->rows += queryDesc->estate->es_processed;
+	entry->total_time += total_time;
+	entry->shared_blks_hit += instr->bufusage.shared_blks_hit;
+	entry->shared_blks_read += instr->bufusage.shared_blks_read;
+	entry->shared_blks_dirtied += instr->bufusage.shared_blks_dirtied;
+	entry->shared_blks_written += instr->bufusage.shared_blks_written;
+	entry->local_blks_hit += instr->bufusage.local_blks_hit;
+	entry->local_blks_read += instr->bufusage.local_blks_read;
+	entry->temp_blks_read += instr->bufusage.temp_blks_read;
+	entry->temp_blks_written += instr->bufusage.temp_blks_written;
+	entry->wal_records += instr->walusage.wal_records;
+	entry->wal_fpi += instr->walusage.wal_fpi;
+	entry->wal_bytes += instr->walusage.wal_bytes;
+	entry->parallel_workers += workers.workers;
+	entry->worker_time += workers.worker_time;
+	entry->worker_function_calls += workers.function_calls;
+	entry->worker_plpgsql_statements += workers.plpgsql_statements;
+	entry->total_cost += queryDesc->plannedstmt->planTree->total_cost;
+	if (jit.created_functions > 0)
+	{
+		entry->jit_calls++;
+		if (estate->es_jit_flags & PGJIT_INLINE)
+			entry->jit_inlined_calls++;
+		if (estate->es_jit_flags & PGJIT_OPT3)
+			entry->jit_optimized_calls++;
+		entry->jit_functions += jit.created_functions;
+		entry->jit_generation_time += INSTR_TIME_GET_MILLISEC(jit.generation_counter);
+		entry->jit_inlining_time += INSTR_TIME_GET_MILLISEC(jit.inlining_counter);
+		entry->jit_optimization_time += INSTR_TIME_GET_MILLISEC(jit.optimization_counter);
+		entry->jit_emission_time += INSTR_TIME_GET_MILLISEC(jit.emission_counter);
+		entry->jit_exec_time += total_time;
+	}
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(ah_queries_lock);
+}
+
+Datum
+all_hooks_queries(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHQueryEntry *entry;
+
+	if (ah_queries == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_queries_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_queries);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		AHQueryEntry tmp;
+		Datum		values[49];
+		bool		nulls[49] = {0};
+		int			i = 0;
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		if (tmp.calls == 0 && tmp.plans == 0)
+			continue;
+
+		values[i++] = Int64GetDatum((int64) tmp.key.queryid);
+		values[i++] = ObjectIdGetDatum(tmp.key.userid);
+		values[i++] = ObjectIdGetDatum(tmp.key.dbid);
+		values[i++] = Int64GetDatum(tmp.calls);
+		values[i++] = Int64GetDatum(tmp.rows);
+		values[i++] = Float8GetDatum(tmp.total_time);
+		values[i++] = Float8GetDatum(tmp.min_time);
+		values[i++] = Float8GetDatum(tmp.max_time);
+		values[i++] = Int64GetDatum(tmp.shared_blks_hit);
+		values[i++] = Int64GetDatum(tmp.shared_blks_read);
+		values[i++] = Int64GetDatum(tmp.shared_blks_dirtied);
+		values[i++] = Int64GetDatum(tmp.shared_blks_written);
+		values[i++] = Int64GetDatum(tmp.local_blks_hit);
+		values[i++] = Int64GetDatum(tmp.local_blks_read);
+		values[i++] = Int64GetDatum(tmp.temp_blks_read);
+		values[i++] = Int64GetDatum(tmp.temp_blks_written);
+		values[i++] = Int64GetDatum(tmp.wal_records);
+		values[i++] = Int64GetDatum(tmp.wal_fpi);
+		values[i++] = DirectFunctionCall3(numeric_in,
+										  CStringGetDatum(psprintf(UINT64_FORMAT, tmp.wal_bytes)),
+										  ObjectIdGetDatum(0),
+										  Int32GetDatum(-1));
+		values[i++] = Int64GetDatum(tmp.plans);
+		values[i++] = Int64GetDatum(tmp.custom_plans);
+		values[i++] = Float8GetDatum(tmp.total_plan_time);
+		values[i++] = Float8GetDatum(tmp.min_plan_time);
+		values[i++] = Float8GetDatum(tmp.max_plan_time);
+		values[i++] = Float8GetDatum(tmp.scan_time);
+		values[i++] = Float8GetDatum(tmp.join_time);
+		values[i++] = Float8GetDatum(tmp.upper_time);
+		values[i++] = Float8GetDatum(tmp.create_time);
+		values[i++] = Int64GetDatum(tmp.join_searches);
+		values[i++] = Int64GetDatum(tmp.geqo_searches);
+		values[i++] = Int64GetDatum(tmp.joinrels);
+		values[i++] = Int64GetDatum(tmp.join_pairs);
+		values[i++] = Int64GetDatum(tmp.base_paths);
+		values[i++] = Int64GetDatum(tmp.join_paths);
+		values[i++] = Int64GetDatum(tmp.upper_paths);
+		values[i++] = Int64GetDatum(tmp.parallel_workers);
+		values[i++] = Float8GetDatum(tmp.worker_time);
+		values[i++] = Int64GetDatum(tmp.worker_function_calls);
+		values[i++] = Int64GetDatum(tmp.worker_plpgsql_statements);
+		values[i++] = Float8GetDatum(tmp.total_cost);
+		values[i++] = Int64GetDatum(tmp.jit_calls);
+		values[i++] = Int64GetDatum(tmp.jit_inlined_calls);
+		values[i++] = Int64GetDatum(tmp.jit_optimized_calls);
+		values[i++] = Int64GetDatum(tmp.jit_functions);
+		values[i++] = Float8GetDatum(tmp.jit_generation_time);
+		values[i++] = Float8GetDatum(tmp.jit_inlining_time);
+		values[i++] = Float8GetDatum(tmp.jit_optimization_time);
+		values[i++] = Float8GetDatum(tmp.jit_emission_time);
+		values[i++] = Float8GetDatum(tmp.jit_exec_time);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_queries_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_queries_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHQueryEntry *entry;
+
+	if (ah_queries == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	LWLockAcquire(ah_queries_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, ah_queries);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(ah_queries, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(ah_queries_lock);
+
+	PG_RETURN_VOID();
+}
+
+// row estimates
+
+static const char *
+ah_plan_node_name(NodeTag tag)
+{
+	switch (tag)
+	{
+		case T_Result: return "Result";
+		case T_ProjectSet: return "ProjectSet";
+		case T_ModifyTable: return "ModifyTable";
+		case T_Append: return "Append";
+		case T_MergeAppend: return "Merge Append";
+		case T_RecursiveUnion: return "Recursive Union";
+		case T_BitmapAnd: return "BitmapAnd";
+		case T_BitmapOr: return "BitmapOr";
+		case T_SeqScan: return "Seq Scan";
+		case T_SampleScan: return "Sample Scan";
+		case T_IndexScan: return "Index Scan";
+		case T_IndexOnlyScan: return "Index Only Scan";
+		case T_BitmapIndexScan: return "Bitmap Index Scan";
+		case T_BitmapHeapScan: return "Bitmap Heap Scan";
+		case T_TidScan: return "Tid Scan";
+		case T_TidRangeScan: return "Tid Range Scan";
+		case T_SubqueryScan: return "Subquery Scan";
+		case T_FunctionScan: return "Function Scan";
+		case T_TableFuncScan: return "Table Function Scan";
+		case T_ValuesScan: return "Values Scan";
+		case T_CteScan: return "CTE Scan";
+		case T_NamedTuplestoreScan: return "Named Tuplestore Scan";
+		case T_WorkTableScan: return "WorkTable Scan";
+		case T_ForeignScan: return "Foreign Scan";
+		case T_CustomScan: return "Custom Scan";
+		case T_NestLoop: return "Nested Loop";
+		case T_MergeJoin: return "Merge Join";
+		case T_HashJoin: return "Hash Join";
+		case T_Material: return "Materialize";
+		case T_Memoize: return "Memoize";
+		case T_Sort: return "Sort";
+		case T_IncrementalSort: return "Incremental Sort";
+		case T_Group: return "Group";
+		case T_Agg: return "Aggregate";
+		case T_WindowAgg: return "WindowAgg";
+		case T_Unique: return "Unique";
+		case T_Gather: return "Gather";
+		case T_GatherMerge: return "Gather Merge";
+		case T_Hash: return "Hash";
+		case T_SetOp: return "SetOp";
+		case T_LockRows: return "LockRows";
+		case T_Limit: return "Limit";
+		default: return "???";
+	}
+}
+
+typedef struct AHEstimateContext
+{
+	uint64		queryid;
+	List	   *rtable;
+	bool		lock_held_exclusive;
+} AHEstimateContext;
+
+static void
+ah_estimate_add(AHEstimateContext *ctx, PlanState *planstate)
+{
+	Plan	   *plan = planstate->plan;
+	Instrumentation *instr = planstate->instrument;
+	AHEstimateKey key;
+	AHEstimateEntry *entry;
+	double		actual;
+	double		estimate;
+	double		qerror;
+	bool		found;
+
+	InstrEndLoop(instr);
+	if (instr->nloops <= 0)
+		return;
+
+	actual = Max(instr->ntuples / instr->nloops, 1.0);
+	estimate = Max(plan->plan_rows, 1.0);
+	qerror = Max(estimate / actual, actual / estimate);
+
+	memset(&key, 0, sizeof(key));
+	key.queryid = ctx->queryid;
+	key.dbid = MyDatabaseId;
+	key.plan_node_id = plan->plan_node_id;
+
+	entry = hash_search(ah_estimates, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		if (!ctx->lock_held_exclusive)
+		{
+			LWLockRelease(ah_estimates_lock);
+			LWLockAcquire(ah_estimates_lock, LW_EXCLUSIVE);
+			ctx->lock_held_exclusive = true;
+		}
+		entry = hash_search(ah_estimates, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+			return;
+		if (!found)
+		{
+			memset((char *) entry + sizeof(AHEstimateKey), 0,
+				   sizeof(AHEstimateEntry) - sizeof(AHEstimateKey));
+			SpinLockInit(&entry->mutex);
+			entry->node_tag = (int32) nodeTag(plan);
+			if ((IsA(plan, SeqScan) || IsA(plan, IndexScan) ||
+				 IsA(plan, IndexOnlyScan) || IsA(plan, BitmapHeapScan) ||
+				 IsA(plan, SampleScan) || IsA(plan, TidScan) ||
+				 IsA(plan, TidRangeScan)) &&
+				((Scan *) plan)->scanrelid > 0)
+				entry->relid = rt_fetch(((Scan *) plan)->scanrelid, ctx->rtable)->relid;
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->executions++;
+	entry->plan_rows = plan->plan_rows;
+	entry->actual_rows = instr->ntuples / instr->nloops;
+	entry->sum_qerror += qerror;
+	entry->max_qerror = Max(entry->max_qerror, qerror);
+	SpinLockRelease(&entry->mutex);
+}
+
+static bool
+ah_estimate_walker(PlanState *planstate, void *context)
+{
+	if (planstate->instrument != NULL)
+		ah_estimate_add((AHEstimateContext *) context, planstate);
+
+	return planstate_tree_walker(planstate, ah_estimate_walker, context);
+}
+
+static void
+ah_estimates_add(QueryDesc *queryDesc)
+{
+	AHEstimateContext ctx;
+
+	if (ah_estimates == NULL || !ah_track_estimates ||
+		queryDesc->plannedstmt->queryId == UINT64CONST(0) ||
+		queryDesc->planstate == NULL ||
+		!(queryDesc->instrument_options & INSTRUMENT_ROWS))
+		return;
+
+	ctx.queryid = queryDesc->plannedstmt->queryId;
+	ctx.rtable = queryDesc->plannedstmt->rtable;
+	ctx.lock_held_exclusive = false;
+
+	LWLockAcquire(ah_estimates_lock, LW_SHARED);
+	ah_estimate_walker(queryDesc->planstate, &ctx);
+	LWLockRelease(ah_estimates_lock);
+}
+
+Datum
+all_hooks_estimates(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHEstimateEntry *entry;
+
+	if (ah_estimates == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_estimates_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_estimates);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		AHEstimateEntry tmp;
+		Datum		values[10];
+		bool		nulls[10] = {0};
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		if (tmp.executions == 0)
+			continue;
+
+		values[0] = Int64GetDatum((int64) tmp.key.queryid);
+		values[1] = ObjectIdGetDatum(tmp.key.dbid);
+		values[2] = Int32GetDatum(tmp.key.plan_node_id);
+		values[3] = CStringGetTextDatum(ah_plan_node_name((NodeTag) tmp.node_tag));
+		values[4] = ObjectIdGetDatum(tmp.relid);
+		nulls[4] = (tmp.relid == InvalidOid);
+		values[5] = Int64GetDatum(tmp.executions);
+		values[6] = Float8GetDatum(tmp.plan_rows);
+		values[7] = Float8GetDatum(tmp.actual_rows);
+		values[8] = Float8GetDatum(tmp.sum_qerror / tmp.executions);
+		values[9] = Float8GetDatum(tmp.max_qerror);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_estimates_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_estimates_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHEstimateEntry *entry;
+
+	if (ah_estimates == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	LWLockAcquire(ah_estimates_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, ah_estimates);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(ah_estimates, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(ah_estimates_lock);
+
+	PG_RETURN_VOID();
+}
+
+// node statistics
+
+// adds the usage of the direct children of a node, not recursing
+static bool
+ah_node_children_walker(PlanState *planstate, void *context)
+{
+	static const BufferUsage no_bufusage = {0};
+	static const WalUsage no_walusage = {0};
+	Instrumentation *children = (Instrumentation *) context;
+
+	if (planstate->instrument != NULL)
+	{
+		BufferUsageAccumDiff(&children->bufusage, &planstate->instrument->bufusage, &no_bufusage);
+		WalUsageAccumDiff(&children->walusage, &planstate->instrument->walusage, &no_walusage);
+	}
+	return false;
+}
+
+// sort method, batches and memory of the nodes EXPLAIN reports them for
+static void
+ah_node_spill(PlanState *planstate, AHNodeSpill *spill)
+{
+	memset(spill, 0, sizeof(AHNodeSpill));
+
+	switch (nodeTag(planstate))
+	{
+		case T_SortState:
+			{
+				SortState  *sortstate = (SortState *) planstate;
+				TuplesortInstrumentation stats;
+
+				if (!sortstate->sort_Done || sortstate->tuplesortstate == NULL)
+					break;
+				tuplesort_get_stats((Tuplesortstate *) sortstate->tuplesortstate, &stats);
+				spill->sort_method = (int32) stats.sortMethod;
+				spill->batches = 1;
+				if (stats.spaceType == SORT_SPACE_TYPE_DISK)
+				{
+					// tuples take about twice their disk size in memory
+					spill->disk = stats.spaceUsed;
+					spill->needed = 2 * stats.spaceUsed;
+				}
+				else
+					spill->memory = stats.spaceUsed;
+			}
+			break;
+		case T_HashState:
+			{
+				HashState  *hashstate = (HashState *) planstate;
+				HashInstrumentation hinstrument = {0};
+
+				if (hashstate->hinstrument)
+					memcpy(&hinstrument, hashstate->hinstrument, sizeof(HashInstrumentation));
+				if (hashstate->shared_info)
+				{
+					for (int i = 0; i < hashstate->shared_info->num_workers; i++)
+					{
+						HashInstrumentation *worker = &hashstate->shared_info->hinstrument[i];
+
+						hinstrument.nbatch = Max(hinstrument.nbatch, worker->nbatch);
+						hinstrument.space_peak = Max(hinstrument.space_peak, worker->space_peak);
+					}
+				}
+				if (hinstrument.nbatch == 0)
+					break;
+				spill->batches = hinstrument.nbatch;
+				spill->memory = (hinstrument.space_peak + 1023) / 1024;
+				if (hinstrument.nbatch > 1)
+					spill->needed = (int64) (spill->memory * hinstrument.nbatch / hash_mem_multiplier);
+			}
+			break;
+		case T_AggState:
+			{
+				AggState   *aggstate = (AggState *) planstate;
+
+				if (aggstate->aggstrategy != AGG_HASHED &&
+					aggstate->aggstrategy != AGG_MIXED)
+					break;
+				spill->batches = aggstate->hash_batches_used;
+				spill->memory = (aggstate->hash_mem_peak + 1023) / 1024;
+				spill->disk = aggstate->hash_disk_used;
+				if (aggstate->hash_batches_used > 1 || aggstate->hash_disk_used > 0)
+					spill->needed = (int64) ((spill->memory + spill->disk) / hash_mem_multiplier);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+ah_node_add(AHEstimateContext *ctx, PlanState *planstate)
+{
+	Instrumentation *instr = planstate->instrument;
+	Instrumentation children;
+	BufferUsage bufusage;
+	WalUsage	walusage;
+	AHNodeSpill spill;
+	AHNodeKey	key;
+	AHNodeEntry *entry;
+	bool		found;
+
+	InstrEndLoop(instr);
+	if (instr->nloops <= 0)
+		return;
+
+	// the counters of a node include those of its children
+	memset(&children, 0, sizeof(children));
+	planstate_tree_walker(planstate, ah_node_children_walker, &children);
+	memset(&bufusage, 0, sizeof(bufusage));
+	BufferUsageAccumDiff(&bufusage, &instr->bufusage, &children.bufusage);
+	memset(&walusage, 0, sizeof(walusage));
+	WalUsageAccumDiff(&walusage, &instr->walusage, &children.walusage);
+
+	ah_node_spill(planstate, &spill);
+
+	memset(&key, 0, sizeof(key));
+	key.queryid = ctx->queryid;
+	key.dbid = MyDatabaseId;
+	key.node_tag = (int32) nodeTag(planstate->plan);
+
+	entry = hash_search(ah_nodes, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		if (!ctx->lock_held_exclusive)
+		{
+			LWLockRelease(ah_nodes_lock);
+			LWLockAcquire(ah_nodes_lock, LW_EXCLUSIVE);
+			ctx->lock_held_exclusive = true;
+		}
+		entry = hash_search(ah_nodes, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+			return;
+		if (!found)
+		{
+			memset((char *) entry + sizeof(AHNodeKey), 0,
+				   sizeof(AHNodeEntry) - sizeof(AHNodeKey));
+			SpinLockInit(&entry->mutex);
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->nodes++;
+	entry->shared_blks_hit += bufusage.shared_blks_hit;
+	entry->shared_blks_read += bufusage.shared_blks_read;
+	entry->local_blks_hit += bufusage.local_blks_hit;
+	entry->local_blks_read += bufusage.local_blks_read;
+	entry->temp_blks_read += bufusage.temp_blks_read;
+	entry->temp_blks_written += bufusage.temp_blks_written;
+	entry->wal_bytes += walusage.wal_bytes;
+	if (spill.needed > 0)
+		entry->spills++;
+	entry->sort_methods |= spill.sort_method;
+	entry->max_batches = Max(entry->max_batches, spill.batches);
+	entry->peak_memory = Max(entry->peak_memory, spill.memory);
+	entry->disk_used = Max(entry->disk_used, spill.disk);
+	entry->work_mem_needed = Max(entry->work_mem_needed, spill.needed);
+	SpinLockRelease(&entry->mutex);
+}
+
+static bool
+ah_node_walker(PlanState *planstate, void *context)
+{
+	if (planstate->instrument != NULL)
+		ah_node_add((AHEstimateContext *) context, planstate);
+
+	return planstate_tree_walker(planstate, ah_node_walker, context);
+}
+
+static void
+ah_nodes_add(QueryDesc *queryDesc)
+{
+	AHEstimateContext ctx;
+
+	if (ah_nodes == NULL || !ah_track_nodes ||
+		queryDesc->plannedstmt->queryId == UINT64CONST(0) ||
+		queryDesc->planstate == NULL ||
+		!(queryDesc->instrument_options & INSTRUMENT_BUFFERS))
+		return;
+
+	ctx.queryid = queryDesc->plannedstmt->queryId;
+	ctx.rtable = queryDesc->plannedstmt->rtable;
+	ctx.lock_held_exclusive = false;
+
+	LWLockAcquire(ah_nodes_lock, LW_SHARED);
+	ah_node_walker(queryDesc->planstate, &ctx);
+	LWLockRelease(ah_nodes_lock);
+}
+
+// names of the TuplesortMethod flags set, as EXPLAIN shows them
+static char *
+ah_sort_methods(int32 methods)
+{
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	for (int method = SORT_TYPE_TOP_N_HEAPSORT; method <= SORT_TYPE_EXTERNAL_MERGE; method <<= 1)
+	{
+		if (methods & method)
+			appendStringInfo(&buf, "%s%s", buf.len > 0 ? ", " : "",
+							 tuplesort_method_name((TuplesortMethod) method));
+	}
+	return buf.data;
+}
+
+Datum
+all_hooks_plan_nodes(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHNodeEntry *entry;
+
+	if (ah_nodes == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_nodes_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_nodes);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		AHNodeEntry tmp;
+		Datum		values[17];
+		bool		nulls[17] = {0};
+		int			i = 0;
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		values[i++] = Int64GetDatum((int64) tmp.key.queryid);
+		values[i++] = ObjectIdGetDatum(tmp.key.dbid);
+		values[i++] = CStringGetTextDatum(ah_plan_node_name((NodeTag) tmp.key.node_tag));
+		values[i++] = Int64GetDatum(tmp.nodes);
+		values[i++] = Int64GetDatum(tmp.shared_blks_hit);
+		values[i++] = Int64GetDatum(tmp.shared_blks_read);
+		values[i++] = Int64GetDatum(tmp.local_blks_hit);
+		values[i++] = Int64GetDatum(tmp.local_blks_read);
+		values[i++] = Int64GetDatum(tmp.temp_blks_read);
+		values[i++] = Int64GetDatum(tmp.temp_blks_written);
+		values[i++] = DirectFunctionCall3(numeric_in,
+										  CStringGetDatum(psprintf(UINT64_FORMAT, tmp.wal_bytes)),
+										  ObjectIdGetDatum(0),
+										  Int32GetDatum(-1));
+		values[i++] = Int64GetDatum(tmp.spills);
+		if (tmp.sort_methods == 0)
+			nulls[i++] = true;
+		else
+			values[i++] = CStringGetTextDatum(ah_sort_methods(tmp.sort_methods));
+		values[i++] = Int64GetDatum(tmp.max_batches);
+		values[i++] = Int64GetDatum(tmp.peak_memory);
+		values[i++] = Int64GetDatum(tmp.disk_used);
+		values[i++] = Int64GetDatum(tmp.work_mem_needed);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_nodes_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_plan_nodes_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHNodeEntry *entry;
+
+	if (ah_nodes == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	LWLockAcquire(ah_nodes_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, ah_nodes);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(ah_nodes, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(ah_nodes_lock);
+
+	PG_RETURN_VOID();
+}
+
+// query memory
+
+static int
+ah_mem_bucket(uint64 kb)
+{
+	int			shift;
+
+	if (kb < AH_MEM_SUB_COUNT)
+		return (int) kb;
+
+	shift = pg_leftmost_one_pos64(kb) - AH_MEM_SUB_BITS;
+	return Min((shift + 1) * AH_MEM_SUB_COUNT + (int) ((kb >> shift) - AH_MEM_SUB_COUNT),
+			   AH_MEM_BUCKETS - 1);
+}
+
+static uint64
+ah_mem_bucket_upper(int bucket)
+{
+	int			shift;
+
+	if (bucket < AH_MEM_SUB_COUNT)
+		return (uint64) bucket;
+
+	shift = bucket / AH_MEM_SUB_COUNT - 1;
+	return (((uint64) (AH_MEM_SUB_COUNT + bucket % AH_MEM_SUB_COUNT) + 1) << shift) - 1;
+}
+
+static int64
+ah_mem_percentile(const int64 *buckets, int64 count, int64 max, double fraction)
+{
+	int64		target = (int64) ceil(fraction * count);
+	int64		seen = 0;
+
+	for (int i = 0; i < AH_MEM_BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if (seen >= target && seen > 0)
+			return Min((int64) ah_mem_bucket_upper(i), max);
+	}
+	return max;
+}
+
+static bool
+ah_memory_tracked(QueryDesc *queryDesc)
+{
+	return ah_memory != NULL && ah_track_memory && queryDesc->estate != NULL &&
+		queryDesc->plannedstmt->queryId != UINT64CONST(0) && !IsParallelWorker();
+}
+
+// keep the peak of every query running in this backend
+static void
+ah_memory_sample_running(void)
+{
+	if (ah_memory == NULL || !ah_track_memory)
+		return;
+
+	for (int i = 0; i < AH_MEM_MAX_RUNNING; i++)
+	{
+		AHMemoryPeak *slot = &ah_memory_peaks[i];
+
+		if (slot->estate != NULL)
+			slot->peak = Max(slot->peak,
+							 MemoryContextMemAllocated(slot->estate->es_query_cxt, true));
+	}
+}
+
+// the query context is freed, whether ExecutorEnd ran or not
+static void
+ah_memory_query_freed(void *arg)
+{
+	for (int i = 0; i < AH_MEM_MAX_RUNNING; i++)
+	{
+		if (ah_memory_peaks[i].estate == (EState *) arg)
+			memset(&ah_memory_peaks[i], 0, sizeof(AHMemoryPeak));
+	}
+}
+
+// executor hook of the query: track it from its start, sample all of them
+static void
+ah_memory_sample(QueryDesc *queryDesc)
+{
+	EState	   *estate = queryDesc->estate;
+	int			free_slot = -1;
+
+	if (!ah_memory_tracked(queryDesc))
+	{
+		ah_memory_sample_running();
+		return;
+	}
+
+	for (int i = 0; i < AH_MEM_MAX_RUNNING && estate != NULL; i++)
+	{
+		if (ah_memory_peaks[i].estate == estate)
+			estate = NULL;
+		else if (free_slot < 0 && ah_memory_peaks[i].estate == NULL)
+			free_slot = i;
+	}
+
+	// too many queries running at once, the deeper ones only get ExecutorEnd
+	if (estate != NULL && free_slot >= 0)
+	{
+		MemoryContextCallback *cb;
+
+		cb = MemoryContextAlloc(estate->es_query_cxt, sizeof(MemoryContextCallback));
+		cb->func = ah_memory_query_freed;
+		cb->arg = estate;
+		MemoryContextRegisterResetCallback(estate->es_query_cxt, cb);
+
+		ah_memory_peaks[free_slot].estate = estate;
+		ah_memory_peaks[free_slot].peak = 0;
+		ah_memory_peaks[free_slot].subid = GetCurrentSubTransactionId();
+	}
+
+	ah_memory_sample_running();
+}
+
+// the memory of each child of the query context, for the log
+static void
+ah_memory_log(QueryDesc *queryDesc, Size peak)
+{
+	MemoryContext query_cxt = queryDesc->estate->es_query_cxt;
+	StringInfoData buf;
+	int			nchildren = 0;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "%s: %zu kB",
+					 query_cxt->name, MemoryContextMemAllocated(query_cxt, false) / 1024);
+	for (MemoryContext child = query_cxt->firstchild; child != NULL; child = child->nextchild)
+	{
+		if (++nchildren > 20)
+		{
+			appendStringInfoString(&buf, ", ...");
+			break;
+		}
+		appendStringInfo(&buf, ", %s: %zu kB",
+						 child->name, MemoryContextMemAllocated(child, true) / 1024);
+	}
+
+	ereport(LOG,
+			(errmsg("query %lld allocated up to %zu kB",
+					(long long) queryDesc->plannedstmt->queryId, peak / 1024),
+			 errdetail_internal("%s", buf.data)));
+	pfree(buf.data);
+}
+
+static void
+ah_memory_add(QueryDesc *queryDesc)
+{
+	AHMemoryKey key;
+	AHMemoryEntry *entry;
+	Size		final;
+	Size		peak;
+	int64		peak_kb;
+	int64		final_kb;
+
+	if (!ah_memory_tracked(queryDesc))
+		return;
+
+	// the queries calling this one see its memory too
+	ah_memory_sample_running();
+
+	final = MemoryContextMemAllocated(queryDesc->estate->es_query_cxt, true);
+	peak = final;
+	for (int i = 0; i < AH_MEM_MAX_RUNNING; i++)
+	{
+		if (ah_memory_peaks[i].estate == queryDesc->estate)
+		{
+			peak = Max(peak, ah_memory_peaks[i].peak);
+			ah_memory_peaks[i].estate = NULL;
+			break;
+		}
+	}
+	peak_kb = (int64) ((peak + 1023) / 1024);
+	final_kb = (int64) ((final + 1023) / 1024);
+
+	if (ah_log_memory_min >= 0 && peak_kb >= ah_log_memory_min)
+		ah_memory_log(queryDesc, peak);
+
+	memset(&key, 0, sizeof(key));
+	key.queryid = queryDesc->plannedstmt->queryId;
+	key.dbid = MyDatabaseId;
+
+	LWLockAcquire(ah_memory_lock, LW_SHARED);
+	entry = hash_search(ah_memory, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		bool		found;
+
+		LWLockRelease(ah_memory_lock);
+		LWLockAcquire(ah_memory_lock, LW_EXCLUSIVE);
+		entry = hash_search(ah_memory, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+		{
+			LWLockRelease(ah_memory_lock);
+			return;
+		}
+		if (!found)
+		{
+			SpinLockInit(&entry->mutex);
+			memset((char *) entry + offsetof(AHMemoryEntry, executions), 0,
+				   sizeof(AHMemoryEntry) - offsetof(AHMemoryEntry, executions));
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->executions++;
+	entry->sum_peak += peak_kb;
+	entry->max_peak = Max(entry->max_peak, peak_kb);
+	entry->sum_final += final_kb;
+	entry->max_final = Max(entry->max_final, final_kb);
+	entry->buckets[ah_mem_bucket((uint64) peak_kb)]++;
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(ah_memory_lock);
+}
+
+static void
+ah_memory_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+		memset(ah_memory_peaks, 0, sizeof(ah_memory_peaks));
+}
+
+// only the queries started in the subtransaction, or deeper, ended
+static void
+ah_memory_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						   SubTransactionId parentSubid, void *arg)
+{
+	if (event != SUBXACT_EVENT_ABORT_SUB)
+		return;
+
+	for (int i = 0; i < AH_MEM_MAX_RUNNING; i++)
+	{
+		if (ah_memory_peaks[i].estate != NULL && ah_memory_peaks[i].subid >= mySubid)
+			memset(&ah_memory_peaks[i], 0, sizeof(AHMemoryPeak));
+	}
+}
+
+Datum
+all_hooks_memory(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHMemoryEntry *entry;
+
+	if (ah_memory == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_memory_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_memory);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		AHMemoryEntry tmp;
+		Datum		values[10];
+		bool		nulls[10] = {0};
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		if (tmp.executions == 0)
+			continue;
+
+		values[0] = Int64GetDatum((int64) tmp.key.queryid);
+		values[1] = ObjectIdGetDatum(tmp.key.dbid);
+		values[2] = Int64GetDatum(tmp.executions);
+		values[3] = Float8GetDatum(tmp.sum_peak / tmp.executions);
+		values[4] = Int64GetDatum(ah_mem_percentile(tmp.buckets, tmp.executions, tmp.max_peak, 0.50));
+		values[5] = Int64GetDatum(ah_mem_percentile(tmp.buckets, tmp.executions, tmp.max_peak, 0.95));
+		values[6] = Int64GetDatum(ah_mem_percentile(tmp.buckets, tmp.executions, tmp.max_peak, 0.99));
+		values[7] = Int64GetDatum(tmp.max_peak);
+		values[8] = Float8GetDatum(tmp.sum_final / tmp.executions);
+		values[9] = Int64GetDatum(tmp.max_final);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_memory_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_memory_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHMemoryEntry *entry;
+
+	if (ah_memory == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	LWLockAcquire(ah_memory_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, ah_memory);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(ah_memory, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(ah_memory_lock);
+
+	PG_RETURN_VOID();
+}
+
+// index advisor
+
+// the column of relation rti a clause operand is, or InvalidAttrNumber
+static AttrNumber
+ah_rel_column(Node *node, Index rti)
+{
+	Var		   *var;
+
+	if (node != NULL && IsA(node, RelabelType))
+		node = (Node *) ((RelabelType *) node)->arg;
+	if (node == NULL || !IsA(node, Var))
+		return InvalidAttrNumber;
+
+	var = (Var *) node;
+	if (var->varno != rti || var->varlevelsup != 0 || var->varattno <= 0)
+		return InvalidAttrNumber;
+	return var->varattno;
+}
+
+/*
+ * The column of rti compared by a binary operator clause, with the other
+ * operand; InvalidAttrNumber for anything else.
+ */
+static AttrNumber
+ah_clause_column(Expr *clause, Index rti, Oid *opno, Node **other)
+{
+	List	   *args;
+	AttrNumber	attnum;
+
+	if (IsA(clause, OpExpr))
+	{
+		*opno = ((OpExpr *) clause)->opno;
+		args = ((OpExpr *) clause)->args;
+	}
+	else if (IsA(clause, ScalarArrayOpExpr) && ((ScalarArrayOpExpr *) clause)->useOr)
+	{
+		// col IN (...), the column is on the left
+		*opno = ((ScalarArrayOpExpr *) clause)->opno;
+		*other = lsecond(((ScalarArrayOpExpr *) clause)->args);
+		return ah_rel_column(linitial(((ScalarArrayOpExpr *) clause)->args), rti);
+	}
+	else
+		return InvalidAttrNumber;
+
+	if (list_length(args) != 2)
+		return InvalidAttrNumber;
+
+	attnum = ah_rel_column(linitial(args), rti);
+	*other = lsecond(args);
+	if (attnum == InvalidAttrNumber)
+	{
+		attnum = ah_rel_column(lsecond(args), rti);
+		*other = linitial(args);
+	}
+	return attnum;
+}
+
+static void
+ah_columns_add(PlannerInfo *root, RelOptInfo *rel, Index rti, RangeTblEntry *rte)
+{
+	int64	   *eq;
+	int64	   *range;
+	int64	   *joins;
+	bool		lock_held_exclusive = false;
+	ListCell   *lc;
+
+	if (ah_columns == NULL || rte->rtekind != RTE_RELATION ||
+		(rte->relkind != RELKIND_RELATION && rte->relkind != RELKIND_MATVIEW) ||
+		rel->max_attr <= 0)
+		return;
+
+	eq = palloc0(sizeof(int64) * (rel->max_attr + 1));
+	range = palloc0(sizeof(int64) * (rel->max_attr + 1));
+	joins = palloc0(sizeof(int64) * (rel->max_attr + 1));
+
+	// filters against constants or parameters
+	foreach(lc, rel->baserestrictinfo)
+	{
+		RestrictInfo *ri = lfirst_node(RestrictInfo, lc);
+		Oid			opno;
+		Node	   *other;
+		AttrNumber	attnum = ah_clause_column(ri->clause, rti, &opno, &other);
+		RegProcedure oprrest;
+
+		if (attnum == InvalidAttrNumber || attnum > rel->max_attr ||
+			contain_var_clause(other))
+			continue;
+
+		oprrest = get_oprrest(opno);
+		if (oprrest == F_EQSEL)
+			eq[attnum]++;
+		else if (oprrest == F_SCALARLTSEL || oprrest == F_SCALARLESEL ||
+				 oprrest == F_SCALARGTSEL || oprrest == F_SCALARGESEL)
+			range[attnum]++;
+	}
+
+	// equi-joins, merged in equivalence classes
+	if (rel->has_eclass_joins)
+	{
+		foreach(lc, root->eq_classes)
+		{
+			EquivalenceClass *ec = (EquivalenceClass *) lfirst(lc);
+			ListCell   *lc2;
+
+			if (ec->ec_has_const || !bms_is_member(rti, ec->ec_relids) ||
+				bms_membership(ec->ec_relids) != BMS_MULTIPLE)
+				continue;
+
+			foreach(lc2, ec->ec_members)
+			{
+				EquivalenceMember *em = (EquivalenceMember *) lfirst(lc2);
+				AttrNumber	attnum = ah_rel_column((Node *) em->em_expr, rti);
+
+				if (attnum != InvalidAttrNumber && attnum <= rel->max_attr)
+					joins[attnum]++;
+			}
+		}
+	}
+
+	// other join clauses
+	foreach(lc, rel->joininfo)
+	{
+		RestrictInfo *ri = lfirst_node(RestrictInfo, lc);
+		Oid			opno;
+		Node	   *other;
+		AttrNumber	attnum = ah_clause_column(ri->clause, rti, &opno, &other);
+
+		if (attnum != InvalidAttrNumber && attnum <= rel->max_attr)
+			joins[attnum]++;
+	}
+
+	LWLockAcquire(ah_columns_lock, LW_SHARED);
+	for (AttrNumber attnum = 1; attnum <= rel->max_attr; attnum++)
+	{
+		AHColumnKey key;
+		AHColumnEntry *entry;
+		bool		found;
+
+		if (eq[attnum] == 0 && range[attnum] == 0 && joins[attnum] == 0)
+			continue;
+
+		memset(&key, 0, sizeof(key));
+		key.dbid = MyDatabaseId;
+		key.relid = rte->relid;
+		key.attnum = attnum;
+
+		entry = hash_search(ah_columns, &key, HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			if (!lock_held_exclusive)
+			{
+				LWLockRelease(ah_columns_lock);
+				LWLockAcquire(ah_columns_lock, LW_EXCLUSIVE);
+				lock_held_exclusive = true;
+			}
+			entry = hash_search(ah_columns, &key, HASH_ENTER_NULL, &found);
+			if (entry == NULL)
+				break;
+			if (!found)
+			{
+				memset((char *) entry + sizeof(AHColumnKey), 0,
+					   sizeof(AHColumnEntry) - sizeof(AHColumnKey));
+				SpinLockInit(&entry->mutex);
+			}
+		}
+
+		SpinLockAcquire(&entry->mutex);
+		entry->eq_filters += eq[attnum];
+		entry->range_filters += range[attnum];
+		entry->joins += joins[attnum];
+		SpinLockRelease(&entry->mutex);
+	}
+	LWLockRelease(ah_columns_lock);
+
+	pfree(eq);
+	pfree(range);
+	pfree(joins);
+}
+
+Datum
+all_hooks_columns(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHColumnEntry *entry;
+
+	if (ah_columns == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_columns_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_columns);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		AHColumnEntry tmp;
+		Datum		values[6];
+		bool		nulls[6] = {0};
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		values[0] = ObjectIdGetDatum(tmp.key.dbid);
+		values[1] = ObjectIdGetDatum(tmp.key.relid);
+		values[2] = Int16GetDatum(tmp.key.attnum);
+		values[3] = Int64GetDatum(tmp.eq_filters);
+		values[4] = Int64GetDatum(tmp.range_filters);
+		values[5] = Int64GetDatum(tmp.joins);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_columns_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_columns_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHColumnEntry *entry;
+
+	if (ah_columns == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	LWLockAcquire(ah_columns_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, ah_columns);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(ah_columns, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(ah_columns_lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * A hypothetical btree index on one column, sized from the table's tuples
+ * and the column's average width as a freshly built index would be.
+ */
+static IndexOptInfo *
+ah_hypo_index_info(RelOptInfo *rel, AHHypoIndex *hypo)
+{
+	IndexOptInfo *index = makeNode(IndexOptInfo);
+	IndexAmRoutine *amroutine = GetIndexAmRoutineByAmId(BTREE_AM_OID, false);
+	Oid			atttype;
+	int32		atttypmod;
+	Oid			attcollation;
+	Oid			opclass;
+	int32		width;
+	double		per_page;
+
+	get_atttypetypmodcoll(hypo->relid, hypo->attnum, &atttype, &atttypmod, &attcollation);
+	opclass = GetDefaultOpClass(atttype, BTREE_AM_OID);
+
+	index->indexoid = hypo->relid;
+	index->reltablespace = rel->reltablespace;
+	index->rel = rel;
+	index->ncolumns = 1;
+	index->nkeycolumns = 1;
+	index->indexkeys = palloc(sizeof(int));
+	index->indexkeys[0] = hypo->attnum;
+	index->indexcollations = palloc(sizeof(Oid));
+	index->indexcollations[0] = attcollation;
+	index->opfamily = palloc(sizeof(Oid));
+	index->opfamily[0] = get_opclass_family(opclass);
+	index->opcintype = palloc(sizeof(Oid));
+	index->opcintype[0] = get_opclass_input_type(opclass);
+	index->sortopfamily = index->opfamily;
+	index->reverse_sort = palloc0(sizeof(bool));
+	index->nulls_first = palloc0(sizeof(bool));
+	index->canreturn = palloc(sizeof(bool));
+	index->canreturn[0] = true;
+	index->relam = BTREE_AM_OID;
+	index->indextlist = list_make1(makeTargetEntry((Expr *) makeVar(rel->relid, hypo->attnum,
+																	  atttype, atttypmod,
+																	  attcollation, 0),
+												   1, NULL, false));
+	index->immediate = true;
+	index->hypothetical = true;
+
+	index->amcanorderbyop = amroutine->amcanorderbyop;
+	index->amoptionalkey = amroutine->amoptionalkey;
+	index->amsearcharray = amroutine->amsearcharray;
+	index->amsearchnulls = amroutine->amsearchnulls;
+	index->amcanparallel = amroutine->amcanparallel;
+	index->amhasgettuple = (amroutine->amgettuple != NULL);
+	index->amhasgetbitmap = (amroutine->amgetbitmap != NULL);
+	index->amcanmarkpos = (amroutine->ammarkpos != NULL && amroutine->amrestrpos != NULL);
+	index->amcostestimate = amroutine->amcostestimate;
+
+	width = get_attavgwidth(hypo->relid, hypo->attnum);
+	if (width <= 0)
+		width = get_typavgwidth(atttype, atttypmod);
+	per_page = (BLCKSZ - SizeOfPageHeaderData - sizeof(BTPageOpaqueData)) *
+		BTREE_DEFAULT_FILLFACTOR / 100.0 /
+		(MAXALIGN(sizeof(IndexTupleData) + width) + sizeof(ItemIdData));
+
+	index->tuples = rel->tuples;
+	// leaf pages and the metapage
+	index->pages = (BlockNumber) ceil(Max(rel->tuples, 1.0) / per_page) + 1;
+	index->tree_height = (index->pages > 2) ? (int) ceil(log(index->pages - 1) / log(per_page)) : 0;
+
+	return index;
+}
+
+static void
+ah_get_relation_info_hook(PlannerInfo *root, Oid relationObjectId, bool inhparent,
+						  RelOptInfo *rel)
+{
+	if (ah_original_get_relation_info_hook)
+		ah_original_get_relation_info_hook(root, relationObjectId, inhparent, rel);
+
+	if (ah_hypo_index != NULL && !inhparent && relationObjectId == ah_hypo_index->relid)
+		rel->indexlist = lcons(ah_hypo_index_info(rel, ah_hypo_index), rel->indexlist);
+}
+
+// true if an index scan of the plan uses indexid
+static bool
+ah_plan_uses_index(Plan *plan, Oid indexid)
+{
+	List	   *children = NIL;
+	ListCell   *lc;
+
+	if (plan == NULL)
+		return false;
+
+	switch (nodeTag(plan))
+	{
+		case T_IndexScan:
+			if (((IndexScan *) plan)->indexid == indexid)
+				return true;
+			break;
+		case T_IndexOnlyScan:
+			if (((IndexOnlyScan *) plan)->indexid == indexid)
+				return true;
+			break;
+		case T_BitmapIndexScan:
+			if (((BitmapIndexScan *) plan)->indexid == indexid)
+				return true;
+			break;
+		case T_Append:
+			children = ((Append *) plan)->appendplans;
+			break;
+		case T_MergeAppend:
+			children = ((MergeAppend *) plan)->mergeplans;
+			break;
+		case T_BitmapAnd:
+			children = ((BitmapAnd *) plan)->bitmapplans;
+			break;
+		case T_BitmapOr:
+			children = ((BitmapOr *) plan)->bitmapplans;
+			break;
+		case T_SubqueryScan:
+			children = list_make1(((SubqueryScan *) plan)->subplan);
+			break;
+		case T_CustomScan:
+			children = ((CustomScan *) plan)->custom_plans;
+			break;
+		default:
+			break;
+	}
+
+	foreach(lc, children)
+		if (ah_plan_uses_index((Plan *) lfirst(lc), indexid))
+			return true;
+
+	return ah_plan_uses_index(plan->lefttree, indexid) ||
+		ah_plan_uses_index(plan->righttree, indexid);
+}
+
+// true if an existing index of the table starts with the column
+static bool
+ah_column_indexed(Oid relid, AttrNumber attnum)
+{
+	Relation	rel = table_open(relid, AccessShareLock);
+	List	   *indexes = RelationGetIndexList(rel);
+	bool		indexed = false;
+	ListCell   *lc;
+
+	foreach(lc, indexes)
+	{
+		HeapTuple	tuple = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(lfirst_oid(lc)));
+		Form_pg_index index;
+
+		if (!HeapTupleIsValid(tuple))
+			continue;
+		index = (Form_pg_index) GETSTRUCT(tuple);
+		if (index->indnatts > 0 && index->indkey.values[0] == attnum &&
+			heap_attisnull(tuple, Anum_pg_index_indpred, NULL))
+			indexed = true;
+		ReleaseSysCache(tuple);
+		if (indexed)
+			break;
+	}
+
+	list_free(indexes);
+	table_close(rel, AccessShareLock);
+
+	return indexed;
+}
+
+/*
+ * Columns of the given tables seen in filters or joins, without an index
+ * starting with them, and with a default btree operator class.
+ */
+static List *
+ah_hypo_candidates(List *relids)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHColumnEntry *entry;
+	List	   *seen = NIL;
+	List	   *candidates = NIL;
+	ListCell   *lc;
+
+	LWLockAcquire(ah_columns_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, ah_columns);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		AHHypoIndex *hypo;
+
+		if (entry->key.dbid != MyDatabaseId || !list_member_oid(relids, entry->key.relid))
+			continue;
+
+		hypo = palloc(sizeof(AHHypoIndex));
+		hypo->relid = entry->key.relid;
+		hypo->attnum = entry->key.attnum;
+		SpinLockAcquire(&entry->mutex);
+		hypo->filters = entry->eq_filters + entry->range_filters;
+		hypo->joins = entry->joins;
+		SpinLockRelease(&entry->mutex);
+		seen = lappend(seen, hypo);
+	}
+	LWLockRelease(ah_columns_lock);
+
+	// catalog lookups, out of the lock
+	foreach(lc, seen)
+	{
+		AHHypoIndex *hypo = (AHHypoIndex *) lfirst(lc);
+		Oid			atttype = get_atttype(hypo->relid, hypo->attnum);
+
+		if (atttype == InvalidOid ||
+			GetDefaultOpClass(atttype, BTREE_AM_OID) == InvalidOid ||
+			ah_column_indexed(hypo->relid, hypo->attnum))
+			continue;
+		candidates = lappend(candidates, hypo);
+	}
+
+	return candidates;
+}
+
+// a plan of a copy of the query, the planner scribbles on its input
+static PlannedStmt *
+ah_hypo_plan(Query *query, const char *query_string)
+{
+	return pg_plan_query(copyObject(query), query_string, CURSOR_OPT_PARALLEL_OK, NULL);
+}
+
+/*
+ * Plan a statement without and with each candidate index.  Parameters ($1...)
+ * get their types from the context and generic estimates, as in the texts of
+ * pg_stat_statements.  The statement is analyzed but never run; the plans do
+ * not count in the statistics.
+ */
+Datum
+all_hooks_index_advice(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	char	   *query_string = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	bool		sampled = ah_sampled;
+	List	   *raw;
+	List	   *querytrees;
+	Query	   *query;
+	Oid		   *param_types = NULL;
+	int			num_params = 0;
+
+	if (ah_columns == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	raw = pg_parse_query(query_string);
+	if (list_length(raw) != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("all_hooks_index_advice expects a single statement")));
+
+	querytrees = pg_analyze_and_rewrite_varparams(linitial_node(RawStmt, raw), query_string,
+												  &param_types, &num_params, NULL);
+	query = (list_length(querytrees) == 1) ? linitial_node(Query, querytrees) : NULL;
+	if (query == NULL || query->commandType == CMD_UTILITY)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("all_hooks_index_advice only plans SELECT, INSERT, UPDATE, DELETE and MERGE")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	ah_sampled = false;
+	ah_original_get_relation_info_hook = get_relation_info_hook;
+	get_relation_info_hook = ah_get_relation_info_hook;
+	PG_TRY();
+	{
+		PlannedStmt *plan = ah_hypo_plan(query, query_string);
+		Cost		base_cost = plan->planTree->total_cost;
+		ListCell   *lc;
+
+		foreach(lc, ah_hypo_candidates(plan->relationOids))
+		{
+			AHHypoIndex *hypo = (AHHypoIndex *) lfirst(lc);
+			char	   *attname = get_attname(hypo->relid, hypo->attnum, false);
+			Cost		cost;
+			Datum		values[9];
+			bool		nulls[9] = {0};
+
+			ah_hypo_index = hypo;
+			plan = ah_hypo_plan(query, query_string);
+			ah_hypo_index = NULL;
+			cost = plan->planTree->total_cost;
+
+			values[0] = ObjectIdGetDatum(hypo->relid);
+			values[1] = CStringGetTextDatum(attname);
+			values[2] = Int64GetDatum(hypo->filters);
+			values[3] = Int64GetDatum(hypo->joins);
+			values[4] = Float8GetDatum(base_cost);
+			values[5] = Float8GetDatum(cost);
+			values[6] = Float8GetDatum(base_cost > 0 ? 100.0 * (base_cost - cost) / base_cost : 0);
+			values[7] = BoolGetDatum(ah_plan_uses_index(plan->planTree, hypo->relid));
+			if (!DatumGetBool(values[7]))
+			{
+				ListCell   *lc2;
+
+				foreach(lc2, plan->subplans)
+					if (ah_plan_uses_index((Plan *) lfirst(lc2), hypo->relid))
+						values[7] = BoolGetDatum(true);
+			}
+			values[8] = CStringGetTextDatum(psprintf("CREATE INDEX ON %s (%s)",
+													 quote_qualified_identifier(get_namespace_name(get_rel_namespace(hypo->relid)),
+																				get_rel_name(hypo->relid)),
+													 quote_identifier(attname)));
+
+			tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+		}
+	}
+	PG_FINALLY();
+	{
+		ah_hypo_index = NULL;
+		get_relation_info_hook = ah_original_get_relation_info_hook;
+		ah_sampled = sampled;
+	}
+	PG_END_TRY();
+
+	return (Datum) 0;
+}
+
+// shared plan cache
+
+static dsa_area *
+ah_plan_cache_area(void)
+{
+	if (ah_plan_area == NULL)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		LWLockRegisterTranche(ah_plan_cache_shared->tranche_id, "all_hooks plan cache");
+		ah_plan_area = dsa_attach_in_place(ah_plan_cache_shared->area, NULL);
+		dsa_pin_mapping(ah_plan_area);
+		on_shmem_exit(dsa_on_shmem_exit_release_in_place,
+					  PointerGetDatum(ah_plan_cache_shared->area));
+		MemoryContextSwitchTo(oldcontext);
+	}
+	return ah_plan_area;
+}
+
+/*
+ * The settings a plan depends on besides the catalogs: the search_path the
+ * planner inlines SQL functions with, row_security, work_mem, and the query
+ * tuning settings that are not at their default.
+ */
+static uint32
+ah_plan_cache_settings_hash(void)
+{
+	static const char *const names[] = {"row_security", "work_mem", "hash_mem_multiplier"};
+	struct config_generic **gucs;
+	int			ngucs;
+	List	   *search_path;
+	uint32		hash = 0;
+	ListCell   *lc;
+
+	search_path = fetch_search_path(true);
+	foreach(lc, search_path)
+		hash = hash_combine(hash, hash_uint32(lfirst_oid(lc)));
+	list_free(search_path);
+
+	for (int i = 0; i < lengthof(names); i++)
+	{
+		const char *value = GetConfigOption(names[i], true, false);
+
+		if (value != NULL)
+			hash = hash_combine(hash, hash_bytes((const unsigned char *) value, strlen(value)));
+	}
+
+#if PG_VERSION_NUM >= 160000
+	gucs = get_guc_variables(&ngucs);
+#else
+	gucs = get_guc_variables();
+	ngucs = GetNumConfigOptions();
+#endif
+	for (int i = 0; i < ngucs; i++)
+	{
+		struct config_generic *conf = gucs[i];
+		char	   *value;
+
+		if (conf->source == PGC_S_DEFAULT ||
+			(conf->group != QUERY_TUNING_METHOD && conf->group != QUERY_TUNING_COST &&
+			 conf->group != QUERY_TUNING_GEQO && conf->group != QUERY_TUNING_OTHER))
+			continue;
+
+		value = GetConfigOptionByName(conf->name, NULL, true);
+		if (value == NULL)
+			continue;
+		hash = hash_combine(hash, hash_bytes((const unsigned char *) conf->name, strlen(conf->name)));
+		hash = hash_combine(hash, hash_bytes((const unsigned char *) value, strlen(value)));
+		pfree(value);
+	}
+
+	return hash;
+}
+
+// false for a statement the cache does not handle
+static bool
+ah_plan_cache_key(Query *parse, const char *query_string, int cursorOptions,
+				  ParamListInfo boundParams, AHPlanKey *key)
+{
+	// a custom plan, the values of the parameters went into it
+	if (parse->queryId == UINT64CONST(0) || query_string == NULL ||
+		parse->commandType == CMD_UTILITY ||
+		(boundParams != NULL && boundParams->numParams > 0))
+		return false;
+
+	memset(key, 0, sizeof(AHPlanKey));
+	key->dbid = MyDatabaseId;
+	key->userid = GetUserId();
+	key->queryid = parse->queryId;
+	key->text_hash = hash_bytes((const unsigned char *) query_string, strlen(query_string));
+	key->settings_hash = ah_plan_cache_settings_hash();
+	key->cursor_options = cursorOptions;
+
+	return true;
+}
+
+// the valid entry of the key for this text, under ah_plans_lock
+static AHPlanEntry *
+ah_plan_cache_find(dsa_area *area, AHPlanKey *key, const char *query_string)
+{
+	AHPlanEntry *entry = hash_search(ah_plans, key, HASH_FIND, NULL);
+	bool		valid;
+
+	if (entry == NULL)
+		return NULL;
+
+	SpinLockAcquire(&entry->mutex);
+	valid = entry->valid;
+	SpinLockRelease(&entry->mutex);
+
+	if (!valid || strcmp(dsa_get_address(area, entry->text), query_string) != 0)
+		return NULL;
+	return entry;
+}
+
+/*
+ * A copy of the cached plan, or NULL.  The relations of the plan are locked
+ * as the core plan cache does, partitions included, and the entry checked
+ * again once the invalidations these locks bring are processed.
+ */
+static PlannedStmt *
+ah_plan_cache_lookup(AHPlanKey *key, Query *parse, const char *query_string)
+{
+	dsa_area   *area = ah_plan_cache_area();
+	AHPlanEntry *entry;
+	dsa_pointer plan_dp = InvalidDsaPointer;
+	char	   *plan_string = NULL;
+	PlannedStmt *result;
+	ListCell   *lc;
+
+	LWLockAcquire(ah_plans_lock, LW_SHARED);
+	entry = ah_plan_cache_find(area, key, query_string);
+	if (entry != NULL)
+	{
+		plan_dp = entry->plan;
+		plan_string = pstrdup(dsa_get_address(area, plan_dp));
+	}
+	LWLockRelease(ah_plans_lock);
+
+	if (plan_string == NULL)
+		return NULL;
+
+	result = (PlannedStmt *) stringToNode(plan_string);
+	pfree(plan_string);
+
+	foreach(lc, result->rtable)
+	{
+		RangeTblEntry *rte = lfirst_node(RangeTblEntry, lc);
+
+		if (rte->rtekind == RTE_RELATION ||
+			(rte->rtekind == RTE_SUBQUERY && OidIsValid(rte->relid)))
+			LockRelationOid(rte->relid, rte->rellockmode);
+	}
+
+	LWLockAcquire(ah_plans_lock, LW_SHARED);
+	entry = ah_plan_cache_find(area, key, query_string);
+	if (entry == NULL || entry->plan != plan_dp)
+	{
+		LWLockRelease(ah_plans_lock);
+		return NULL;
+	}
+	SpinLockAcquire(&entry->mutex);
+	entry->hits++;
+	SpinLockRelease(&entry->mutex);
+	LWLockRelease(ah_plans_lock);
+
+	// the locations are not serialized
+	result->stmt_location = parse->stmt_location;
+	result->stmt_len = parse->stmt_len;
+
+	return result;
+}
+
+// bit of a relation (cacheid < 0) or syscache entry in the depends bitmap
+static inline uint32
+ah_plan_depends_bit(Oid relid, int cacheid, uint32 hashvalue)
+{
+	if (cacheid < 0)
+		return hash_uint32(relid) % AH_PLAN_DEPENDS_BITS;
+	return hash_combine(hash_uint32((uint32) cacheid), hashvalue) % AH_PLAN_DEPENDS_BITS;
+}
+
+static inline void
+ah_plan_depends_set(uint32 bit)
+{
+	ah_plan_cache_shared->depends[bit / 64] |= UINT64CONST(1) << (bit % 64);
+}
+
+static inline bool
+ah_plan_depends_test(uint32 bit)
+{
+	return (ah_plan_cache_shared->depends[bit / 64] & (UINT64CONST(1) << (bit % 64))) != 0;
+}
+
+// a syscache entry sets its own bit and the one of its whole cache
+static void
+ah_plan_depends_add(AHPlanEntry *entry)
+{
+	for (int i = 0; i < entry->nrelations; i++)
+		ah_plan_depends_set(ah_plan_depends_bit(entry->relations[i], -1, 0));
+	for (int i = 0; i < entry->nitems; i++)
+	{
+		ah_plan_depends_set(ah_plan_depends_bit(InvalidOid, entry->item_cache[i],
+												entry->item_hash[i]));
+		ah_plan_depends_set(ah_plan_depends_bit(InvalidOid, entry->item_cache[i], 0));
+	}
+}
+
+static void
+ah_plan_cache_remove(dsa_area *area, AHPlanEntry *entry)
+{
+	dsa_free(area, entry->text);
+	dsa_free(area, entry->plan);
+	hash_search(ah_plans, &entry->key, HASH_REMOVE, NULL);
+	pg_atomic_sub_fetch_u32(&ah_plan_cache_shared->nentries, 1);
+}
+
+// free the invalidated entries, under ah_plans_lock held exclusively
+static void
+ah_plan_cache_sweep(dsa_area *area)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHPlanEntry *entry;
+
+	memset(ah_plan_cache_shared->depends, 0, sizeof(ah_plan_cache_shared->depends));
+	hash_seq_init(&hash_seq, ah_plans);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->valid)
+			ah_plan_depends_add(entry);
+		else
+			ah_plan_cache_remove(area, entry);
+	}
+	pg_atomic_write_u32(&ah_plan_cache_shared->ninvalid, 0);
+}
+
+static int
+ah_plan_entry_cmp(const void *lhs, const void *rhs)
+{
+	const AHPlanEntry *l = *(AHPlanEntry *const *) lhs;
+	const AHPlanEntry *r = *(AHPlanEntry *const *) rhs;
+
+	if (l->hits != r->hits)
+		return (l->hits < r->hits) ? -1 : 1;
+	// the cheapest to plan again first
+	if (l->plan_time != r->plan_time)
+		return (l->plan_time < r->plan_time) ? -1 : 1;
+	return 0;
+}
+
+// evict the least used entries, under ah_plans_lock held exclusively
+static void
+ah_plan_cache_dealloc(dsa_area *area)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHPlanEntry **entries;
+	AHPlanEntry *entry;
+	int			nentries = 0;
+	int			nvictims;
+
+	entries = palloc(hash_get_num_entries(ah_plans) * sizeof(AHPlanEntry *));
+	hash_seq_init(&hash_seq, ah_plans);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		entries[nentries++] = entry;
+
+	qsort(entries, nentries, sizeof(AHPlanEntry *), ah_plan_entry_cmp);
+
+	nvictims = Max(1, nentries * AH_PLAN_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, nentries);
+	for (int i = 0; i < nvictims; i++)
+		ah_plan_cache_remove(area, entries[i]);
+
+	pfree(entries);
+}
+
+static void
+ah_plan_cache_store(AHPlanKey *key, const char *query_string, PlannedStmt *plan,
+					double plan_time)
+{
+	dsa_area   *area;
+	AHPlanEntry *entry;
+	char	   *plan_string;
+	Size		text_len = strlen(query_string) + 1;
+	Size		plan_len;
+	dsa_pointer text_dp;
+	dsa_pointer plan_dp;
+	bool		found;
+	int			nitems = 0;
+	ListCell   *lc;
+
+	// plans the core plan cache would not keep either
+	if (plan->dependsOnRole || plan->transientPlan ||
+		list_length(plan->relationOids) > AH_PLAN_MAX_RELATIONS ||
+		list_length(plan->invalItems) > AH_PLAN_MAX_ITEMS)
+		return;
+
+	plan_string = nodeToString(plan);
+	plan_len = strlen(plan_string) + 1;
+	area = ah_plan_cache_area();
+
+	LWLockAcquire(ah_plans_lock, LW_EXCLUSIVE);
+
+	if (pg_atomic_read_u32(&ah_plan_cache_shared->ninvalid) > 0)
+		ah_plan_cache_sweep(area);
+
+	// stored by another backend in the meantime
+	if (hash_search(ah_plans, key, HASH_FIND, NULL) != NULL)
+	{
+		LWLockRelease(ah_plans_lock);
+		pfree(plan_string);
+		return;
+	}
+
+	if (hash_get_num_entries(ah_plans) >= ah_max_cached_plans)
+		ah_plan_cache_dealloc(area);
+
+	// the DSA area is full, evict once more before giving up
+	for (int attempt = 0;; attempt++)
+	{
+		text_dp = dsa_allocate_extended(area, text_len, DSA_ALLOC_NO_OOM);
+		plan_dp = dsa_allocate_extended(area, plan_len, DSA_ALLOC_NO_OOM);
+		if (DsaPointerIsValid(text_dp) && DsaPointerIsValid(plan_dp))
+			break;
+		if (DsaPointerIsValid(text_dp))
+			dsa_free(area, text_dp);
+		if (DsaPointerIsValid(plan_dp))
+			dsa_free(area, plan_dp);
+		if (attempt > 0 || hash_get_num_entries(ah_plans) == 0)
+		{
+			LWLockRelease(ah_plans_lock);
+			pfree(plan_string);
+			return;
+		}
+		ah_plan_cache_dealloc(area);
+	}
+
+	entry = hash_search(ah_plans, key, HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+	{
+		dsa_free(area, text_dp);
+		dsa_free(area, plan_dp);
+		LWLockRelease(ah_plans_lock);
+		pfree(plan_string);
+		return;
+	}
+	memcpy(dsa_get_address(area, text_dp), query_string, text_len);
+	memcpy(dsa_get_address(area, plan_dp), plan_string, plan_len);
+
+	SpinLockInit(&entry->mutex);
+	entry->valid = true;
+	entry->text = text_dp;
+	entry->plan = plan_dp;
+	entry->plan_size = plan_len;
+	entry->plan_time = plan_time;
+	entry->hits = 0;
+	entry->nrelations = 0;
+	foreach(lc, plan->relationOids)
+		entry->relations[entry->nrelations++] = lfirst_oid(lc);
+	foreach(lc, plan->invalItems)
+	{
+		PlanInvalItem *item = lfirst_node(PlanInvalItem, lc);
+
+		entry->item_cache[nitems] = item->cacheId;
+		entry->item_hash[nitems] = item->hashValue;
+		nitems++;
+	}
+	entry->nitems = nitems;
+	ah_plan_depends_add(entry);
+	pg_atomic_add_fetch_u32(&ah_plan_cache_shared->nentries, 1);
+
+	LWLockRelease(ah_plans_lock);
+	pfree(plan_string);
+}
+
+/*
+ * Flag the entries depending on a relation (InvalidOid for all of them), or
+ * on a syscache entry (cacheid >= 0, hashvalue 0 for the whole cache).  The
+ * shared lock is enough, each entry is flagged under its spinlock.
+ */
+static void
+ah_plan_cache_invalidate(Oid relid, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHPlanEntry *entry;
+	uint32		ninvalid = 0;
+
+	if (ah_plans == NULL || pg_atomic_read_u32(&ah_plan_cache_shared->nentries) == 0)
+		return;
+
+	LWLockAcquire(ah_plans_lock, LW_SHARED);
+
+	// no entry depends on it
+	if ((cacheid >= 0 || relid != InvalidOid) &&
+		!ah_plan_depends_test(ah_plan_depends_bit(relid, cacheid, hashvalue)))
+	{
+		LWLockRelease(ah_plans_lock);
+		return;
+	}
+
+	hash_seq_init(&hash_seq, ah_plans);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		bool		hit = false;
+
+		if (cacheid < 0)
+		{
+			hit = (relid == InvalidOid);
+			for (int i = 0; i < entry->nrelations && !hit; i++)
+				hit = (entry->relations[i] == relid);
+		}
+		else
+		{
+			for (int i = 0; i < entry->nitems && !hit; i++)
+				hit = (entry->item_cache[i] == cacheid &&
+					   (hashvalue == 0 || entry->item_hash[i] == hashvalue));
+		}
+
+		if (hit)
+		{
+			SpinLockAcquire(&entry->mutex);
+			if (entry->valid)
+			{
+				entry->valid = false;
+				ninvalid++;
+			}
+			SpinLockRelease(&entry->mutex);
+		}
+	}
+	if (ninvalid > 0)
+		pg_atomic_add_fetch_u32(&ah_plan_cache_shared->ninvalid, ninvalid);
+	LWLockRelease(ah_plans_lock);
+}
+
+// no backend uses the cache, the first one to do so empties it
+static inline bool
+ah_plan_cache_unused(void)
+{
+	return ah_plan_cache_shared == NULL ||
+		pg_atomic_read_u32(&ah_plan_cache_shared->nbackends) == 0;
+}
+
+/*
+ * Count this backend among the users of the cache, the first one drops the
+ * entries whose invalidations nobody processed.
+ */
+static void
+ah_plan_cache_join(void)
+{
+	static bool exit_registered = false;
+
+	if (ah_plan_cache_joined)
+		return;
+
+	if (!exit_registered)
+	{
+		before_shmem_exit(ah_plan_cache_leave, (Datum) 0);
+		exit_registered = true;
+	}
+	ah_plan_cache_joined = true;
+	if (pg_atomic_fetch_add_u32(&ah_plan_cache_shared->nbackends, 1) == 0)
+		ah_plan_cache_invalidate(InvalidOid, -1, 0);
+}
+
+static void
+ah_plan_cache_leave(int code, Datum arg)
+{
+	if (!ah_plan_cache_joined)
+		return;
+
+	ah_plan_cache_joined = false;
+	pg_atomic_sub_fetch_u32(&ah_plan_cache_shared->nbackends, 1);
+}
+
+static void
+ah_assign_plan_cache(bool newval, void *extra)
+{
+	if (!newval)
+		ah_plan_cache_leave(0, (Datum) 0);
+}
+
+static void
+ah_plan_cache_relcache_callback(Datum arg, Oid relid)
+{
+	if (ah_plan_cache_unused())
+		return;
+	ah_plan_cache_invalidate(relid, -1, 0);
+}
+
+// functions and domains are PlanInvalItems, anything else resets the cache
+static void
+ah_plan_cache_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	if (ah_plan_cache_unused())
+		return;
+	if (cacheid == PROCOID || cacheid == TYPEOID)
+		ah_plan_cache_invalidate(InvalidOid, cacheid, hashvalue);
+	else
+		ah_plan_cache_invalidate(InvalidOid, -1, 0);
+}
+
+Datum
+all_hooks_plan_cache(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHPlanEntry *entry;
+	dsa_area   *area;
+
+	if (ah_plans == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+	area = ah_plan_cache_area();
+
+	LWLockAcquire(ah_plans_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_plans);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[8];
+		bool		nulls[8] = {0};
+
+		values[0] = Int64GetDatum((int64) entry->key.queryid);
+		values[1] = ObjectIdGetDatum(entry->key.userid);
+		values[2] = ObjectIdGetDatum(entry->key.dbid);
+		SpinLockAcquire(&entry->mutex);
+		values[3] = Int64GetDatum(entry->hits);
+		SpinLockRelease(&entry->mutex);
+		values[4] = Float8GetDatum(entry->plan_time);
+		values[5] = Int64GetDatum((int64) entry->plan_size);
+		values[6] = BoolGetDatum(entry->valid);
+		values[7] = CStringGetTextDatum(dsa_get_address(area, entry->text));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_plans_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_plan_cache_reset(PG_FUNCTION_ARGS)
+{
+	dsa_area   *area;
+
+	if (ah_plans == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	area = ah_plan_cache_area();
+	ah_plan_cache_invalidate(InvalidOid, -1, 0);
+
+	LWLockAcquire(ah_plans_lock, LW_EXCLUSIVE);
+	ah_plan_cache_sweep(area);
+	LWLockRelease(ah_plans_lock);
+
+	PG_RETURN_VOID();
+}
+
+// client authentication
+
+// whether the role logging in is a superuser or a replication role
+static bool
+ah_client_privileged(Port *port)
+{
+	HeapTuple	tuple;
+	bool		result = false;
+
+	if (port->user_name == NULL)
+		return false;
+
+	// the password check looked the role up the same way
+	tuple = SearchSysCache1(AUTHNAME, PointerGetDatum(port->user_name));
+	if (HeapTupleIsValid(tuple))
+	{
+		Form_pg_authid role = (Form_pg_authid) GETSTRUCT(tuple);
+
+		result = role->rolsuper || role->rolreplication;
+		ReleaseSysCache(tuple);
+	}
+	return result;
+}
+
+static int
+ah_client_entry_cmp(const void *lhs, const void *rhs)
+{
+	const AHClientEntry *l = *(AHClientEntry *const *) lhs;
+	const AHClientEntry *r = *(AHClientEntry *const *) rhs;
+
+	if (l->last_attempt != r->last_attempt)
+		return (l->last_attempt < r->last_attempt) ? -1 : 1;
+	return 0;
+}
+
+// evict the addresses seen least recently, under ah_clients_lock held exclusively
+static void
+ah_clients_dealloc(TimestampTz now)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHClientEntry **entries;
+	AHClientEntry *entry;
+	int			nentries = 0;
+	int			nidle = 0;
+	int			nvictims;
+
+	entries = palloc(hash_get_num_entries(ah_clients) * sizeof(AHClientEntry *));
+
+	// the ones in backoff go last, evicting them would lift it
+	hash_seq_init(&hash_seq, ah_clients);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->backoff_until <= now)
+			entries[nidle++] = entry;
+	}
+	nentries = nidle;
+	hash_seq_init(&hash_seq, ah_clients);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->backoff_until > now)
+			entries[nentries++] = entry;
+	}
+
+	qsort(entries, nidle, sizeof(AHClientEntry *), ah_client_entry_cmp);
+	qsort(entries + nidle, nentries - nidle, sizeof(AHClientEntry *), ah_client_entry_cmp);
+
+	nvictims = Max(1, nentries * AH_CLIENTS_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, nentries);
+	for (int i = 0; i < nvictims; i++)
+		hash_search(ah_clients, &entries[i]->key, HASH_REMOVE, NULL);
+
+	pfree(entries);
+}
+
+/*
+ * Account an authentication of the client, and return whether it must be
+ * rejected: its address is in backoff or out of tokens.  *retry gets the
+ * ms left before the backoff ends, 0 when rejected for the rate.
+ */
+static bool
+ah_client_authenticate(Port *port, int status, double auth_time, long *retry)
+{
+	AHClientKey key;
+	AHClientEntry *entry;
+	TimestampTz now = GetCurrentTimestamp();
+	bool		limited;
+	bool		reject = false;
+
+	*retry = 0;
+	memset(&key, 0, sizeof(key));
+	if (pg_getnameinfo_all(&port->raddr.addr, port->raddr.salen,
+						   key.addr, sizeof(key.addr), NULL, 0,
+						   NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		strlcpy(key.addr, "[unknown]", sizeof(key.addr));
+	key.privileged = ah_client_privileged(port);
+
+	// local and replication connections are only counted
+	limited = port->raddr.addr.ss_family != AF_UNIX && !am_walsender;
+
+	LWLockAcquire(ah_clients_lock, LW_SHARED);
+	entry = hash_search(ah_clients, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		bool		found;
+
+		LWLockRelease(ah_clients_lock);
+		LWLockAcquire(ah_clients_lock, LW_EXCLUSIVE);
+		entry = hash_search(ah_clients, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+		{
+			ah_clients_dealloc(now);
+			entry = hash_search(ah_clients, &key, HASH_ENTER_NULL, &found);
+		}
+		if (entry == NULL)
+		{
+			// still full, the address is neither counted nor limited
+			LWLockRelease(ah_clients_lock);
+			return false;
+		}
+		if (!found)
+		{
+			SpinLockInit(&entry->mutex);
+			memset((char *) entry + offsetof(AHClientEntry, attempts), 0,
+				   sizeof(AHClientEntry) - offsetof(AHClientEntry, attempts));
+			entry->tokens = ah_auth_burst;
+			entry->refill_time = now;
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+
+	entry->attempts++;
+	entry->last_attempt = now;
+	entry->total_time += auth_time;
+	if (auth_time > entry->max_time)
+		entry->max_time = auth_time;
+
+	if (!limited)
+		;
+	else if (now < entry->backoff_until)
+	{
+		reject = true;
+		*retry = (long) ((entry->backoff_until - now) / 1000);
+	}
+	else if (ah_auth_rate > 0)
+	{
+		entry->tokens += (double) (now - entry->refill_time) / USECS_PER_SEC * ah_auth_rate;
+		if (entry->tokens > ah_auth_burst)
+			entry->tokens = ah_auth_burst;
+		entry->refill_time = now;
+		if (entry->tokens < 1.0)
+			reject = true;
+		else
+			entry->tokens -= 1.0;
+	}
+
+	if (reject)
+		entry->rejected++;
+	else if (status != STATUS_OK)
+	{
+		entry->failures++;
+		entry->failures_in_row++;
+		entry->last_failure = now;
+		if (ah_auth_backoff > 0 && limited)
+		{
+			// ah_auth_backoff * 2^(failures in a row - 1), capped
+			double		backoff = ldexp((double) ah_auth_backoff,
+										Min(entry->failures_in_row - 1, 30));
+
+			backoff = Min(backoff, (double) ah_auth_backoff_max);
+			entry->backoff_until = now + (TimestampTz) (backoff * 1000);
+		}
+	}
+	else
+		entry->failures_in_row = 0;
+
+	SpinLockRelease(&entry->mutex);
+	LWLockRelease(ah_clients_lock);
+
+	return reject;
+}
+
+// a client address loaded from the statistics file starts with no backoff
+static void
+ah_client_restored(void *entry)
+{
+	AHClientEntry *client = (AHClientEntry *) entry;
+
+	client->failures_in_row = 0;
+	client->backoff_until = 0;
+	client->tokens = ah_auth_burst;
+	client->refill_time = GetCurrentTimestamp();
+}
+
+Datum
+all_hooks_clients(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHClientEntry *entry;
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (ah_clients == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_clients_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_clients);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[10];
+		bool		nulls[10] = {0};
+		AHClientEntry tmp;
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		// like pg_stat_activity.client_addr, NULL for Unix sockets
+		if (tmp.key.addr[0] == '[')
+			nulls[0] = true;
+		else
+			values[0] = DirectFunctionCall1(inet_in, CStringGetDatum(tmp.key.addr));
+		values[1] = Int64GetDatum(tmp.attempts);
+		values[2] = Int64GetDatum(tmp.failures);
+		values[3] = Int64GetDatum(tmp.rejected);
+		values[4] = Float8GetDatum(tmp.total_time);
+		values[5] = Float8GetDatum(tmp.max_time);
+		if (tmp.last_failure == 0)
+			nulls[6] = true;
+		else
+			values[6] = TimestampTzGetDatum(tmp.last_failure);
+		values[7] = Int32GetDatum(tmp.failures_in_row);
+		if (tmp.backoff_until <= now)
+			nulls[8] = true;
+		else
+			values[8] = TimestampTzGetDatum(tmp.backoff_until);
+		values[9] = BoolGetDatum(tmp.key.privileged);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_clients_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_clients_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHClientEntry *entry;
+
+	if (ah_clients == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	LWLockAcquire(ah_clients_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, ah_clients);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(ah_clients, &entry->key, HASH_REMOVE, NULL);
+	LWLockRelease(ah_clients_lock);
+
+	PG_RETURN_VOID();
+}
+
+// utility statistics
+
+// timeout handler, in a signal handler: only reads the wait event
+static void
+ah_lock_sample_handler(void)
+{
+	if ((*my_wait_event_info & 0xFF000000) == PG_WAIT_LOCK)
+		ah_lock_samples++;
+}
+
+static void
+ah_lock_sampling_start(void)
+{
+	if (ah_lock_sampling++ > 0)
+		return;
+	if (ah_lock_timeout == MAX_TIMEOUTS)
+		ah_lock_timeout = RegisterTimeout(USER_TIMEOUT, ah_lock_sample_handler);
+	ah_lock_sampling_interval = ah_lock_sample_interval;
+	enable_timeout_every(ah_lock_timeout,
+						 TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+													 ah_lock_sampling_interval),
+						 ah_lock_sampling_interval);
+}
+
+static void
+ah_lock_sampling_stop(void)
+{
+	if (--ah_lock_sampling == 0)
+		disable_timeout(ah_lock_timeout, false);
+}
+
+static bool
+ah_check_lock_sample_interval(int *newval, void **extra, GucSource source)
+{
+	if (*newval != 0 && *newval < AH_LOCK_SAMPLE_MIN)
+	{
+		GUC_check_errdetail("The interval must be 0 or at least %d ms.", AH_LOCK_SAMPLE_MIN);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * The relation a maintenance command works on, InvalidOid when it names
+ * none or several.  Returns false for the other statements.
+ */
+static bool
+ah_utility_relation(Node *stmt, Oid *relid)
+{
+	RangeVar   *rv = NULL;
+	List	   *rels = NIL;
+
+	*relid = InvalidOid;
+	switch (nodeTag(stmt))
+	{
+		case T_VacuumStmt:
+			{
+				VacuumStmt *vac = (VacuumStmt *) stmt;
+
+				if (list_length(vac->rels) == 1)
+				{
+					VacuumRelation *vrel = linitial_node(VacuumRelation, vac->rels);
+
+					if (OidIsValid(vrel->oid))
+					{
+						*relid = vrel->oid;
+						return true;
+					}
+					rv = vrel->relation;
+				}
+			}
+			break;
+		case T_IndexStmt:
+			rv = ((IndexStmt *) stmt)->relation;
+			break;
+		case T_AlterTableStmt:
+			rv = ((AlterTableStmt *) stmt)->relation;
+			break;
+		case T_CopyStmt:
+			rv = ((CopyStmt *) stmt)->relation;
+			break;
+		case T_RefreshMatViewStmt:
+			rv = ((RefreshMatViewStmt *) stmt)->relation;
+			break;
+		case T_ClusterStmt:
+			rv = ((ClusterStmt *) stmt)->relation;
+			break;
+		case T_ReindexStmt:
+			rv = ((ReindexStmt *) stmt)->relation;
+			break;
+		case T_TruncateStmt:
+			rels = ((TruncateStmt *) stmt)->relations;
+			break;
+		case T_LockStmt:
+			rels = ((LockStmt *) stmt)->relations;
+			break;
+		default:
+			return false;
+	}
+
+	if (list_length(rels) == 1)
+		rv = linitial_node(RangeVar, rels);
+	if (rv != NULL && IsTransactionState())
+		*relid = RangeVarGetRelid(rv, NoLock, true);
+	return true;
+}
+
+static void
+ah_utility_add(CommandTag tag, Oid relid, ProcessUtilityContext context,
+			   bool nested, double total_time, double lock_wait_time)
+{
+	AHUtilityKey key;
+	AHUtilityEntry *entry;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.tag = (int32) tag;
+	key.relid = relid;
+
+	LWLockAcquire(ah_utility_lock, LW_SHARED);
+	entry = hash_search(ah_utility, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		bool		found;
+
+		LWLockRelease(ah_utility_lock);
+		LWLockAcquire(ah_utility_lock, LW_EXCLUSIVE);
+		entry = hash_search(ah_utility, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+		{
+			LWLockRelease(ah_utility_lock);
+			return;
+		}
+		if (!found)
+		{
+			SpinLockInit(&entry->mutex);
+			memset((char *) entry + offsetof(AHUtilityEntry, calls), 0,
+				   sizeof(AHUtilityEntry) - offsetof(AHUtilityEntry, calls));
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	if (entry->calls == 0 || total_time < entry->min_time)
+		entry->min_time = total_time;
+	if (total_time > entry->max_time)
+		entry->max_time = total_time;
+	entry->calls++;
+	if (context == PROCESS_UTILITY_TOPLEVEL)
+		entry->toplevel_calls++;
+	else if (context == PROCESS_UTILITY_SUBCOMMAND)
+		entry->subcommand_calls++;
+	if (nested)
+		entry->nested_calls++;
+	entry->total_time += total_time;
+	if (lock_wait_time > 0)
+	{
+		entry->lock_wait_time += lock_wait_time;
+		entry->lock_waited_calls++;
+	}
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(ah_utility_lock);
+}
+
+Datum
+all_hooks_utility(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHUtilityEntry *entry;
+
+	if (ah_utility == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_utility_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_utility);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[12];
+		bool		nulls[12] = {0};
+		AHUtilityEntry tmp;
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		values[0] = ObjectIdGetDatum(tmp.key.dbid);
+		values[1] = CStringGetTextDatum(GetCommandTagName((CommandTag) tmp.key.tag));
+		if (OidIsValid(tmp.key.relid))
+			values[2] = ObjectIdGetDatum(tmp.key.relid);
+		else
+			nulls[2] = true;
+		values[3] = Int64GetDatum(tmp.calls);
+		values[4] = Int64GetDatum(tmp.toplevel_calls);
+		values[5] = Int64GetDatum(tmp.subcommand_calls);
+		values[6] = Int64GetDatum(tmp.nested_calls);
+		values[7] = Float8GetDatum(tmp.total_time);
+		values[8] = Float8GetDatum(tmp.min_time);
+		values[9] = Float8GetDatum(tmp.max_time);
+		values[10] = Float8GetDatum(tmp.lock_wait_time);
+		values[11] = Int64GetDatum(tmp.lock_waited_calls);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_utility_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_utility_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHUtilityEntry *entry;
+
+	if (ah_utility == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	LWLockAcquire(ah_utility_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, ah_utility);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(ah_utility, &entry->key, HASH_REMOVE, NULL);
+	LWLockRelease(ah_utility_lock);
+
+	PG_RETURN_VOID();
+}
+
+// EXPLAIN (HOOKS)
+#if PG_VERSION_NUM >= 180000
+
+static bool
+ah_explain_hooks_enabled(ExplainState *es)
+{
+	bool	   *hooks = (bool *) GetExplainExtensionState(es, ah_explain_id);
+
+	return hooks != NULL && *hooks;
+}
+
+static void
+ah_explain_hooks_handler(ExplainState *es, DefElem *opt, ParseState *pstate)
+{
+	bool	   *hooks = (bool *) GetExplainExtensionState(es, ah_explain_id);
+
+	if (hooks == NULL)
+	{
+		hooks = palloc0(sizeof(bool));
+		SetExplainExtensionState(es, ah_explain_id, hooks);
+	}
+	*hooks = defGetBoolean(opt);
+
+	// the explained statement is always sampled
+	ah_explain_pending = *hooks;
+	if (*hooks)
+	{
+		ah_sampled = true;
+		memset(&ah_explain_plan_phases, 0, sizeof(ah_explain_plan_phases));
+	}
+}
+
+static void
+ah_explain_end_loop(AHExplainNode *st)
+{
+	if (!st->in_loop)
+		return;
+
+	if (st->loops == 0 || st->loop_time < st->time_min)
+		st->time_min = st->loop_time;
+	st->time_max = Max(st->time_max, st->loop_time);
+	st->loops++;
+	st->time_sum += st->loop_time;
+	st->time_sumsq += st->loop_time * st->loop_time;
+	st->rows_sum += st->loop_rows;
+	st->rows_sumsq += st->loop_rows * st->loop_rows;
+
+	st->in_loop = false;
+	st->loop_time = 0;
+	st->loop_rows = 0;
+}
+
+/*
+ * One build of a Hash node, from what its instrumentation gained while the
+ * HashJoin above it ran.  The time is zero under TIMING OFF.
+ */
+static void
+ah_explain_hash_loop(PlanState *hash, instr_time time_before, double rows_before)
+{
+	AHExplainNode *st = &ah_explain_query->nodes[hash->plan->plan_node_id];
+	instr_time	duration = hash->instrument->counter;
+
+	INSTR_TIME_SUBTRACT(duration, time_before);
+	st->in_loop = true;
+	st->loop_time = INSTR_TIME_GET_MILLISEC(duration);
+	st->loop_rows = hash->instrument->tuplecount - rows_before;
+	ah_explain_end_loop(st);
+}
+
+static TupleTableSlot *
+ah_explain_exec_node(PlanState *node)
+{
+	AHExplainNode *st = &ah_explain_query->nodes[node->plan->plan_node_id];
+	int			saved_node = ah_explain_node;
+	TupleTableSlot *slot;
+	instr_time	start;
+	instr_time	duration;
+	HashJoinTable hash_table = NULL;
+	instr_time	hash_time;
+	double		hash_rows = 0;
+
+	INSTR_TIME_SET_ZERO(hash_time);
+
+	// a rescan ended the loop of the instrumentation
+	if (node->instrument != NULL && node->instrument->nloops != st->instr_loops)
+	{
+		ah_explain_end_loop(st);
+		st->instr_loops = node->instrument->nloops;
+	}
+
+	// a Hash runs through MultiExecProcNode, which we cannot stand in
+	// front of; its instrumentation tells whether the join built it
+	if (IsA(node, HashJoinState) && innerPlanState(node)->instrument != NULL)
+	{
+		hash_table = ((HashJoinState *) node)->hj_HashTable;
+		hash_time = innerPlanState(node)->instrument->counter;
+		hash_rows = innerPlanState(node)->instrument->tuplecount;
+	}
+
+	INSTR_TIME_SET_CURRENT(start);
+	ah_explain_node = node->plan->plan_node_id;
+	slot = st->next(node);
+	ah_explain_node = saved_node;
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	if (IsA(node, HashJoinState) && innerPlanState(node)->instrument != NULL &&
+		((HashJoinState *) node)->hj_HashTable != NULL &&
+		((HashJoinState *) node)->hj_HashTable != hash_table)
+		ah_explain_hash_loop(innerPlanState(node), hash_time, hash_rows);
+
+	// ExecProcNodeFirst replaces itself on the first call, stay in front
+	if (node->ExecProcNode != ah_explain_exec_node)
+	{
+		st->next = node->ExecProcNode;
+		node->ExecProcNode = ah_explain_exec_node;
+	}
+
+	st->in_loop = true;
+	st->loop_time += INSTR_TIME_GET_MILLISEC(duration);
+	if (TupIsNull(slot))
+		ah_explain_end_loop(st);
+	else
+		st->loop_rows += 1;
+
+	return slot;
+}
+
+static bool
+ah_explain_max_node_walker(PlanState *planstate, void *context)
+{
+	int		   *max_id = (int *) context;
+
+	*max_id = Max(*max_id, planstate->plan->plan_node_id);
+	return planstate_tree_walker(planstate, ah_explain_max_node_walker, context);
+}
+
+static bool
+ah_explain_wrap_walker(PlanState *planstate, void *context)
+{
+	ah_explain_query->nodes[planstate->plan->plan_node_id].next = planstate->ExecProcNode;
+	planstate->ExecProcNode = ah_explain_exec_node;
+	return planstate_tree_walker(planstate, ah_explain_wrap_walker, context);
+}
+
+// the per-node data lives in the query memory
+static void
+ah_explain_query_reset(void *arg)
+{
+	ah_explain_query = NULL;
+	ah_explain_node = -1;
+}
+
+// called after standard_ExecutorStart for the statement under EXPLAIN (ANALYZE, HOOKS)
+static void
+ah_explain_wrap(QueryDesc *queryDesc)
+{
+	EState	   *estate = queryDesc->estate;
+	MemoryContextCallback *cb;
+	int			max_id = 0;
+
+	ah_explain_max_node_walker(queryDesc->planstate, &max_id);
+
+	ah_explain_query = MemoryContextAllocZero(estate->es_query_cxt,
+											  offsetof(AHExplainQuery, nodes) +
+											  sizeof(AHExplainNode) * (max_id + 1));
+	ah_explain_query->estate = estate;
+	ah_explain_query->nnodes = max_id + 1;
+
+	cb = MemoryContextAlloc(estate->es_query_cxt, sizeof(MemoryContextCallback));
+	cb->func = ah_explain_query_reset;
+	cb->arg = NULL;
+	MemoryContextRegisterResetCallback(estate->es_query_cxt, cb);
+
+	ah_explain_wrap_walker(queryDesc->planstate, NULL);
+}
+
+static void
+ah_explain_show_node(PlanState *planstate, ExplainState *es)
+{
+	AHExplainNode *st;
+	double		time_mean;
+	double		time_stddev;
+	double		rows_mean;
+	double		rows_var;
+	double		hit_per_loop = 0;
+
+	if (ah_explain_query == NULL || planstate->state != ah_explain_query->estate ||
+		planstate->plan->plan_node_id >= ah_explain_query->nnodes)
+		return;
+
+	st = &ah_explain_query->nodes[planstate->plan->plan_node_id];
+	ah_explain_end_loop(st);
+	if (st->loops == 0)
+		return;
+
+	time_mean = st->time_sum / st->loops;
+	time_stddev = sqrt(Max(st->time_sumsq / st->loops - time_mean * time_mean, 0.0));
+	rows_mean = st->rows_sum / st->loops;
+	rows_var = Max(st->rows_sumsq / st->loops - rows_mean * rows_mean, 0.0);
+	if (planstate->instrument != NULL && planstate->instrument->nloops > 0)
+		hit_per_loop = planstate->instrument->bufusage.shared_blks_hit /
+			planstate->instrument->nloops;
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		ExplainIndentText(es);
+		appendStringInfo(es->str,
+						 "Hooks Loop Time: loops=" INT64_FORMAT " min=%.3f mean=%.3f max=%.3f stddev=%.3f ms\n",
+						 st->loops, st->time_min, time_mean, st->time_max, time_stddev);
+		ExplainIndentText(es);
+		appendStringInfo(es->str,
+						 "Hooks Loop Rows: mean=%.2f variance=%.2f, shared hit=%.2f per loop, fmgr calls=" INT64_FORMAT "\n",
+						 rows_mean, rows_var, hit_per_loop, st->fmgr_calls);
+	}
+	else
+	{
+		ExplainPropertyInteger("Hooks Loops", NULL, st->loops, es);
+		ExplainPropertyFloat("Hooks Loop Time Min", "ms", st->time_min, 3, es);
+		ExplainPropertyFloat("Hooks Loop Time Mean", "ms", time_mean, 3, es);
+		ExplainPropertyFloat("Hooks Loop Time Max", "ms", st->time_max, 3, es);
+		ExplainPropertyFloat("Hooks Loop Time Stddev", "ms", time_stddev, 3, es);
+		ExplainPropertyFloat("Hooks Loop Rows Mean", NULL, rows_mean, 2, es);
+		ExplainPropertyFloat("Hooks Loop Rows Variance", NULL, rows_var, 2, es);
+		ExplainPropertyFloat("Hooks Shared Hit Per Loop", NULL, hit_per_loop, 2, es);
+		ExplainPropertyInteger("Hooks Fmgr Calls", NULL, st->fmgr_calls, es);
+	}
+}
+
+// planning phases of the explained statement, see AHPlanPhases
+static void
+ah_explain_show_planning(ExplainState *es)
+{
+	AHPlanPhases *p = &ah_explain_plan_phases;
+	double		scan;
+	double		join;
+	double		upper;
+	double		create;
+
+	if (p->end == 0)
+		return;
+
+	ah_plan_phases_split(p, &scan, &join, &upper, &create);
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		ExplainIndentText(es);
+		appendStringInfo(es->str,
+						 "Hooks Planning: scan paths=%.3f join search=%.3f upper paths=%.3f plan creation=%.3f ms\n",
+						 scan, join, upper, create);
+		ExplainIndentText(es);
+		appendStringInfo(es->str,
+						 "Hooks Planning Paths: base=" INT64_FORMAT " join=" INT64_FORMAT " upper=" INT64_FORMAT
+						 ", joinrels=" INT64_FORMAT " join pairs=" INT64_FORMAT " geqo searches=" INT64_FORMAT "\n",
+						 p->base_paths, p->join_paths, p->upper_paths,
+						 p->joinrels, p->join_pairs, p->geqo_searches);
+	}
+	else
+	{
+		ExplainPropertyFloat("Hooks Planning Scan Paths Time", "ms", scan, 3, es);
+		ExplainPropertyFloat("Hooks Planning Join Search Time", "ms", join, 3, es);
+		ExplainPropertyFloat("Hooks Planning Upper Paths Time", "ms", upper, 3, es);
+		ExplainPropertyFloat("Hooks Planning Plan Creation Time", "ms", create, 3, es);
+		ExplainPropertyInteger("Hooks Planning Base Paths", NULL, p->base_paths, es);
+		ExplainPropertyInteger("Hooks Planning Join Paths", NULL, p->join_paths, es);
+		ExplainPropertyInteger("Hooks Planning Upper Paths", NULL, p->upper_paths, es);
+		ExplainPropertyInteger("Hooks Planning Joinrels", NULL, p->joinrels, es);
+		ExplainPropertyInteger("Hooks Planning Join Pairs", NULL, p->join_pairs, es);
+		ExplainPropertyInteger("Hooks Planning GEQO Searches", NULL, p->geqo_searches, es);
+	}
+}
+
+// an EXPLAIN failing before its execution must not flag the next statement
+static void
+ah_explain_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT)
+	{
+		ah_explain_pending = false;
+		ah_explain_planning = false;
+	}
+}
+#endif
+
+// planner_hook
+static PlannedStmt *
+ah_planner_hook(Query *parse, const char *query_st, int cursorOptions, ParamListInfo boundp)
+{
+	PlannedStmt *result;
+	instr_time	start;
+	uint64		elapsed;
+	bool		toplevel = (ah_nesting_level == 0);
+	AHPlanPhases phases;
+	AHPlanPhases *outer_phases = ah_plan_phases;
+	AHPlanKey	plan_key;
+	bool		cacheable;
+	PlannedStmt *cached = NULL;
+	uint64		plan_start = 0;
+#if PG_VERSION_NUM >= 180000
+	bool		explain_phases = false;
+#endif
+
+	if (toplevel)
+		ah_sample_statement();
+
+	cacheable = toplevel && ah_plan_cache && ah_plans != NULL &&
+		ah_plan_cache_key(parse, query_st, cursorOptions, boundp, &plan_key);
+
+	INSTR_TIME_SET_ZERO(start);
+	memset(&phases, 0, sizeof(phases));
+	if (ah_sampled)
+	{
+		ah_record_event(AH_HOOK_PLANNER, parse->queryId, InvalidOid);
+		ah_trace_begin(AH_HOOK_PLANNER, parse->queryId, InvalidOid, 0);
+		INSTR_TIME_SET_CURRENT(start);
+		phases.start = ah_now_ns();
+	}
+	ah_plan_phases = ah_sampled ? &phases : NULL;
+
+#if PG_VERSION_NUM >= 180000
+	// planning of the statement under EXPLAIN (HOOKS)
+	if (ah_explain_pending && !ah_explain_planning)
+	{
+		explain_phases = true;
+		ah_explain_planning = true;
+	}
+#endif
+
+	if (cacheable)
+	{
+		ah_plan_cache_join();
+		cached = ah_plan_cache_lookup(&plan_key, parse, query_st);
+		plan_start = ah_now_ns();
+	}
+
+	ah_nesting_level++;
+	PG_TRY();
+	{
+		if (cached != NULL)
+			result = cached;
+		else if (ah_original_planner_hook){
+			result = ah_original_planner_hook(parse,query_st,cursorOptions, boundp);
+		}
+		else
+		{
+			result = standard_planner(parse, query_st, cursorOptions, boundp);
+		}
+	}
+	PG_FINALLY();
+	{
+		ah_nesting_level--;
+		ah_plan_phases = outer_phases;
+	}
+	PG_END_TRY();
+
+	if (ah_sampled)
+	{
+		phases.end = ah_now_ns();
+		elapsed = ah_record_latency(AH_HOOK_PLANNER, start);
+		ah_trace_end(AH_HOOK_PLANNER, parse->queryId, InvalidOid, 0);
+
+		ah_query_plan_add(parse->queryId, elapsed / 1000000.0, boundp, &phases);
+	}
+
+	if (cacheable && cached == NULL)
+		ah_plan_cache_store(&plan_key, query_st, result,
+							(ah_now_ns() - plan_start) / 1000000.0);
+
+#if PG_VERSION_NUM >= 180000
+	if (explain_phases)
+	{
+		ah_explain_plan_phases = phases;
+		ah_explain_planning = false;
+	}
+#endif
+
+	// ExecutorStart keeps the decision for this plan
+	if (toplevel)
+	{
+		if (!ah_plan_is_costly(result))
+			ah_sampled = false;
+		ah_sample_planned = result;
+	}
+
+	return result;
+}
+
+// ProcessUtility_hook
+void ah_ProcessUtility_hook(
+	PlannedStmt *pstmt,
+	const char *queryString,
+	bool readOnlyTree,
+	ProcessUtilityContext context,
+	ParamListInfo params,
+	QueryEnvironment *queryEnv,
+	DestReceiver *dest,
+	QueryCompletion *completionTag)
+{
+	instr_time	start;
+	bool		nested = ah_nesting_level > 0;
+	Oid			relid = InvalidOid;
+	bool		sample_locks = false;
+	uint32		lock_samples = 0;
+
+	if (ah_nesting_level == 0)
+		ah_sample_statement();
+
+	INSTR_TIME_SET_ZERO(start);
+	if (ah_sampled)
+	{
+		ah_record_event(AH_HOOK_PROCESS_UTILITY, pstmt->queryId, InvalidOid);
+		ah_trace_begin(AH_HOOK_PROCESS_UTILITY, pstmt->queryId, InvalidOid, 0);
+		if (ah_utility != NULL &&
+			ah_utility_relation(pstmt->utilityStmt, &relid) &&
+			ah_lock_sample_interval > 0)
+		{
+			sample_locks = true;
+			lock_samples = ah_lock_samples;
+			ah_lock_sampling_start();
+		}
+		INSTR_TIME_SET_CURRENT(start);
+	}
+
+	ah_nesting_level++;
+	PG_TRY();
+	{
+		if (ah_original_ProcessUtility_hook)
+		{
+			ah_original_ProcessUtility_hook(pstmt, queryString,readOnlyTree,context,params,queryEnv,dest, completionTag);
+		}
+		else
+		{
+			standard_ProcessUtility(pstmt,queryString, readOnlyTree, context, params, queryEnv, dest, completionTag);
+		}
+	}
+	PG_FINALLY();
+	{
+		ah_nesting_level--;
+		if (sample_locks)
+			ah_lock_sampling_stop();
+	}
+	PG_END_TRY();
+
+	if (ah_sampled)
+	{
+		uint64		elapsed = ah_record_latency(AH_HOOK_PROCESS_UTILITY, start);
+
+		if (ah_utility != NULL)
+			ah_utility_add(CreateCommandTag(pstmt->utilityStmt), relid, context, nested,
+						   elapsed / 1000000.0,
+						   sample_locks ?
+						   (double) (ah_lock_samples - lock_samples) * ah_lock_sampling_interval : 0);
+		ah_trace_end(AH_HOOK_PROCESS_UTILITY, pstmt->queryId, InvalidOid, 0);
+	}
+}
+
+// Executor
+// executeCheckPerms_hook
+#if PG_VERSION_NUM <160000
+bool ah_ExecutorCheckPerms_hook (List* tableList, bool abort)
+#else
+bool ah_ExecutorCheckPerms_hook (List* tableList, List* rteperminfos, bool abort)
+#endif
+{
+
+	if (ah_sampled)
+		ah_record_event(AH_HOOK_EXECUTOR_CHECK_PERMS, pgstat_get_my_query_id(), InvalidOid);
+
+	return true;
+}
+
+// ExecutorStart_hook
+void ah_ExecutorStart_hook (QueryDesc *queryDesc, int eflags)
+{
+	bool		costly = ah_plan_is_costly(queryDesc->plannedstmt);
+	instr_time	start;
+#if PG_VERSION_NUM >= 180000
+	bool		explain_wrap = false;
+
+	// the statement run by EXPLAIN (ANALYZE, HOOKS), with buffer counts
+	if (ah_explain_pending && queryDesc->instrument_options != 0)
+	{
+		ah_explain_pending = false;
+		if (!(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+		{
+			explain_wrap = true;
+			queryDesc->instrument_options |= INSTRUMENT_BUFFERS;
+		}
+	}
+#endif
+
+	// a top-level statement not planned just before, like a prepared one
+	if (ah_nesting_level == 0)
+	{
+		// a parallel worker follows its leader
+		if (IsParallelWorker() && ah_parallel != NULL)
+			ah_sampled = ah_parallel_worker_begin(queryDesc->plannedstmt->queryId);
+		else if (queryDesc->plannedstmt != ah_sample_planned)
+		{
+			ah_sample_statement();
+			if (!costly)
+				ah_sampled = false;
+		}
+		ah_sample_planned = NULL;
+	}
+
+	if (queryDesc->plannedstmt->parallelModeNeeded && !IsParallelWorker())
+		ah_parallel_begin(queryDesc->plannedstmt->queryId);
+
+	INSTR_TIME_SET_ZERO(start);
+	if (ah_sampled)
+	{
+		ah_record_event(AH_HOOK_EXECUTOR_START, queryDesc->plannedstmt->queryId, InvalidOid);
+
+		// row counts on every node, for the estimate statistics
+		if (costly && ah_estimates != NULL && ah_track_estimates &&
+			queryDesc->plannedstmt->queryId != UINT64CONST(0) &&
+			!(eflags & EXEC_FLAG_EXPLAIN_ONLY) && !IsParallelWorker())
+			queryDesc->instrument_options |= INSTRUMENT_ROWS;
+
+		// buffer and WAL usage on every node, for the node statistics
+		if (costly && ah_nodes != NULL && ah_track_nodes &&
+			queryDesc->plannedstmt->queryId != UINT64CONST(0) &&
+			!(eflags & EXEC_FLAG_EXPLAIN_ONLY) && !IsParallelWorker())
+			queryDesc->instrument_options |= INSTRUMENT_BUFFERS | INSTRUMENT_WAL;
+
+		ah_trace_begin(AH_HOOK_EXECUTOR_START, queryDesc->plannedstmt->queryId, InvalidOid, 0);
+		INSTR_TIME_SET_CURRENT(start);
+	}
+
+	// functions run by the initialization are nested statements
+	ah_nesting_level++;
+	PG_TRY();
+	{
+		if (ah_original_ExecutorStart_hook)
+		{
+			ah_original_ExecutorStart_hook(queryDesc, eflags);
+		}
+		else
+		{
+			standard_ExecutorStart(queryDesc, eflags);
+		}
+	}
+	PG_FINALLY();
+	{
+		ah_nesting_level--;
+	}
+	PG_END_TRY();
+
+#if PG_VERSION_NUM >= 180000
+	if (explain_wrap)
+		ah_explain_wrap(queryDesc);
+#endif
+
+	if (!ah_sampled)
+		return;
+
+	ah_record_latency(AH_HOOK_EXECUTOR_START, start);
+	ah_trace_end(AH_HOOK_EXECUTOR_START, queryDesc->plannedstmt->queryId, InvalidOid, 0);
+	ah_memory_sample(queryDesc);
+
+	// totaltime collects time, buffer and WAL usage for ExecutorEnd
+	if (costly && ah_queries != NULL && queryDesc->plannedstmt->queryId != UINT64CONST(0) &&
+		queryDesc->totaltime == NULL && !IsParallelWorker())
+	{
+		MemoryContext oldcxt;
+
+		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL, false);
+		MemoryContextSwitchTo(oldcxt);
+	}
+}
+
+// ExecutorRun_hook
+void ah_ExecutorRun_hook(
+	QueryDesc *queryDesc,
+	ScanDirection direction,
+	uint64 count
+#if PG_VERSION_NUM < 180000
+	, bool execute_once
+#endif
+)
+{
+	instr_time	start;
+
+	INSTR_TIME_SET_ZERO(start);
+	if (ah_sampled)
+	{
+		ah_memory_sample(queryDesc);
+		ah_record_event(AH_HOOK_EXECUTOR_RUN, queryDesc->plannedstmt->queryId, InvalidOid);
+		ah_trace_begin(AH_HOOK_EXECUTOR_RUN, queryDesc->plannedstmt->queryId, InvalidOid, 0);
+		INSTR_TIME_SET_CURRENT(start);
+	}
+
+	ah_nesting_level++;
+	PG_TRY();
+	{
+		if (ah_original_ExecutorRun_hook)
+		{
+#if PG_VERSION_NUM < 180000
+			ah_original_ExecutorRun_hook(queryDesc, direction, count, execute_once);
+#else
+			ah_original_ExecutorRun_hook(queryDesc, direction, count);
+#endif
+
+		}
+		else
+		{
+#if PG_VERSION_NUM < 180000
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+#else
+			standard_ExecutorRun(queryDesc, direction, count);
+#endif
+		}
+	}
+	PG_FINALLY();
+	{
+		ah_nesting_level--;
+	}
+	PG_END_TRY();
+
+	if (ah_sampled)
+	{
+		ah_record_latency(AH_HOOK_EXECUTOR_RUN, start);
+		ah_trace_end(AH_HOOK_EXECUTOR_RUN, queryDesc->plannedstmt->queryId, InvalidOid, 0);
+		ah_memory_sample(queryDesc);
+	}
+}
+
+// ExecutorFinish_hook
+void ah_ExecutorFinish_hook(QueryDesc *queryDesc)
+{
+	instr_time	start;
+
+	INSTR_TIME_SET_ZERO(start);
+	if (ah_sampled)
+	{
+		ah_memory_sample(queryDesc);
+		ah_record_event(AH_HOOK_EXECUTOR_FINISH, queryDesc->plannedstmt->queryId, InvalidOid);
+		ah_trace_begin(AH_HOOK_EXECUTOR_FINISH, queryDesc->plannedstmt->queryId, InvalidOid, 0);
+		INSTR_TIME_SET_CURRENT(start);
+	}
+
+	ah_nesting_level++;
+	PG_TRY();
+	{
+		if (ah_original_ExecutorFinish_hook)
+		{
+			ah_original_ExecutorFinish_hook(queryDesc);
+		}
+		else
+		{
+			standard_ExecutorFinish(queryDesc);
+		}
+	}
+	PG_FINALLY();
+	{
+		ah_nesting_level--;
+	}
+	PG_END_TRY();
+
+	if (ah_sampled)
+	{
+		ah_record_latency(AH_HOOK_EXECUTOR_FINISH, start);
+		ah_trace_end(AH_HOOK_EXECUTOR_FINISH, queryDesc->plannedstmt->queryId, InvalidOid, 0);
+		ah_memory_sample(queryDesc);
+	}
+}
+
+// ExecutorEnd_hook
+void ah_ExecutorEnd_hook(QueryDesc *q)
+{
+	uint64		queryid = q->plannedstmt->queryId;
+	instr_time	start;
+
+	INSTR_TIME_SET_ZERO(start);
+	if (ah_sampled)
+	{
+		ah_record_event(AH_HOOK_EXECUTOR_END, queryid, InvalidOid);
+
+		// the leader accounts the whole query, with what its workers report
+		if (IsParallelWorker())
+		{
+			if (ah_parallel != NULL)
+				ah_parallel_worker_end(queryid);
+		}
+		else
+		{
+			ah_query_stats_add(q);
+			ah_estimates_add(q);
+			ah_nodes_add(q);
+			ah_memory_add(q);
+		}
+
+		ah_trace_begin(AH_HOOK_EXECUTOR_END, queryid, InvalidOid, 0);
+		INSTR_TIME_SET_CURRENT(start);
+	}
+
+	ah_nesting_level++;
+	PG_TRY();
+	{
+		if (ah_original_ExecutorEnd_hook)
+			ah_original_ExecutorEnd_hook(q);
+		else
+			standard_ExecutorEnd(q);
+	}
+	PG_FINALLY();
+	{
+		ah_nesting_level--;
+	}
+	PG_END_TRY();
+
+	if (ah_sampled)
+	{
+		ah_record_latency(AH_HOOK_EXECUTOR_END, start);
+		ah_trace_end(AH_HOOK_EXECUTOR_END, queryid, InvalidOid, 0);
+	}
+}
+
+// function profiler
+
+static void
+ah_function_stats_add(Oid funcid, uint64 total, uint64 self, bool abort)
+{
+	AHFunctionKey key;
+	AHFunctionEntry *entry;
+
+	if (ah_functions == NULL)
+		return;
+
+	key.dbid = MyDatabaseId;
+	key.funcid = funcid;
+
+	LWLockAcquire(ah_functions_lock, LW_SHARED);
+	entry = hash_search(ah_functions, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		bool		found;
+
+		LWLockRelease(ah_functions_lock);
+		LWLockAcquire(ah_functions_lock, LW_EXCLUSIVE);
+		// the table is full: the function is not tracked
+		entry = hash_search(ah_functions, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+		{
+			LWLockRelease(ah_functions_lock);
+			return;
+		}
+		if (!found)
+		{
+			SpinLockInit(&entry->mutex);
+			entry->calls = 0;
+			entry->aborts = 0;
+			entry->total = 0;
+			entry->self = 0;
+			entry->min = PG_UINT64_MAX;
+			entry->max = 0;
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->calls++;
+	if (abort)
+		entry->aborts++;
+	entry->total += total;
+	entry->self += self;
+	entry->min = Min(entry->min, total);
+	entry->max = Max(entry->max, total);
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(ah_functions_lock);
+}
+
+Datum
+all_hooks_functions(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHFunctionEntry *entry;
+
+	if (ah_functions == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_functions_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_functions);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		AHFunctionEntry tmp;
+		Datum		values[8];
+		bool		nulls[8] = {0};
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		values[0] = ObjectIdGetDatum(tmp.key.dbid);
+		values[1] = ObjectIdGetDatum(tmp.key.funcid);
+		values[2] = Int64GetDatum(tmp.calls);
+		values[3] = Int64GetDatum(tmp.aborts);
+		values[4] = Float8GetDatum(tmp.total / 1000000.0);
+		values[5] = Float8GetDatum(tmp.self / 1000000.0);
+		values[6] = Float8GetDatum(tmp.min / 1000000.0);
+		values[7] = Float8GetDatum(tmp.max / 1000000.0);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_functions_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_functions_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHFunctionEntry *entry;
+
+	if (ah_functions == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	LWLockAcquire(ah_functions_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, ah_functions);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(ah_functions, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(ah_functions_lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * fmgr_hook
+ *
+ * The private slot *arg is shared with any fmgr_hook chained after us, so
+ * the start time is kept on our own call stack, which also carries the
+ * nested time needed for self time.
+ */
+void ah_fmgr_hook(FmgrHookEventType event, FmgrInfo * flinfo, Datum *arg){
+
+	if (!ah_sampled)
+	{
+		if (ah_original_fmgr_hook)
+			ah_original_fmgr_hook(event, flinfo, arg);
+		return;
+	}
+
+	ah_record_event(AH_HOOK_FMGR, pgstat_get_my_query_id(), flinfo->fn_oid);
+
+	switch (event)
+	{
+		case FHET_START:
+			ah_trace_begin(AH_HOOK_FMGR, pgstat_get_my_query_id(), flinfo->fn_oid, 0);
+#if PG_VERSION_NUM >= 180000
+			if (ah_explain_query != NULL && ah_explain_node >= 0)
+				ah_explain_query->nodes[ah_explain_node].fmgr_calls++;
+#endif
+			if (ah_fn_depth < AH_FN_MAX_DEPTH)
+			{
+				ah_fn_stack[ah_fn_depth].start = ah_now_ns();
+				ah_fn_stack[ah_fn_depth].child = 0;
+			}
+			ah_fn_depth++;
+			break;
+
+		case FHET_END:
+		case FHET_ABORT:
+			// unbalanced, the hook was linked in the middle of a call
+			if (ah_fn_depth <= 0)
+				break;
+			ah_fn_depth--;
+			if (ah_fn_depth < AH_FN_MAX_DEPTH)
+			{
+				AHFunctionFrame *frame = &ah_fn_stack[ah_fn_depth];
+				uint64		total = ah_now_ns() - frame->start;
+				uint64		self = total > frame->child ? total - frame->child : 0;
+
+				if (ah_fn_depth > 0)
+					ah_fn_stack[ah_fn_depth - 1].child += total;
+				ah_function_stats_add(flinfo->fn_oid, total, self, event == FHET_ABORT);
+				if (IsParallelWorker())
+					ah_worker_function_calls++;
+			}
+			ah_trace_end(AH_HOOK_FMGR, pgstat_get_my_query_id(), flinfo->fn_oid, 0);
+			break;
+	}
+
+	if (ah_original_fmgr_hook)
+		ah_original_fmgr_hook(event,flinfo,arg);
+}
+
+// needs_fmgr_hook
+
+static bool
+ah_list_contains(const char *list, const char *name)
+{
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *l;
+	bool		found = false;
+
+	if (list == NULL || list[0] == '\0' || name == NULL)
+		return false;
+
+	rawstring = pstrdup(list);
+	if (SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		foreach(l, elemlist)
+		{
+			if (strcmp((char *) lfirst(l), name) == 0)
+			{
+				found = true;
+				break;
+			}
+		}
+	}
+	pfree(rawstring);
+	list_free(elemlist);
+
+	return found;
+}
+
+// whether the configuration selects this function, from the catalogs
+static bool
+ah_function_matches(Oid fn_oid)
+{
+	HeapTuple	tuple;
+	Form_pg_proc procform;
+	char	   *nspname;
+	char		oidstr[12];
+	bool		result;
+
+	tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
+	if (!HeapTupleIsValid(tuple))
+		return false;
+	procform = (Form_pg_proc) GETSTRUCT(tuple);
+
+	nspname = get_namespace_name(procform->pronamespace);
+	snprintf(oidstr, sizeof(oidstr), "%u", fn_oid);
+
+	result = ah_list_contains(ah_trace_functions, oidstr) ||
+		ah_list_contains(ah_trace_functions, NameStr(procform->proname)) ||
+		ah_list_contains(ah_trace_schemas, nspname) ||
+		ah_list_contains(ah_trace_languages, get_language_name(procform->prolang, true));
+
+	if (!result && nspname != NULL)
+	{
+		char	   *qualname = psprintf("%s.%s", nspname, NameStr(procform->proname));
+
+		result = ah_list_contains(ah_trace_functions, qualname);
+		pfree(qualname);
+	}
+
+	ReleaseSysCache(tuple);
+
+	return result;
+}
+
+static bool
+ah_function_is_traced(Oid fn_oid)
+{
+	AHTracedFunction *entry;
+	bool		found;
+	bool		traced;
+
+	if (ah_traced_functions_stale)
+	{
+		if (ah_traced_functions != NULL)
+			hash_destroy(ah_traced_functions);
+		ah_traced_functions = NULL;
+		ah_traced_functions_stale = false;
+		ah_trace_any = (ah_trace_functions && ah_trace_functions[0] != '\0') ||
+			(ah_trace_schemas && ah_trace_schemas[0] != '\0') ||
+			(ah_trace_languages && ah_trace_languages[0] != '\0');
+	}
+
+	if (!ah_trace_any || !IsTransactionState())
+		return false;
+
+	if (ah_traced_functions != NULL)
+	{
+		entry = hash_search(ah_traced_functions, &fn_oid, HASH_FIND, NULL);
+		if (entry != NULL)
+			return entry->traced;
+	}
+
+	// catalog lookups may process invalidations, so the hash is built after
+	traced = ah_function_matches(fn_oid);
+
+	if (ah_traced_functions_stale)
+		return traced;
+
+	if (ah_traced_functions == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(AHTracedFunction);
+		ctl.hcxt = TopMemoryContext;
+		ah_traced_functions = hash_create("all_hooks traced functions", 256, &ctl,
+										  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = hash_search(ah_traced_functions, &fn_oid, HASH_ENTER, &found);
+	entry->traced = traced;
+
+	return traced;
+}
+
+static void
+ah_assign_trace(const char *newval, void *extra)
+{
+	ah_traced_functions_stale = true;
+}
+
+static void
+ah_traced_functions_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+{
+	ah_traced_functions_stale = true;
+}
+
+/*
+ * Only functions selected by the all_hooks.trace_* settings go through
+ * fmgr_hook, the others keep their direct call path and can be inlined.
+ * This runs on every fmgr_info: an untraced function costs the local hash
+ * probe only, the event is recorded for the traced ones.
+ */
+bool ah_needs_fmgr_hook (Oid fn_oid)
+{
+	if (ah_original_needs_fmgr_hook && ah_original_needs_fmgr_hook(fn_oid))
+	{
+		return true;
+	}
+
+	if (!ah_function_is_traced(fn_oid))
+		return false;
+
+	if (ah_sampled)
+		ah_record_event(AH_HOOK_NEEDS_FMGR, pgstat_get_my_query_id(), fn_oid);
+	return true;
+}
+
+// PLPGSQL
+// PL/pgSQL statement profiler
+
+static const char *
+ah_plpgsql_stmt_typename(int cmd_type)
+{
+	switch ((PLpgSQL_stmt_type) cmd_type)
+	{
+		case PLPGSQL_STMT_BLOCK: return "BLOCK";
+		case PLPGSQL_STMT_ASSIGN: return "ASSIGN";
+		case PLPGSQL_STMT_IF: return "IF";
+		case PLPGSQL_STMT_CASE: return "CASE";
+		case PLPGSQL_STMT_LOOP: return "LOOP";
+		case PLPGSQL_STMT_WHILE: return "WHILE";
+		case PLPGSQL_STMT_FORI: return "FOR integer";
+		case PLPGSQL_STMT_FORS: return "FOR query";
+		case PLPGSQL_STMT_FORC: return "FOR cursor";
+		case PLPGSQL_STMT_FOREACH_A: return "FOREACH";
+		case PLPGSQL_STMT_EXIT: return "EXIT";
+		case PLPGSQL_STMT_RETURN: return "RETURN";
+		case PLPGSQL_STMT_RETURN_NEXT: return "RETURN NEXT";
+		case PLPGSQL_STMT_RETURN_QUERY: return "RETURN QUERY";
+		case PLPGSQL_STMT_RAISE: return "RAISE";
+		case PLPGSQL_STMT_ASSERT: return "ASSERT";
+		case PLPGSQL_STMT_EXECSQL: return "SQL statement";
+		case PLPGSQL_STMT_DYNEXECUTE: return "EXECUTE";
+		case PLPGSQL_STMT_DYNFORS: return "FOR EXECUTE";
+		case PLPGSQL_STMT_GETDIAG: return "GET DIAGNOSTICS";
+		case PLPGSQL_STMT_OPEN: return "OPEN";
+		case PLPGSQL_STMT_FETCH: return "FETCH";
+		case PLPGSQL_STMT_CLOSE: return "CLOSE";
+		case PLPGSQL_STMT_PERFORM: return "PERFORM";
+		case PLPGSQL_STMT_CALL: return "CALL";
+		case PLPGSQL_STMT_COMMIT: return "COMMIT";
+		case PLPGSQL_STMT_ROLLBACK: return "ROLLBACK";
+	}
+	return "unknown";
+}
+
+/*
+ * Add the statements of one execution to the shared table, under a single
+ * shared lock; the statements seen for the first time are then added under
+ * an exclusive lock.
+ */
+static void
+ah_plpgsql_flush(AHPlpgsqlInfo *info)
+{
+	int			missing = 0;
+
+	if (ah_statements == NULL)
+		return;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		LWLockAcquire(ah_statements_lock, pass == 0 ? LW_SHARED : LW_EXCLUSIVE);
+
+		for (unsigned int i = 0; i < info->nstatements; i++)
+		{
+			AHPlpgsqlStmtStats *st = &info->stmts[i];
+			AHStatementKey key;
+			AHStatementEntry *entry;
+			bool		found;
+
+			if (st->calls == 0)
+				continue;
+
+			memset(&key, 0, sizeof(key));
+			key.dbid = MyDatabaseId;
+			key.funcid = info->funcid;
+			key.lineno = st->lineno;
+			key.cmd_type = st->cmd_type;
+
+			if (pass == 0)
+				entry = hash_search(ah_statements, &key, HASH_FIND, NULL);
+			else
+			{
+				entry = hash_search(ah_statements, &key, HASH_ENTER_NULL, &found);
+				if (entry != NULL && !found)
+				{
+					SpinLockInit(&entry->mutex);
+					entry->calls = 0;
+					entry->total = 0;
+					entry->max = 0;
+				}
+			}
+			if (entry == NULL)
+			{
+				missing++;
+				continue;
+			}
+
+			SpinLockAcquire(&entry->mutex);
+			entry->calls += st->calls;
+			entry->total += st->total;
+			entry->max = Max(entry->max, st->max);
+			SpinLockRelease(&entry->mutex);
+
+			st->calls = 0;
+			st->total = 0;
+			st->max = 0;
+		}
+
+		LWLockRelease(ah_statements_lock);
+
+		if (missing == 0)
+			break;
+	}
+}
+
+// statements completed by a call an error ended
+static void
+ah_plpgsql_abort_flush(void *arg)
+{
+	AHPlpgsqlInfo *info = (AHPlpgsqlInfo *) arg;
+
+	if (!info->ended)
+		ah_plpgsql_flush(info);
+}
+
+// our state in estate->plugin_info, NULL if func_setup ran before we were linked
+static inline AHPlpgsqlInfo *
+ah_plpgsql_info(PLpgSQL_execstate *estate)
+{
+	AHPlpgsqlInfo *info = (AHPlpgsqlInfo *) estate->plugin_info;
+
+	if (info == NULL || info->estate != estate)
+		return NULL;
+	return info;
+}
+
+/*
+ * estate->plugin_info belongs to us; the chained plugin gets its own
+ * pointer back for the duration of its callback.
+ */
+#define AH_PLPGSQL_CHAIN(callback, estate, arg) \
+	do { \
+		if (ah_original_plpgsql_plugin && ah_original_plpgsql_plugin->callback) \
+		{ \
+			AHPlpgsqlInfo *ah_info = ah_plpgsql_info(estate); \
+			if (ah_info) \
+				(estate)->plugin_info = ah_info->chained_info; \
+			ah_original_plpgsql_plugin->callback((estate), (arg)); \
+			if (ah_info) \
+			{ \
+				ah_info->chained_info = (estate)->plugin_info; \
+				(estate)->plugin_info = ah_info; \
+			} \
+		} \
+	} while (0)
+
+static void ah_plpgsql_stmt_beg_hook(PLpgSQL_execstate * estate, PLpgSQL_stmt* stmt)
+{
+	AHPlpgsqlInfo *info = ah_plpgsql_info(estate);
+
+	if (!ah_sampled)
+	{
+		AH_PLPGSQL_CHAIN(stmt_beg, estate, stmt);
+		return;
+	}
+
+	ah_record_event(AH_HOOK_PLPGSQL_STMT_BEG, pgstat_get_my_query_id(), estate->func->fn_oid);
+
+	AH_PLPGSQL_CHAIN(stmt_beg, estate, stmt);
+
+	ah_trace_begin(AH_HOOK_PLPGSQL_STMT_BEG, pgstat_get_my_query_id(),
+				   estate->func->fn_oid, stmt->lineno);
+
+	if (info != NULL && stmt->stmtid > 0 && stmt->stmtid <= info->nstatements)
+	{
+		AHPlpgsqlStmtStats *st = &info->stmts[stmt->stmtid - 1];
+
+		st->lineno = stmt->lineno;
+		st->cmd_type = (int32) stmt->cmd_type;
+		st->start = ah_now_ns();
+	}
+}
+
+static void ah_plpgsql_stmt_end_hook(PLpgSQL_execstate * estate, PLpgSQL_stmt* stmt)
+{
+	AHPlpgsqlInfo *info = ah_plpgsql_info(estate);
+
+	if (!ah_sampled)
+	{
+		AH_PLPGSQL_CHAIN(stmt_end, estate, stmt);
+		return;
+	}
+
+	ah_trace_end(AH_HOOK_PLPGSQL_STMT_BEG, pgstat_get_my_query_id(),
+				 estate->func->fn_oid, stmt->lineno);
+
+	if (info != NULL && stmt->stmtid > 0 && stmt->stmtid <= info->nstatements)
+	{
+		AHPlpgsqlStmtStats *st = &info->stmts[stmt->stmtid - 1];
+
+		if (st->start != 0)
+		{
+			uint64		elapsed = ah_now_ns() - st->start;
+
+			st->calls++;
+			st->total += elapsed;
+			st->max = Max(st->max, elapsed);
+			st->start = 0;
+		}
+		if (IsParallelWorker())
+			ah_worker_plpgsql_statements++;
+	}
+
+	ah_record_event(AH_HOOK_PLPGSQL_STMT_END, pgstat_get_my_query_id(), estate->func->fn_oid);
+
+	AH_PLPGSQL_CHAIN(stmt_end, estate, stmt);
+}
+
+static void ah_plpgsql_func_setup_hook(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+{
+	AHPlpgsqlInfo *info;
+
+	// no state at all: the other hooks find no plugin_info of ours
+	if (!ah_sampled)
+	{
+		AH_PLPGSQL_CHAIN(func_setup, estate, func);
+		return;
+	}
+
+	ah_record_event(AH_HOOK_PLPGSQL_FUNC_SETUP, pgstat_get_my_query_id(), func->fn_oid);
+
+	// one timing slot per statement, indexed by stmtid
+	info = palloc0(offsetof(AHPlpgsqlInfo, stmts) +
+				   sizeof(AHPlpgsqlStmtStats) * func->nstatements);
+	info->estate = estate;
+	info->funcid = func->fn_oid;
+	info->nstatements = func->nstatements;
+	info->chained_info = estate->plugin_info;
+	estate->plugin_info = info;
+
+	// the context of the call goes away with it, normally or on error
+	info->abort_flush.func = ah_plpgsql_abort_flush;
+	info->abort_flush.arg = info;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, &info->abort_flush);
+
+	AH_PLPGSQL_CHAIN(func_setup, estate, func);
+}
+
+static void ah_plpgsql_func_beg_hook(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+{
+	if (!ah_sampled)
+	{
+		AH_PLPGSQL_CHAIN(func_beg, estate, func);
+		return;
+	}
+
+	ah_record_event(AH_HOOK_PLPGSQL_FUNC_BEG, pgstat_get_my_query_id(), func->fn_oid);
+
+	AH_PLPGSQL_CHAIN(func_beg, estate, func);
+
+	ah_trace_begin(AH_HOOK_PLPGSQL_FUNC_BEG, pgstat_get_my_query_id(), func->fn_oid, 0);
+}
+
+static void ah_plpgsql_func_end_hook(PLpgSQL_execstate *estate, PLpgSQL_function *func)
+{
+	AHPlpgsqlInfo *info = ah_plpgsql_info(estate);
+
+	if (ah_sampled)
+	{
+		ah_record_event(AH_HOOK_PLPGSQL_FUNC_END, pgstat_get_my_query_id(), func->fn_oid);
+
+		// begin and end records share the hook of the begin
+		ah_trace_end(AH_HOOK_PLPGSQL_FUNC_BEG, pgstat_get_my_query_id(), func->fn_oid, 0);
+	}
+
+	AH_PLPGSQL_CHAIN(func_end, estate, func);
+
+	if (info != NULL)
+	{
+		ah_plpgsql_flush(info);
+		info->ended = true;
+	}
+}
+
+Datum
+all_hooks_plpgsql_statements(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS hash_seq;
+	AHStatementEntry *entry;
+
+	if (ah_statements == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(ah_statements_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, ah_statements);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		AHStatementEntry tmp;
+		Datum		values[7];
+		bool		nulls[7] = {0};
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		values[0] = ObjectIdGetDatum(tmp.key.dbid);
+		values[1] = ObjectIdGetDatum(tmp.key.funcid);
+		values[2] = Int32GetDatum(tmp.key.lineno);
+		values[3] = CStringGetTextDatum(ah_plpgsql_stmt_typename(tmp.key.cmd_type));
+		values[4] = Int64GetDatum(tmp.calls);
+		values[5] = Float8GetDatum(tmp.total / 1000000.0);
+		values[6] = Float8GetDatum(tmp.max / 1000000.0);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(ah_statements_lock);
+
+	return (Datum) 0;
+}
+
+Datum
+all_hooks_plpgsql_statements_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AHStatementEntry *entry;
+
+	if (ah_statements == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("all_hooks must be loaded via \"shared_preload_libraries\"")));
+
+	LWLockAcquire(ah_statements_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, ah_statements);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(ah_statements, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(ah_statements_lock);
+
+	PG_RETURN_VOID();
+}
+
+// log shipping
+
+static Size
+ah_log_size(void)
+{
+	return add_size(offsetof(AHLogRing, records),
+					mul_size(ah_log_buffer_size, sizeof(AHLogRecord)));
+}
+
+/*
+ * Copy a message to the log ring, no allocation and no error possible here.
+ * False when the ring is full: the file misses it.
+ */
+static bool
+ah_log_enqueue(ErrorData *edata)
+{
+	uint64		pos;
+	AHLogRecord *rec;
+	const char *message = edata->message ? edata->message : "";
+	int			len;
+
+	if (pg_atomic_read_u64(&ah_log->head) - ah_log->tail >= (uint64) ah_log_buffer_size)
+	{
+		pg_atomic_fetch_add_u64(&ah_log->dropped, 1);
+		return false;
+	}
+
+	pos = pg_atomic_fetch_add_u64(&ah_log->head, 1);
+	rec = &ah_log->records[pos % ah_log_buffer_size];
+
+	pg_atomic_write_u64(&rec->seq, 0);
+	pg_write_barrier();
+
+	rec->ts = GetCurrentTimestamp();
+	rec->queryid = pgstat_get_my_query_id();
+	rec->pid = MyProcPid;
+	rec->elevel = edata->elevel;
+	rec->sqlerrcode = edata->sqlerrcode;
+	len = pg_mbcliplen(message, strlen(message), AH_LOG_MESSAGE_LEN - 1);
+	memcpy(rec->message, message, len);
+	rec->message[len] = '\0';
+
+	pg_write_barrier();
+	pg_atomic_write_u64(&rec->seq, pos + 1);
+
+	// wake the writer up early when the ring fills up
+	if (pos - ah_log->tail == (uint64) ah_log_buffer_size / 2 &&
+		ah_log->worker_latch != NULL)
+		SetLatch(ah_log->worker_latch);
+
+	return true;
+}
+
+static const char *
+ah_log_level_name(int elevel)
+{
+	switch (elevel)
+	{
+		case DEBUG5:
+		case DEBUG4:
+		case DEBUG3:
+		case DEBUG2:
+		case DEBUG1:
+			return "DEBUG";
+		case LOG:
+		case LOG_SERVER_ONLY:
+			return "LOG";
+		case INFO:
+			return "INFO";
+		case NOTICE:
+			return "NOTICE";
+		case WARNING:
+		case WARNING_CLIENT_ONLY:
+			return "WARNING";
+		case ERROR:
+			return "ERROR";
+		case FATAL:
+			return "FATAL";
+		case PANIC:
+			return "PANIC";
+	}
+	return "???";
+}
+
+/*
+ * Append every complete record of the ring to buf as JSON lines, and return
+ * their number.  Stops at the first record still being written, which the
+ * next round picks up.
+ */
+static int
+ah_log_drain(StringInfo buf)
+{
+	int			n = 0;
+	uint64		head = pg_atomic_read_u64(&ah_log->head);
+	uint64		pos = ah_log->tail;
+
+	if (head - pos > (uint64) ah_log_buffer_size)
+	{
+		pg_atomic_fetch_add_u64(&ah_log->dropped, head - pos - ah_log_buffer_size);
+		pos = head - ah_log_buffer_size;
+	}
+
+	for (; pos < head; pos++)
+	{
+		AHLogRecord *rec = &ah_log->records[pos % ah_log_buffer_size];
+		AHLogRecord copy;
+		uint64		seq;
+
+		seq = pg_atomic_read_u64(&rec->seq);
+		pg_read_barrier();
+		memcpy(&copy.ts, &rec->ts,
+			   sizeof(AHLogRecord) - offsetof(AHLogRecord, ts));
+		pg_read_barrier();
+
+		if (seq < pos + 1)
+			break;
+		if (seq != pos + 1 || pg_atomic_read_u64(&rec->seq) != seq)
+		{
+			pg_atomic_fetch_add_u64(&ah_log->dropped, 1);
+			continue;
+		}
+		copy.message[AH_LOG_MESSAGE_LEN - 1] = '\0';
+
+		appendStringInfoString(buf, "{\"ts\":");
+		escape_json(buf, timestamptz_to_str(copy.ts));
+		appendStringInfo(buf, ",\"pid\":%d,\"level\":\"%s\",\"sqlstate\":\"%s\",\"queryid\":" INT64_FORMAT ",\"message\":",
+						 copy.pid,
+						 ah_log_level_name(copy.elevel),
+						 unpack_sql_state(copy.sqlerrcode),
+						 (int64) copy.queryid);
+		escape_json(buf, copy.message);
+		appendStringInfoString(buf, "}\n");
+		n++;
+	}
+	ah_log->tail = pos;
+
+	return n;
+}
+
+// complain only once until the file can be opened again
+static int
+ah_log_open(bool *failed)
+{
+	int			fd;
+
+	if (ah_log_file == NULL || ah_log_file[0] == '\0')
+	{
+		pg_atomic_write_u32(&ah_log->writing, 0);
+		return -1;
+	}
+
+	fd = open(ah_log_file, O_WRONLY | O_APPEND | O_CREAT | PG_BINARY, pg_file_create_mode);
+	if (fd < 0 && !*failed)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", ah_log_file),
+				 errdetail("Messages stay in the server log until it can be opened.")));
+	*failed = fd < 0;
+	pg_atomic_write_u32(&ah_log->writing, fd >= 0 ? 1 : 0);
+	return fd;
+}
+
+// write the n records of buf, closing the file when it fails
+static void
+ah_log_write(int *fd, StringInfo buf, int n)
+{
+	if (n == 0)
+		return;
+
+	if (*fd < 0)
+		pg_atomic_fetch_add_u64(&ah_log->dropped, n);
+	else if (write(*fd, buf->data, buf->len) != buf->len)
+	{
+		int			save_errno = errno;
+
+		// before logging, so that this message is not redirected
+		pg_atomic_write_u32(&ah_log->writing, 0);
+		close(*fd);
+		*fd = -1;
+		pg_atomic_fetch_add_u64(&ah_log->dropped, n);
+
+		errno = save_errno;
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write to file \"%s\": %m", ah_log_file)));
+	}
+	resetStringInfo(buf);
+}
+
+void
+all_hooks_log_worker_main(Datum main_arg)
+{
+	StringInfoData buf;
+	int			fd;
+	int			n;
+	bool		open_failed = false;
+	uint64		dropped = 0;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	ah_log->worker_latch = &MyProc->procLatch;
+	initStringInfo(&buf);
+	fd = ah_log_open(&open_failed);
+
+	while (!ShutdownRequestPending)
+	{
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 ah_log_flush_interval,
+						 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		// a reload may change the file, and lets us reopen a rotated one
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			if (fd >= 0)
+				close(fd);
+			fd = -1;
+		}
+		// and after a failure, try again each round
+		if (fd < 0)
+			fd = ah_log_open(&open_failed);
+
+		n = ah_log_drain(&buf);
+		ah_log_write(&fd, &buf, n);
+
+		if (pg_atomic_read_u64(&ah_log->dropped) != dropped)
+		{
+			uint64		total = pg_atomic_read_u64(&ah_log->dropped);
+
+			ereport(LOG,
+					(errmsg("all_hooks log writer lost " UINT64_FORMAT " messages",
+							total - dropped),
+					 errdetail("The ring was full or the file could not be written."),
+					 errhint("Consider raising all_hooks.log_buffer_size.")));
+			dropped = total;
+		}
+	}
+
+	// last batch before leaving
+	n = ah_log_drain(&buf);
+	ah_log_write(&fd, &buf, n);
+	pg_atomic_write_u32(&ah_log->writing, 0);
+	if (fd >= 0)
+		close(fd);
+
+	ah_log->worker_latch = NULL;
+	proc_exit(0);
+}
+
+// emit_log_hook
+void ah_emit_log_hook(ErrorData * eData)
+{
+
+	// we avoid log looping when falling back to the server log
+	if (ah_events != NULL)
+	{
+		ah_record_event(AH_HOOK_EMIT_LOG, pgstat_get_my_query_id(), InvalidOid);
+	}
+	else if (!ah_emit_log_hook_warned && !ah_emit_log_hook_in_hook)
+	{
+		// once: a WARNING per message would double the log
+		ah_emit_log_hook_warned = true;
+		ah_emit_log_hook_in_hook = true;
+		elog(WARNING, "emit_log_hook called");
+		ah_emit_log_hook_in_hook = false;
+	}
+
+	// ship the message, the postmaster itself stays away from shared memory
+	if (ah_log != NULL && IsUnderPostmaster &&
+		ah_log_file != NULL && ah_log_file[0] != '\0' &&
+		eData->output_to_server)
+	{
+		if (ah_log_enqueue(eData) && ah_log_redirect &&
+			pg_atomic_read_u32(&ah_log->writing) != 0)
+			eData->output_to_server = false;
+	}
+
+	if (ah_original_emit_log_hook)
+	{
+		ah_original_emit_log_hook(eData);
+	}
+
+
+}
+
+//check_password_hook
+void ah_check_password_hook(const char *username, const char *shadow_pass, PasswordType password_type, Datum validuntil_time, bool validuntil_null)
+{
+
+	ah_record_event(AH_HOOK_CHECK_PASSWORD, 0, InvalidOid);
+
+	if (ah_original_check_password_hook)
+	{
+		ah_original_check_password_hook(username, shadow_pass, password_type, validuntil_time, validuntil_null);
+	}
+}
+
+void ah_ClientAuthentication_hook(Port * port, int status)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	uint64		auth_ns = now > MyStartTimestamp ? (uint64) (now - MyStartTimestamp) * 1000 : 0;
+
+	// reject abusive clients before any other module or the session runs
+	if (ah_clients != NULL)
+	{
+		long		retry;
+
+		if (ah_client_authenticate(port, status, auth_ns / 1000000.0, &retry))
+			ereport(FATAL,
+					(errcode(ERRCODE_TOO_MANY_CONNECTIONS),
+					 errmsg("too many connection attempts from host \"%s\"",
+							port->remote_host),
+					 retry > 0 ?
+					 errdetail("Too many failed authentications, retry in %ld ms.", retry) :
+					 errdetail("More than %g connections per second.", ah_auth_rate)));
+	}
+
+	// If any other extension registered its own hook handler,
+	// call it before performing our own logic.
+	if (ah_original_client_authentication_hook)
+		ah_original_client_authentication_hook(port, status);
+
+	// connection setup and authentication, from the backend start
+	if (ah_latency != NULL && auth_ns > 0)
+		ah_hist_add(&ah_latency->hist[AH_HOOK_CLIENT_AUTHENTICATION], auth_ns);
+
+	if (ah_events == NULL)
+	{
+		if (status != STATUS_OK)
+		{
+			elog(WARNING,"ah_ClientAuthentication_hook status KO");
+		}else{
+			elog(WARNING,"ah_ClientAuthentication_hook called OK");
+		}
+	}
+	else
+	{
+		ah_record_event(AH_HOOK_CLIENT_AUTHENTICATION, 0, InvalidOid);
+	}
+}
+
+// statistics file
+
+static bool
+ah_stats_write(FILE *file, pg_crc32c *crc, const void *data, Size len)
+{
+	COMP_CRC32C(*crc, data, len);
+	return fwrite(data, 1, len, file) == len;
+}
+
+// on_shmem_exit callback of the postmaster
+static void
+ah_stats_save(int code, Datum arg)
+{
+	const char *tmpfile = AH_STATS_FILE ".tmp";
+	FILE	   *file;
+	AHStatsHeader header;
+	AHStatsSection section;
+	pg_crc32c	crc;
+	uint64		size = sizeof(AHStatsHeader);
+
+	// after a crash the tables may be inconsistent
+	if (code != 0 || !ah_save_stats || ah_latency == NULL)
+		return;
+
+	file = AllocateFile(tmpfile, PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	// rewritten at the end, with the checksum
+	memset(&header, 0, sizeof(header));
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		goto error;
+
+	INIT_CRC32C(crc);
+
+	section.id = AH_STATS_LATENCY;
+	section.entry_size = sizeof(AHHistogram);
+	section.count = AH_NUM_HOOKS;
+	if (!ah_stats_write(file, &crc, &section, sizeof(section)))
+		goto error;
+	for (int hook = 0; hook < AH_NUM_HOOKS; hook++)
+	{
+		AHHistogram *hist = &ah_latency->hist[hook];
+		AHHistogram copy;
+
+		pg_atomic_init_u64(&copy.sum, pg_atomic_read_u64(&hist->sum));
+		pg_atomic_init_u64(&copy.max, pg_atomic_read_u64(&hist->max));
+		for (int i = 0; i < AH_HIST_BUCKETS; i++)
+			pg_atomic_init_u64(&copy.buckets[i], pg_atomic_read_u64(&hist->buckets[i]));
+		if (!ah_stats_write(file, &crc, &copy, sizeof(copy)))
+			goto error;
+	}
+	size += sizeof(section) + AH_NUM_HOOKS * sizeof(AHHistogram);
+
+	// no backend is left, the tables need no lock
+	for (int t = 0; t < lengthof(ah_stats_tables); t++)
+	{
+		const AHStatsTable *table = &ah_stats_tables[t];
+		HASH_SEQ_STATUS status;
+		void	   *entry;
+
+		section.id = table->id;
+		section.entry_size = table->entry_size;
+		section.count = hash_get_num_entries(*table->htab);
+		if (!ah_stats_write(file, &crc, &section, sizeof(section)))
+			goto error;
+
+		hash_seq_init(&status, *table->htab);
+		while ((entry = hash_seq_search(&status)) != NULL)
+		{
+			if (!ah_stats_write(file, &crc, entry, table->entry_size))
+			{
+				hash_seq_term(&status);
+				goto error;
+			}
+		}
+		size += sizeof(section) + section.count * table->entry_size;
+	}
+
+	FIN_CRC32C(crc);
+
+	memcpy(header.magic, AH_STATS_MAGIC, sizeof(AH_STATS_MAGIC));
+	header.version = AH_STATS_VERSION;
+	header.header_size = sizeof(AHStatsHeader);
+	header.nsections = 1 + lengthof(ah_stats_tables);
+	header.crc = crc;
+	header.size = size;
+	if (fseek(file, 0, SEEK_SET) != 0 ||
+		fwrite(&header, sizeof(header), 1, file) != 1)
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	(void) durable_rename(tmpfile, AH_STATS_FILE, LOG);
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m", tmpfile)));
+	if (file)
+		FreeFile(file);
+	unlink(tmpfile);
+}
+
+// check the sections of a mapped statistics file, NULL if it is usable
+static const char *
+ah_stats_check(const char *map, Size len)
+{
+	const AHStatsHeader *header = (const AHStatsHeader *) map;
+	Size		pos = sizeof(AHStatsHeader);
+	pg_crc32c	crc;
+
+	if (len < sizeof(AHStatsHeader) ||
+		memcmp(header->magic, AH_STATS_MAGIC, sizeof(AH_STATS_MAGIC)) != 0)
+		return "not an all_hooks statistics file";
+	if (header->version != AH_STATS_VERSION ||
+		header->header_size != sizeof(AHStatsHeader))
+		return "written by another version of all_hooks";
+	if (header->size != len ||
+		header->nsections != 1 + lengthof(ah_stats_tables))
+		return "truncated";
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, map + pos, len - pos);
+	FIN_CRC32C(crc);
+	if (!EQ_CRC32C(crc, header->crc))
+		return "checksum mismatch";
+
+	// the same sections, in the same order, as ah_stats_save writes them
+	for (uint32 s = 0; s < header->nsections; s++)
+	{
+		AHStatsSection section;
+		uint32		id = s == 0 ? AH_STATS_LATENCY : ah_stats_tables[s - 1].id;
+		Size		entry_size = s == 0 ? sizeof(AHHistogram) : ah_stats_tables[s - 1].entry_size;
+
+		if (len - pos < sizeof(section))
+			return "truncated";
+		memcpy(&section, map + pos, sizeof(section));
+		pos += sizeof(section);
+
+		if (section.id != id || section.entry_size != entry_size ||
+			(s == 0 && section.count != AH_NUM_HOOKS))
+			return "written by another version of all_hooks";
+		if (section.count > (len - pos) / entry_size)
+			return "truncated";
+		pos += section.count * entry_size;
+	}
+	if (pos != len)
+		return "truncated";
+
+	return NULL;
+}
 
-	elog(WARNING, "ExecutorRun_hook called");
+/*
+ * Restore the statistics saved by the last shutdown, in the postmaster.
+ *
+ * The file is mapped rather than read: entries are copied once, from the
+ * page cache to the shared tables.
+ */
+static void
+ah_stats_load(void)
+{
+	int			fd;
+	struct stat st;
+	char	   *map;
+	const char *problem;
+	Size		pos;
+	int64		dropped = 0;
+
+	fd = OpenTransientFile(AH_STATS_FILE, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", AH_STATS_FILE)));
+		return;
+	}
 
-	if (ah_original_ExecutorRun_hook)
+	if (fstat(fd, &st) < 0)
 	{
-#if PG_VERSION_NUM < 180000
-		ah_original_ExecutorRun_hook(queryDesc, direction, count, execute_once);
-#else
-		ah_original_ExecutorRun_hook(queryDesc, direction, count);
-#endif
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", AH_STATS_FILE)));
+		CloseTransientFile(fd);
+		unlink(AH_STATS_FILE);
+		return;
+	}
 
+	if (st.st_size == 0)
+	{
+		CloseTransientFile(fd);
+		unlink(AH_STATS_FILE);
+		return;
 	}
-	else
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	CloseTransientFile(fd);
+	if (map == MAP_FAILED)
 	{
-#if PG_VERSION_NUM < 180000
-		standard_ExecutorRun(queryDesc, direction, count, execute_once);
-#else
-		standard_ExecutorRun(queryDesc, direction, count);
-#endif
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not map file \"%s\": %m", AH_STATS_FILE)));
+		unlink(AH_STATS_FILE);
+		return;
 	}
-}
 
-// ExecutorFinish_hook
-void ah_ExecutorFinish_hook(QueryDesc *queryDesc)
-{
+	problem = ah_stats_check(map, st.st_size);
+	if (problem != NULL)
+	{
+		ereport(LOG,
+				(errmsg("ignoring all_hooks statistics file \"%s\": %s",
+						AH_STATS_FILE, problem)));
+		munmap(map, st.st_size);
+		unlink(AH_STATS_FILE);
+		return;
+	}
 
-	elog(WARNING, "ExecutorFinish_hook called");
-	if (ah_original_ExecutorFinish_hook)
+	pos = sizeof(AHStatsHeader) + sizeof(AHStatsSection);
+	for (int hook = 0; hook < AH_NUM_HOOKS; hook++)
 	{
-		ah_original_ExecutorFinish_hook(queryDesc);
+		AHHistogram *hist = &ah_latency->hist[hook];
+		AHHistogram saved;
+
+		memcpy(&saved, map + pos, sizeof(saved));
+		pg_atomic_write_u64(&hist->sum, pg_atomic_read_u64(&saved.sum));
+		pg_atomic_write_u64(&hist->max, pg_atomic_read_u64(&saved.max));
+		for (int i = 0; i < AH_HIST_BUCKETS; i++)
+			pg_atomic_write_u64(&hist->buckets[i], pg_atomic_read_u64(&saved.buckets[i]));
+		pos += sizeof(saved);
 	}
-	else
+
+	for (int t = 0; t < lengthof(ah_stats_tables); t++)
 	{
-		standard_ExecutorFinish(queryDesc);
+		const AHStatsTable *table = &ah_stats_tables[t];
+		AHStatsSection section;
+		Size		keysize = table->mutex_offset;	// the mutex follows the key
+
+		memcpy(&section, map + pos, sizeof(section));
+		pos += sizeof(section);
+
+		for (uint64 i = 0; i < section.count; i++)
+		{
+			const char *saved = map + pos + i * table->entry_size;
+			char	   *entry;
+			bool		found;
+
+			// the key is at the start of the entry
+			entry = hash_search(*table->htab, saved, HASH_ENTER_NULL, &found);
+			if (entry == NULL)
+			{
+				// all_hooks.max_* was lowered
+				dropped += section.count - i;
+				break;
+			}
+			memcpy(entry + keysize, saved + keysize, table->entry_size - keysize);
+			SpinLockInit((slock_t *) (entry + table->mutex_offset));
+			if (table->restored != NULL)
+				table->restored(entry);
+		}
+		pos += section.count * table->entry_size;
 	}
-}
 
-// ExecutorEnd_hook
-void ah_ExecutorEnd_hook(QueryDesc *q)
-{
-	elog(WARNING,"ExecutorEnd hook called");
-	if (ah_original_ExecutorEnd_hook)
-		ah_original_ExecutorEnd_hook(q);
-	else
-		standard_ExecutorEnd(q);
-}
+	munmap(map, st.st_size);
 
-// fmgr_hook
-void ah_fmgr_hook(FmgrHookEventType event, FmgrInfo * flinfo, Datum *arg){
+	if (dropped > 0)
+		ereport(LOG,
+				(errmsg("all_hooks could not restore " INT64_FORMAT " entries of \"%s\"",
+						dropped, AH_STATS_FILE),
+				 errhint("Increase the all_hooks.max_* settings.")));
 
-	elog(WARNING,"fmgr hook called");
-	if (ah_original_fmgr_hook)
-		ah_original_fmgr_hook(event,flinfo,arg);
+	// a crash must not bring these statistics back
+	unlink(AH_STATS_FILE);
 }
 
-// needs_fmgr_hook
-bool ah_needs_fmgr_hook (Oid fn_oid)
+//shmem_startup
+void ah_shmem_startup_hook(void)
 {
-	elog(WARNING, "needs_fmgr_hook_type called");
-	if (ah_original_needs_fmgr_hook)
-	{
-		elog(WARNING, "ah_original_needs_fmgr_hook called");
-		return ah_original_needs_fmgr_hook(fn_oid);
-	}else
+
+	bool		found;
+	bool		restore = false;
+
+	if (ah_original_shmem_startup_hook)
 	{
-		return true;
+		ah_original_shmem_startup_hook();
 	}
-}
 
-// PLPGSQL
-static void ah_plpgsql_stmt_beg_hook(PLpgSQL_execstate * estate, PLpgSQL_stmt* stmt)
-{
-	elog(WARNING,"stmt_beg hook called");
-	if (ah_original_plpgsql_plugin)
+	if (!ah_shmem_enabled)
 	{
-		if (ah_original_plpgsql_plugin->stmt_beg)
-		{
-			ah_original_plpgsql_plugin->stmt_beg(estate, stmt);
-		}
+		elog(WARNING,"shmem_startup_hook called");
+		return;
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
+	ah_events = ShmemInitStruct("all_hooks events", ah_events_size(), &found);
+	if (!found)
+	{
+		pg_atomic_init_u64(&ah_events->head, 0);
+		ah_events->tail = 0;
+		ah_events->dropped = 0;
+		ah_events->lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_EVENTS].lock;
+		for (int i = 0; i < ah_event_buffer_size; i++)
+			pg_atomic_init_u64(&ah_events->events[i].seq, 0);
 	}
-}
 
-static void ah_plpgsql_stmt_end_hook(PLpgSQL_execstate * estate, PLpgSQL_stmt* stmt)
-{
-	elog(WARNING,"stmt_end hook called");
-	if (ah_original_plpgsql_plugin)
+	ah_latency = ShmemInitStruct("all_hooks latency", sizeof(AHLatencyStats), &found);
+	if (!found)
 	{
-		if (ah_original_plpgsql_plugin->stmt_end)
+		for (int hook = 0; hook < AH_NUM_HOOKS; hook++)
 		{
-			ah_original_plpgsql_plugin->stmt_end(estate, stmt);
+			AHHistogram *hist = &ah_latency->hist[hook];
+
+			pg_atomic_init_u64(&hist->sum, 0);
+			pg_atomic_init_u64(&hist->max, 0);
+			for (int i = 0; i < AH_HIST_BUCKETS; i++)
+				pg_atomic_init_u64(&hist->buckets[i], 0);
 		}
+		restore = !IsUnderPostmaster;
+	}
+
+	ah_functions_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_FUNCTIONS].lock;
+	{
+		HASHCTL		info;
 
+		info.keysize = sizeof(AHFunctionKey);
+		info.entrysize = sizeof(AHFunctionEntry);
+		ah_functions = ShmemInitHash("all_hooks functions",
+									 ah_max_functions, ah_max_functions,
+									 &info, HASH_ELEM | HASH_BLOBS);
 	}
-}
 
-static void ah_plpgsql_func_setup_hook(PLpgSQL_execstate *estate, PLpgSQL_function *func)
-{
-	elog(WARNING,"func_setup hook called");
-	if (ah_original_plpgsql_plugin)
+	ah_statements_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_STATEMENTS].lock;
 	{
-		if (ah_original_plpgsql_plugin->func_setup)
-		{
-			ah_original_plpgsql_plugin->func_setup(estate, func);
-		}
+		HASHCTL		info;
+
+		info.keysize = sizeof(AHStatementKey);
+		info.entrysize = sizeof(AHStatementEntry);
+		ah_statements = ShmemInitHash("all_hooks plpgsql statements",
+									  ah_max_statements, ah_max_statements,
+									  &info, HASH_ELEM | HASH_BLOBS);
 	}
-}
 
-static void ah_plpgsql_func_beg_hook(PLpgSQL_execstate *estate, PLpgSQL_function *func)
-{
-	elog(WARNING,"func_beg hook called");
-	if (ah_original_plpgsql_plugin)
+	ah_queries_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_QUERIES].lock;
 	{
-		if (ah_original_plpgsql_plugin->func_beg)
-		{
-			ah_original_plpgsql_plugin->func_beg(estate, func);
-		}
+		HASHCTL		info;
 
+		info.keysize = sizeof(AHQueryKey);
+		info.entrysize = sizeof(AHQueryEntry);
+		ah_queries = ShmemInitHash("all_hooks queries",
+								   ah_max_queries, ah_max_queries,
+								   &info, HASH_ELEM | HASH_BLOBS);
 	}
-}
 
-static void ah_plpgsql_func_end_hook(PLpgSQL_execstate *estate, PLpgSQL_function *func)
-{
-	elog(WARNING,"func_end hook called");
-	if (ah_original_plpgsql_plugin)
+	ah_estimates_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_ESTIMATES].lock;
 	{
-		if (ah_original_plpgsql_plugin->func_end)
-		{
-			ah_original_plpgsql_plugin->func_end(estate, func);
-		}
+		HASHCTL		info;
 
+		info.keysize = sizeof(AHEstimateKey);
+		info.entrysize = sizeof(AHEstimateEntry);
+		ah_estimates = ShmemInitHash("all_hooks estimates",
+									 ah_max_plan_nodes, ah_max_plan_nodes,
+									 &info, HASH_ELEM | HASH_BLOBS);
 	}
 
-}
+	ah_nodes_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_NODES].lock;
+	{
+		HASHCTL		info;
 
-// emit_log_hook
-void ah_emit_log_hook(ErrorData * eData)
-{
+		info.keysize = sizeof(AHNodeKey);
+		info.entrysize = sizeof(AHNodeEntry);
+		ah_nodes = ShmemInitHash("all_hooks nodes",
+								 ah_max_plan_nodes, ah_max_plan_nodes,
+								 &info, HASH_ELEM | HASH_BLOBS);
+	}
 
-	// we avoid log looping
-	if (! ah_emit_log_hook_in_hook)
+	ah_memory_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_MEMORY].lock;
 	{
-		ah_emit_log_hook_in_hook = true;
-		elog(WARNING, "emit_log_hook called");
+		HASHCTL		info;
+
+		info.keysize = sizeof(AHMemoryKey);
+		info.entrysize = sizeof(AHMemoryEntry);
+		ah_memory = ShmemInitHash("all_hooks memory",
+								  ah_max_memory_queries, ah_max_memory_queries,
+								  &info, HASH_ELEM | HASH_BLOBS);
 	}
 
-	if (ah_original_emit_log_hook)
+	ah_parallel = ShmemInitStruct("all_hooks parallel",
+								  mul_size(MaxBackends, sizeof(AHParallelSlot)), &found);
+	if (!found)
 	{
-		ah_original_emit_log_hook(eData);
+		memset(ah_parallel, 0, mul_size(MaxBackends, sizeof(AHParallelSlot)));
+		for (int i = 0; i < MaxBackends; i++)
+			SpinLockInit(&ah_parallel[i].mutex);
 	}
 
+	ah_columns_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_COLUMNS].lock;
+	{
+		HASHCTL		info;
 
-}
+		info.keysize = sizeof(AHColumnKey);
+		info.entrysize = sizeof(AHColumnEntry);
+		ah_columns = ShmemInitHash("all_hooks columns",
+								   ah_max_columns, ah_max_columns,
+								   &info, HASH_ELEM | HASH_BLOBS);
+	}
 
-//check_password_hook
-void ah_check_password_hook(const char *username, const char *shadow_pass, PasswordType password_type, Datum validuntil_time, bool validuntil_null)
-{
+	ah_plans_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_PLANS].lock;
+	{
+		HASHCTL		info;
 
-	elog(WARNING,"check_password_hook called");
+		info.keysize = sizeof(AHPlanKey);
+		info.entrysize = sizeof(AHPlanEntry);
+		ah_plans = ShmemInitHash("all_hooks plans",
+								 ah_max_cached_plans, ah_max_cached_plans,
+								 &info, HASH_ELEM | HASH_BLOBS);
+	}
 
-	if (ah_original_check_password_hook)
+	ah_clients_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_CLIENTS].lock;
 	{
-		ah_original_check_password_hook(username, shadow_pass, password_type, validuntil_time, validuntil_null);
+		HASHCTL		info;
+
+		info.keysize = sizeof(AHClientKey);
+		info.entrysize = sizeof(AHClientEntry);
+		ah_clients = ShmemInitHash("all_hooks clients",
+								   ah_max_clients, ah_max_clients,
+								   &info, HASH_ELEM | HASH_BLOBS);
 	}
-}
 
-void ah_ClientAuthentication_hook(Port * port, int status)
-{
+	ah_utility_lock = &(GetNamedLWLockTranche(AH_LWLOCK_TRANCHE))[AH_LWLOCK_UTILITY].lock;
+	{
+		HASHCTL		info;
 
-	// If any other extension registered its own hook handler,
-	// call it before performing our own logic.
-	if (ah_original_client_authentication_hook)
-		ah_original_client_authentication_hook(port, status);
+		info.keysize = sizeof(AHUtilityKey);
+		info.entrysize = sizeof(AHUtilityEntry);
+		ah_utility = ShmemInitHash("all_hooks utility",
+								   ah_max_utility, ah_max_utility,
+								   &info, HASH_ELEM | HASH_BLOBS);
+	}
+
+	ah_plan_cache_shared = ShmemInitStruct("all_hooks plan cache",
+										   offsetof(AHPlanCache, area) + AH_PLAN_AREA_SIZE,
+										   &found);
+	if (!found)
+	{
+		dsa_area   *area;
+
+		ah_plan_cache_shared->tranche_id = LWLockNewTrancheId();
+		pg_atomic_init_u32(&ah_plan_cache_shared->nentries, 0);
+		pg_atomic_init_u32(&ah_plan_cache_shared->ninvalid, 0);
+		pg_atomic_init_u32(&ah_plan_cache_shared->nbackends, 0);
+		memset(ah_plan_cache_shared->depends, 0, sizeof(ah_plan_cache_shared->depends));
+		LWLockRegisterTranche(ah_plan_cache_shared->tranche_id, "all_hooks plan cache");
+
+		// backends attach when they first use it
+		area = dsa_create_in_place(ah_plan_cache_shared->area, AH_PLAN_AREA_SIZE,
+								   ah_plan_cache_shared->tranche_id, NULL);
+		dsa_set_size_limit(area, (size_t) ah_plan_cache_size * 1024 * 1024);
+		dsa_pin(area);
+		dsa_detach(area);
+	}
 
-	if (status != STATUS_OK)
+	ah_log = ShmemInitStruct("all_hooks log", ah_log_size(), &found);
+	if (!found)
 	{
-		elog(WARNING,"ah_ClientAuthentication_hook status KO");
-	}else{
-		elog(WARNING,"ah_ClientAuthentication_hook called OK");
+		pg_atomic_init_u64(&ah_log->head, 0);
+		ah_log->tail = 0;
+		pg_atomic_init_u64(&ah_log->dropped, 0);
+		pg_atomic_init_u32(&ah_log->writing, 0);
+		ah_log->worker_latch = NULL;
+		for (int i = 0; i < ah_log_buffer_size; i++)
+			pg_atomic_init_u64(&ah_log->records[i].seq, 0);
 	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	// the postmaster saves the statistics when it shuts down
+	if (!IsUnderPostmaster)
+		on_shmem_exit(ah_stats_save, (Datum) 0);
+	if (restore && ah_save_stats)
+		ah_stats_load();
+
+	ah_record_event(AH_HOOK_SHMEM_STARTUP, 0, InvalidOid);
 }
 
-//shmem_startup
-void ah_shmem_startup_hook(void)
+// shmem_request
+static void ah_shmem_request_hook(void)
 {
-
-	if (ah_original_shmem_startup_hook)
+	if (ah_original_shmem_request_hook)
 	{
-		ah_original_shmem_startup_hook();
+		ah_original_shmem_request_hook();
 	}
-	elog(WARNING,"shmem_startup_hook called");
 
+	RequestAddinShmemSpace(ah_events_size());
+	RequestAddinShmemSpace(sizeof(AHLatencyStats));
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_functions, sizeof(AHFunctionEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_statements, sizeof(AHStatementEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_queries, sizeof(AHQueryEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_plan_nodes, sizeof(AHEstimateEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_plan_nodes, sizeof(AHNodeEntry)));
+	RequestAddinShmemSpace(mul_size(MaxBackends, sizeof(AHParallelSlot)));
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_memory_queries, sizeof(AHMemoryEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_columns, sizeof(AHColumnEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_cached_plans, sizeof(AHPlanEntry)));
+	RequestAddinShmemSpace(offsetof(AHPlanCache, area) + AH_PLAN_AREA_SIZE);
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_clients, sizeof(AHClientEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(ah_max_utility, sizeof(AHUtilityEntry)));
+	RequestAddinShmemSpace(ah_log_size());
+	RequestNamedLWLockTranche(AH_LWLOCK_TRANCHE, AH_NUM_LWLOCKS);
 }
 
 
@@ -500,7 +7034,12 @@ static void ah_explain_per_node_hook(PlanState *planstate, List *ancestors,
 									const char *plan_name,
 									ExplainState *es)
 {
-	elog(WARNING,"explain_per_node_hook called");
+	if (ah_sampled)
+		ah_record_event(AH_HOOK_EXPLAIN_PER_NODE, planstate->state->es_plannedstmt->queryId, InvalidOid);
+
+	if (ah_explain_hooks_enabled(es))
+		ah_explain_show_node(planstate, es);
+
 	if (ah_original_explain_per_node_hook)
 	{
 		ah_original_explain_per_node_hook(planstate, ancestors, relationship, plan_name, es);
@@ -517,12 +7056,19 @@ QueryEnvironment *queryEnv)
 {
 	if (ah_original_explain_per_plan_hook)
 		ah_original_explain_per_plan_hook(plannedstmt, into, es, queryString, params, queryEnv);
-	elog(WARNING,"explain_per_plan_hook called");
+	if (ah_sampled)
+		ah_record_event(AH_HOOK_EXPLAIN_PER_PLAN, plannedstmt->queryId, InvalidOid);
+
+	if (ah_explain_hooks_enabled(es))
+	{
+		ah_explain_show_planning(es);
+		memset(&ah_explain_plan_phases, 0, sizeof(ah_explain_plan_phases));
+		ah_explain_pending = false;
+	}
 
 }
 #endif
 
-#if PG_VERSION_NUM >= 180000
 	/*
 	 * Allow to editorialize on the set of Paths for this base
 	 * relation.  It could add new paths (such as CustomPaths) by calling
@@ -532,35 +7078,55 @@ QueryEnvironment *queryEnv)
 
 static void ah_set_rel_pathlist_hook(PlannerInfo *root, RelOptInfo *rel,
 		Index rti, RangeTblEntry *rte){
-	char rtekind_str[16];
 
-	switch (rte->rtekind)
+	if (!ah_sampled)
 	{
-		case RTE_RELATION : strcpy(rtekind_str,"RELATION");
-		break;
-		case RTE_SUBQUERY : strcpy(rtekind_str,"SUBQUERY");
-		break;
-		case RTE_JOIN : strcpy(rtekind_str,"JOIN");
-		break;
-		case RTE_FUNCTION : strcpy(rtekind_str,"FUNCTION");
-		break;
-		case RTE_TABLEFUNC : strcpy(rtekind_str,"TABLEFUNC");
-		break;
-		case RTE_VALUES : strcpy(rtekind_str,"VALUES");
-		break;
-		case RTE_CTE : strcpy(rtekind_str,"CTE");
-		break;
-		case RTE_NAMEDTUPLESTORE : strcpy(rtekind_str,"NAMEDTUPLESTORE");
-		break;
-		case RTE_RESULT : strcpy(rtekind_str,"RESULT");
-		break;
-		case RTE_GROUP : strcpy(rtekind_str,"GROUP");
-		break;
+		if (ah_original_set_rel_pathlist_hook)
+			ah_original_set_rel_pathlist_hook(root, rel, rti, rte);
+		return;
+	}
+
+	if (ah_track_columns)
+		ah_columns_add(root, rel, rti, rte);
 
-		default : strcpy(rtekind_str,"unknown");
+	if (ah_events != NULL)
+	{
+		ah_record_event(AH_HOOK_SET_REL_PATHLIST, root->parse->queryId, rte->relid);
 	}
+	else
+	{
+		char rtekind_str[16];
+
+		switch (rte->rtekind)
+		{
+			case RTE_RELATION : strcpy(rtekind_str,"RELATION");
+			break;
+			case RTE_SUBQUERY : strcpy(rtekind_str,"SUBQUERY");
+			break;
+			case RTE_JOIN : strcpy(rtekind_str,"JOIN");
+			break;
+			case RTE_FUNCTION : strcpy(rtekind_str,"FUNCTION");
+			break;
+			case RTE_TABLEFUNC : strcpy(rtekind_str,"TABLEFUNC");
+			break;
+			case RTE_VALUES : strcpy(rtekind_str,"VALUES");
+			break;
+			case RTE_CTE : strcpy(rtekind_str,"CTE");
+			break;
+			case RTE_NAMEDTUPLESTORE : strcpy(rtekind_str,"NAMEDTUPLESTORE");
+			break;
+			case RTE_RESULT : strcpy(rtekind_str,"RESULT");
+			break;
+#if PG_VERSION_NUM >= 180000
+			case RTE_GROUP : strcpy(rtekind_str,"GROUP");
+			break;
+#endif
+
+			default : strcpy(rtekind_str,"unknown");
+		}
 
 		elog(WARNING,"set_rel_pathlist_hook called: %s",rtekind_str);
+	}
 
 	// preserve hooks chaining
 	if (ah_original_set_rel_pathlist_hook){
@@ -568,7 +7134,115 @@ static void ah_set_rel_pathlist_hook(PlannerInfo *root, RelOptInfo *rel,
 	}
 
 }
-#endif
+
+// planning phases
+
+// paths kept in a relation, partial ones included
+static inline int64
+ah_rel_paths(RelOptInfo *rel)
+{
+	return list_length(rel->pathlist) + list_length(rel->partial_pathlist);
+}
+
+// join_search_hook, called for each join problem larger than one relation
+static RelOptInfo *
+ah_join_search_hook(PlannerInfo *root, int levels_needed, List *initial_rels)
+{
+	AHPlanPhases *p = ah_plan_phases;
+	RelOptInfo *result;
+	instr_time	start;
+	int			nrels;
+	bool		geqo_search = false;
+	ListCell   *lc;
+
+	INSTR_TIME_SET_ZERO(start);
+	if (p != NULL)
+	{
+		ah_record_event(AH_HOOK_JOIN_SEARCH, root->parse->queryId, InvalidOid);
+		ah_trace_begin(AH_HOOK_JOIN_SEARCH, root->parse->queryId, InvalidOid, levels_needed);
+		INSTR_TIME_SET_CURRENT(start);
+		if (p->join_start == 0)
+			p->join_start = ah_now_ns();
+	}
+	nrels = list_length(root->join_rel_list);
+
+	// without a hook, make_rel_from_joinlist chooses between these two
+	if (ah_original_join_search_hook)
+		result = ah_original_join_search_hook(root, levels_needed, initial_rels);
+	else if (enable_geqo && levels_needed >= geqo_threshold)
+	{
+		geqo_search = true;
+		result = geqo(root, levels_needed, initial_rels);
+	}
+	else
+		result = standard_join_search(root, levels_needed, initial_rels);
+
+	if (p == NULL)
+		return result;
+
+	p->join_ns += ah_record_latency(AH_HOOK_JOIN_SEARCH, start);
+	p->join_end = ah_now_ns();
+	ah_trace_end(AH_HOOK_JOIN_SEARCH, root->parse->queryId, InvalidOid, levels_needed);
+
+	p->join_searches++;
+	if (geqo_search)
+		p->geqo_searches++;
+	foreach(lc, initial_rels)
+	{
+		RelOptInfo *rel = lfirst_node(RelOptInfo, lc);
+
+		if (rel->reloptkind == RELOPT_BASEREL)
+			p->base_paths += ah_rel_paths(rel);
+	}
+	// GEQO throws away the joinrels of the tours it evaluates
+	for (int i = nrels; i < list_length(root->join_rel_list); i++)
+		p->join_paths += ah_rel_paths(list_nth_node(RelOptInfo, root->join_rel_list, i));
+	p->joinrels += Max(list_length(root->join_rel_list) - nrels, 0);
+
+	return result;
+}
+
+// set_join_pathlist_hook, once per pair of relations joined
+static void
+ah_set_join_pathlist_hook(PlannerInfo *root, RelOptInfo *joinrel,
+						  RelOptInfo *outerrel, RelOptInfo *innerrel,
+						  JoinType jointype, JoinPathExtraData *extra)
+{
+	if (ah_original_set_join_pathlist_hook)
+		ah_original_set_join_pathlist_hook(root, joinrel, outerrel, innerrel, jointype, extra);
+
+	if (ah_plan_phases == NULL)
+		return;
+
+	ah_record_event(AH_HOOK_SET_JOIN_PATHLIST, root->parse->queryId, InvalidOid);
+	ah_plan_phases->join_pairs++;
+}
+
+// create_upper_paths_hook, at the end of each upper planning stage
+static void
+ah_create_upper_paths_hook(PlannerInfo *root, UpperRelationKind stage,
+						   RelOptInfo *input_rel, RelOptInfo *output_rel,
+						   void *extra)
+{
+	AHPlanPhases *p = ah_plan_phases;
+
+	if (ah_original_create_upper_paths_hook)
+		ah_original_create_upper_paths_hook(root, stage, input_rel, output_rel, extra);
+
+	if (p == NULL)
+		return;
+
+	ah_record_event(AH_HOOK_CREATE_UPPER_PATHS, root->parse->queryId, (Oid) stage);
+	p->upper_last = ah_now_ns();
+	if (p->upper_first == 0)
+	{
+		p->upper_first = p->upper_last;
+		// a single relation, no join search counted its paths
+		if (p->join_searches == 0 && input_rel->reloptkind == RELOPT_BASEREL)
+			p->base_paths += ah_rel_paths(input_rel);
+	}
+	p->upper_paths += ah_rel_paths(output_rel);
+}
 
 // objectaccess
 
@@ -591,7 +7265,24 @@ static void ah_object_access_hook(ObjectAccessType access,Oid classId, Oid objec
 		default : accessName= "unknown";
 
 	}
-	elog(WARNING, "object_access_hook called: class %u / object %u / %s", classId,objectId, accessName);
+	// DDL of this backend drops the cached plans at once, others wait for
+	// the invalidation messages
+	if (access == OAT_DROP || access == OAT_POST_ALTER)
+	{
+		if (classId == RelationRelationId)
+			ah_plan_cache_invalidate(objectId, -1, 0);
+		else if (classId == ProcedureRelationId)
+			ah_plan_cache_invalidate(InvalidOid, PROCOID,
+									 GetSysCacheHashValue1(PROCOID, ObjectIdGetDatum(objectId)));
+		else if (classId == TypeRelationId)
+			ah_plan_cache_invalidate(InvalidOid, TYPEOID,
+									 GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(objectId)));
+	}
+
+	if (ah_events == NULL)
+		elog(WARNING, "object_access_hook called: class %u / object %u / %s", classId,objectId, accessName);
+	else if (ah_sampled)
+		ah_record_event(AH_HOOK_OBJECT_ACCESS, pgstat_get_my_query_id(), objectId);
 
 	if (ah_original_object_access_hook)
 	{
@@ -603,7 +7294,8 @@ static void ah_object_access_hook(ObjectAccessType access,Oid classId, Oid objec
 
 static void ah_object_access_hook_str(ObjectAccessType access, Oid classId,const char *objectStr,int subId,void *arg)
 {
-	elog(WARNING, "object_access_hook_str called");
+	if (ah_sampled)
+		ah_record_event(AH_HOOK_OBJECT_ACCESS_STR, pgstat_get_my_query_id(), InvalidOid);
 	if (ah_original_object_access_hook_str)
 	{
 		ah_original_object_access_hook_str(access, classId,objectStr,subId,arg);
@@ -633,7 +7325,8 @@ static const char * ah_explain_get_index_name_hook(Oid indexId)
 		}
 	}
 
-	elog(WARNING, "explain_get_index_name_hook called: %s",result);
+	if (ah_sampled)
+		ah_record_event(AH_HOOK_EXPLAIN_GET_INDEX_NAME, pgstat_get_my_query_id(), indexId);
 	return result;
 
 }
@@ -645,11 +7338,248 @@ static void ah_explain_validate_options_hook (struct ExplainState *es,
 										   	List *options,
 											ParseState *pstate)
 {
-	elog(WARNING, "explain_validate_options_hook called");
+	if (ah_sampled)
+		ah_record_event(AH_HOOK_EXPLAIN_VALIDATE_OPTIONS, pgstat_get_my_query_id(), InvalidOid);
+
+	if (ah_original_explain_validate_option_hook)
+		ah_original_explain_validate_option_hook(es, options, pstate);
+}
+#endif
+
+
+// all_hooks.enabled
+
+/*
+ * Link our function at the head of a hook chain, or unlink it.  Unlinking is
+ * only possible while we are still at the head: if another module chained
+ * itself after us, we stay linked rather than break its chain.
+ */
+#define AH_SWITCH(id, hook, ours, original, enable) \
+	do { \
+		if ((enable) && !ah_linked[id]) \
+		{ \
+			elog(DEBUG1, "hooking: %s", ah_hook_names[id]); \
+			original = hook; \
+			hook = ours; \
+			ah_linked[id] = true; \
+		} \
+		else if (!(enable) && ah_linked[id]) \
+		{ \
+			if (hook == ours) \
+			{ \
+				elog(DEBUG1, "unhooking: %s", ah_hook_names[id]); \
+				hook = original; \
+				ah_linked[id] = false; \
+			} \
+			else \
+				elog(LOG, "all_hooks: %s cannot be unlinked, another module is chained after it", \
+					 ah_hook_names[id]); \
+		} \
+	} while (0)
+
+static void
+ah_switch_group(int group, bool enable)
+{
+	PLpgSQL_plugin **plugin_ptr;
 
+	switch ((AHHookGroup) group)
+	{
+		case AH_GROUP_PLANNER:
+			AH_SWITCH(AH_HOOK_PLANNER, planner_hook, ah_planner_hook,
+					  ah_original_planner_hook, enable);
+			AH_SWITCH(AH_HOOK_SET_REL_PATHLIST, set_rel_pathlist_hook, ah_set_rel_pathlist_hook,
+					  ah_original_set_rel_pathlist_hook, enable);
+			AH_SWITCH(AH_HOOK_JOIN_SEARCH, join_search_hook, ah_join_search_hook,
+					  ah_original_join_search_hook, enable);
+			AH_SWITCH(AH_HOOK_SET_JOIN_PATHLIST, set_join_pathlist_hook, ah_set_join_pathlist_hook,
+					  ah_original_set_join_pathlist_hook, enable);
+			AH_SWITCH(AH_HOOK_CREATE_UPPER_PATHS, create_upper_paths_hook, ah_create_upper_paths_hook,
+					  ah_original_create_upper_paths_hook, enable);
+			break;
+
+		case AH_GROUP_EXECUTOR:
+			AH_SWITCH(AH_HOOK_EXECUTOR_START, ExecutorStart_hook, ah_ExecutorStart_hook,
+					  ah_original_ExecutorStart_hook, enable);
+			AH_SWITCH(AH_HOOK_EXECUTOR_RUN, ExecutorRun_hook, ah_ExecutorRun_hook,
+					  ah_original_ExecutorRun_hook, enable);
+			AH_SWITCH(AH_HOOK_EXECUTOR_FINISH, ExecutorFinish_hook, ah_ExecutorFinish_hook,
+					  ah_original_ExecutorFinish_hook, enable);
+			AH_SWITCH(AH_HOOK_EXECUTOR_END, ExecutorEnd_hook, ah_ExecutorEnd_hook,
+					  ah_original_ExecutorEnd_hook, enable);
+			AH_SWITCH(AH_HOOK_EXECUTOR_CHECK_PERMS, ExecutorCheckPerms_hook, ah_ExecutorCheckPerms_hook,
+					  ah_original_ExecutorCheckPerms_hook, enable);
+			break;
+
+		case AH_GROUP_UTILITY:
+			AH_SWITCH(AH_HOOK_PROCESS_UTILITY, ProcessUtility_hook, ah_ProcessUtility_hook,
+					  ah_original_ProcessUtility_hook, enable);
+			break;
+
+		case AH_GROUP_FMGR:
+			// a fresh link cannot see the end of calls already running
+			if (enable && !ah_linked[AH_HOOK_FMGR])
+				ah_fn_depth = 0;
+			AH_SWITCH(AH_HOOK_NEEDS_FMGR, needs_fmgr_hook, ah_needs_fmgr_hook,
+					  ah_original_needs_fmgr_hook, enable);
+			AH_SWITCH(AH_HOOK_FMGR, fmgr_hook, ah_fmgr_hook,
+					  ah_original_fmgr_hook, enable);
+			break;
+
+		case AH_GROUP_PLPGSQL:
+			/* Link us into the PL/pgSQL executor. */
+			plugin_ptr = (PLpgSQL_plugin **) find_rendezvous_variable("PLpgSQL_plugin");
+			AH_SWITCH(AH_HOOK_PLPGSQL_FUNC_SETUP, *plugin_ptr, &ah_plugin_funcs,
+					  ah_original_plpgsql_plugin, enable);
+			break;
+
+		case AH_GROUP_AUTH:
+			AH_SWITCH(AH_HOOK_CHECK_PASSWORD, check_password_hook, ah_check_password_hook,
+					  ah_original_check_password_hook, enable);
+			AH_SWITCH(AH_HOOK_CLIENT_AUTHENTICATION, ClientAuthentication_hook, ah_ClientAuthentication_hook,
+					  ah_original_client_authentication_hook, enable);
+			break;
+
+		case AH_GROUP_EXPLAIN:
+#if PG_VERSION_NUM >= 180000
+			AH_SWITCH(AH_HOOK_EXPLAIN_PER_NODE, explain_per_node_hook, ah_explain_per_node_hook,
+					  ah_original_explain_per_node_hook, enable);
+			AH_SWITCH(AH_HOOK_EXPLAIN_PER_PLAN, explain_per_plan_hook, ah_explain_per_plan_hook,
+					  ah_original_explain_per_plan_hook, enable);
+			AH_SWITCH(AH_HOOK_EXPLAIN_VALIDATE_OPTIONS, explain_validate_options_hook, ah_explain_validate_options_hook,
+					  ah_original_explain_validate_option_hook, enable);
+#endif
+			AH_SWITCH(AH_HOOK_EXPLAIN_GET_INDEX_NAME, explain_get_index_name_hook, ah_explain_get_index_name_hook,
+					  ah_original_explain_get_index_name_hook, enable);
+			break;
+
+		case AH_GROUP_OBJECT_ACCESS:
+			AH_SWITCH(AH_HOOK_OBJECT_ACCESS, object_access_hook, ah_object_access_hook,
+					  ah_original_object_access_hook, enable);
+			AH_SWITCH(AH_HOOK_OBJECT_ACCESS_STR, object_access_hook_str, ah_object_access_hook_str,
+					  ah_original_object_access_hook_str, enable);
+			break;
+
+		case AH_GROUP_EMIT_LOG:
+			AH_SWITCH(AH_HOOK_EMIT_LOG, emit_log_hook, ah_emit_log_hook,
+					  ah_original_emit_log_hook, enable);
+			break;
+
+		case AH_NUM_GROUPS:
+			break;
+	}
 }
+
+static bool
+ah_check_enabled(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *l;
+	int			mask = 0;
+	int		   *myextra;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	foreach(l, elemlist)
+	{
+		char	   *tok = (char *) lfirst(l);
+		int			group;
+
+		if (pg_strcasecmp(tok, "all") == 0)
+		{
+			mask = AH_ALL_GROUPS;
+			continue;
+		}
+		if (pg_strcasecmp(tok, "none") == 0)
+			continue;
+
+		for (group = 0; group < AH_NUM_GROUPS; group++)
+		{
+			if (pg_strcasecmp(tok, ah_group_names[group]) == 0)
+				break;
+		}
+		if (group == AH_NUM_GROUPS)
+		{
+			GUC_check_errdetail("Unrecognized hook group: \"%s\".", tok);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+		mask |= 1 << group;
+	}
+
+	pfree(rawstring);
+	list_free(elemlist);
+
+#if PG_VERSION_NUM >= 160000
+	myextra = (int *) guc_malloc(LOG, sizeof(int));
+#else
+	myextra = (int *) malloc(sizeof(int));
 #endif
+	if (!myextra)
+		return false;
+	*myextra = mask;
+	*extra = myextra;
+
+	return true;
+}
+
+static void
+ah_switch_groups(int mask)
+{
+	for (int group = 0; group < AH_NUM_GROUPS; group++)
+		ah_switch_group(group, (mask & (1 << group)) != 0);
+}
+
+/*
+ * SET or set_config() can run in the middle of a statement, and relinking
+ * then would call an End hook without its Start: a change made in a
+ * transaction is applied when it ends.  Outside of one (reload, library
+ * load, GUC rollback at the end of the transaction), it is applied now.
+ */
+static void
+ah_assign_enabled(const char *newval, void *extra)
+{
+	int			mask = *((int *) extra);
+
+	if (IsTransactionState())
+		ah_pending_groups = mask;
+	else
+	{
+		ah_pending_groups = -1;
+		ah_switch_groups(mask);
+	}
+}
+
+static void
+ah_enabled_xact_callback(XactEvent event, void *arg)
+{
+	int			mask = ah_pending_groups;
 
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			if (mask >= 0)
+			{
+				ah_pending_groups = -1;
+				ah_switch_groups(mask);
+			}
+			break;
+		default:
+			break;
+	}
+}
 
 // --------------------------------------
 // --------------------------------------
@@ -674,124 +7604,503 @@ void _PG_init(void)
 	// Will be called one aty the extension load
 	// and for each parallel worker
 
-	PLpgSQL_plugin **plugin_ptr;
-
 	elog(WARNING, "all_hooks init");
 
+	// shared memory is only available when preloaded
+	if (process_shared_preload_libraries_in_progress)
+	{
+		ah_shmem_enabled = true;
+
+		DefineCustomIntVariable("all_hooks.event_buffer_size",
+								"Number of hook events kept in the shared ring buffer.",
+								NULL,
+								&ah_event_buffer_size,
+								65536,
+								1024,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.max_functions",
+								"Number of functions tracked by the function profiler.",
+								NULL,
+								&ah_max_functions,
+								1000,
+								100,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.max_statements",
+								"Number of PL/pgSQL statements tracked by the line profiler.",
+								NULL,
+								&ah_max_statements,
+								5000,
+								100,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.max_queries",
+								"Number of queryIds tracked by the query statistics.",
+								NULL,
+								&ah_max_queries,
+								5000,
+								100,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.max_memory_queries",
+								"Number of queryIds tracked by the query memory statistics.",
+								"Each takes about 1.3 kB of shared memory, even with all_hooks.track_memory off.",
+								&ah_max_memory_queries,
+								1000,
+								100,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.max_plan_nodes",
+								"Number of (queryId, plan node) pairs tracked by the estimate statistics, and of (queryId, node type) by the node statistics.",
+								NULL,
+								&ah_max_plan_nodes,
+								10000,
+								100,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.max_columns",
+								"Number of table columns tracked by the index advisor.",
+								NULL,
+								&ah_max_columns,
+								10000,
+								100,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.max_cached_plans",
+								"Number of plans the shared plan cache holds.",
+								NULL,
+								&ah_max_cached_plans,
+								1000,
+								100,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.plan_cache_size",
+								"Memory the serialized plans of the shared plan cache can use.",
+								NULL,
+								&ah_plan_cache_size,
+								64,
+								1,
+								INT_MAX / 1024,
+								PGC_POSTMASTER,
+								GUC_UNIT_MB,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.max_clients",
+								"Number of client addresses tracked by the authentication statistics.",
+								NULL,
+								&ah_max_clients,
+								1000,
+								100,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.max_utility",
+								"Number of (command, relation) tracked by the utility statistics.",
+								NULL,
+								&ah_max_utility,
+								1000,
+								100,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomBoolVariable("all_hooks.save_stats",
+								 "Save the statistics across server shutdowns.",
+								 NULL,
+								 &ah_save_stats,
+								 true,
+								 PGC_SIGHUP,
+								 0,
+								 NULL,
+								 NULL,
+								 NULL);
+
+		DefineCustomRealVariable("all_hooks.auth_rate",
+								 "Authentications per second allowed from one client address, 0 for no limit.",
+								 NULL,
+								 &ah_auth_rate,
+								 0.0,
+								 0.0,
+								 1000000.0,
+								 PGC_SIGHUP,
+								 0,
+								 NULL,
+								 NULL,
+								 NULL);
+
+		DefineCustomIntVariable("all_hooks.auth_burst",
+								"Authentications one client address can make at once above all_hooks.auth_rate.",
+								NULL,
+								&ah_auth_burst,
+								20,
+								1,
+								INT_MAX,
+								PGC_SIGHUP,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.auth_backoff",
+								"Time a client address is rejected after a failed authentication, 0 to disable.",
+								"Doubles with each further failure in a row.",
+								&ah_auth_backoff,
+								0,
+								0,
+								INT_MAX,
+								PGC_SIGHUP,
+								GUC_UNIT_MS,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.auth_backoff_max",
+								"Longest time a client address is rejected after failed authentications.",
+								NULL,
+								&ah_auth_backoff_max,
+								60000,
+								0,
+								INT_MAX,
+								PGC_SIGHUP,
+								GUC_UNIT_MS,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("all_hooks.log_buffer_size",
+								"Number of log messages the shared ring holds for the log writer.",
+								NULL,
+								&ah_log_buffer_size,
+								8192,
+								128,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomStringVariable("all_hooks.log_file",
+								   "File the log writer appends messages to, as JSON lines.",
+								   "Relative to the data directory; empty disables log shipping.",
+								   &ah_log_file,
+								   "",
+								   PGC_SIGHUP,
+								   0,
+								   NULL,
+								   NULL,
+								   NULL);
+
+		DefineCustomBoolVariable("all_hooks.log_redirect",
+								 "Only ship messages to all_hooks.log_file, not to the server log.",
+								 NULL,
+								 &ah_log_redirect,
+								 false,
+								 PGC_SIGHUP,
+								 0,
+								 NULL,
+								 NULL,
+								 NULL);
+
+		DefineCustomIntVariable("all_hooks.log_flush_interval",
+								"Time between two writes of the log writer.",
+								NULL,
+								&ah_log_flush_interval,
+								1000,
+								10,
+								60000,
+								PGC_SIGHUP,
+								GUC_UNIT_MS,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomBoolVariable("all_hooks.track_estimates",
+								 "Compare the row estimate of each plan node with its actual rows.",
+								 NULL,
+								 &ah_track_estimates,
+								 false,
+								 PGC_SUSET,
+								 0,
+								 NULL,
+								 NULL,
+								 NULL);
+
+		DefineCustomBoolVariable("all_hooks.track_memory",
+								 "Collect the peak and final memory of each query execution.",
+								 NULL,
+								 &ah_track_memory,
+								 false,
+								 PGC_SUSET,
+								 0,
+								 NULL,
+								 NULL,
+								 NULL);
+
+		DefineCustomIntVariable("all_hooks.log_memory_min",
+								"Peak query memory from which its memory contexts are logged, -1 to disable.",
+								"Needs all_hooks.track_memory.",
+								&ah_log_memory_min,
+								-1,
+								-1,
+								INT_MAX,
+								PGC_SUSET,
+								GUC_UNIT_KB,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomBoolVariable("all_hooks.track_nodes",
+								 "Collect buffer, WAL and memory usage per plan node type.",
+								 NULL,
+								 &ah_track_nodes,
+								 false,
+								 PGC_SUSET,
+								 0,
+								 NULL,
+								 NULL,
+								 NULL);
+
+		DefineCustomBoolVariable("all_hooks.track_columns",
+								 "Count the filters and joins on each table column, for the index advisor.",
+								 NULL,
+								 &ah_track_columns,
+								 false,
+								 PGC_SUSET,
+								 0,
+								 NULL,
+								 NULL,
+								 NULL);
+
+		DefineCustomBoolVariable("all_hooks.plan_cache",
+								 "Reuse the plans of top-level statements across backends.",
+								 "Custom plans of statements with parameters are not shared.",
+								 &ah_plan_cache,
+								 false,
+								 PGC_SUSET,
+								 0,
+								 NULL,
+								 ah_assign_plan_cache,
+								 NULL);
+
+		DefineCustomIntVariable("all_hooks.lock_sample_interval",
+								"Interval between two samples of the lock waits of utility statements, 0 to disable.",
+								NULL,
+								&ah_lock_sample_interval,
+								0,
+								0,
+								INT_MAX,
+								PGC_SUSET,
+								GUC_UNIT_MS,
+								ah_check_lock_sample_interval,
+								NULL,
+								NULL);
+
+		// the query statistics are keyed by queryId
+		EnableQueryId();
+
+		// log writer
+		{
+			BackgroundWorker worker;
+
+			memset(&worker, 0, sizeof(worker));
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+			worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+			worker.bgw_restart_time = 10;
+			snprintf(worker.bgw_library_name, BGW_MAXLEN, "all_hooks");
+			snprintf(worker.bgw_function_name, BGW_MAXLEN, "all_hooks_log_worker_main");
+			snprintf(worker.bgw_name, BGW_MAXLEN, "all_hooks log writer");
+			snprintf(worker.bgw_type, BGW_MAXLEN, "all_hooks log writer");
+			RegisterBackgroundWorker(&worker);
+		}
 
-	elog(WARNING,"hooking: plpgsql");
-	/* Link us into the PL/pgSQL executor. */
-	plugin_ptr = (PLpgSQL_plugin **)find_rendezvous_variable("PLpgSQL_plugin");
-	ah_original_plpgsql_plugin = *plugin_ptr;
-	*plugin_ptr = &ah_plugin_funcs;
-
+		// shmem_request_hook
+		elog(WARNING,"hooking: shmem_request_hook");
+		ah_original_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = ah_shmem_request_hook;
+	}
 
 	// shmem_startup_hook
 	elog(WARNING,"hooking: shmem_startup_hook");
 	ah_original_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = ah_shmem_startup_hook;
 
-	// planner_hook
-	elog(WARNING,"hooking: planner_hook");
-	ah_original_planner_hook = planner_hook;
-	planner_hook = ah_planner_hook;
-
-	// ProcessUtility_hook
-	elog(WARNING,"hooking: ProcessUtility_hook");
-	ah_original_ProcessUtility_hook = ProcessUtility_hook;
-	ProcessUtility_hook = ah_ProcessUtility_hook;
-
-	// ExecutorStart_hook
-	elog(WARNING,"hooking: ExecutorStart_hook");
-	ah_original_ExecutorStart_hook = ExecutorStart_hook;
-	ExecutorStart_hook = ah_ExecutorStart_hook;
-
-	//ExecutorRun_hook
-	elog(WARNING,"hooking: ExecutorRun_hook");
-	ah_original_ExecutorRun_hook = ExecutorRun_hook;
-	ExecutorRun_hook = ah_ExecutorRun_hook;
-
-	//ExecutorEnd_hook
-	elog(WARNING,"hooking: ExecutorEnd_hook");
-	ah_original_ExecutorEnd_hook = ExecutorEnd_hook;
-	ExecutorEnd_hook = ah_ExecutorEnd_hook;
-
-	// ExecutorCheckPerms_hook
-	elog(WARNING,"hooking: ExecutorCheckPerms_hook");
-	ah_original_ExecutorCheckPerms_hook = ExecutorCheckPerms_hook;
-	ExecutorCheckPerms_hook = ah_ExecutorCheckPerms_hook;
-
-	//ExecutorFinish_hook_type
-	elog(WARNING,"hooking: ExecutorFinish_hook");
-	ah_original_ExecutorFinish_hook = ExecutorFinish_hook;
-	ExecutorFinish_hook = ah_ExecutorFinish_hook;
-
-	// needs_fmgr_hook
-	elog(WARNING,"hooking: needs_fmgr_hook");
-	ah_original_needs_fmgr_hook = needs_fmgr_hook;
-	needs_fmgr_hook = ah_needs_fmgr_hook;
-
-	// fmgr_hook
-	elog(WARNING,"hooking: fmgr_hook");
-	ah_original_fmgr_hook = fmgr_hook;
-	fmgr_hook = ah_fmgr_hook;
-
-	// check_password_hook
-	elog(WARNING,"hooking: check_password_hook");
-	ah_original_check_password_hook = check_password_hook;
-	check_password_hook = ah_check_password_hook;
-
-	// ClientAuthentication_hook
-	elog(WARNING,"hooking: ClientAuthentication_hook");
-	ah_original_client_authentication_hook = ClientAuthentication_hook;
-	ClientAuthentication_hook = ah_ClientAuthentication_hook;
-
-
-	// explain_hook
-#if PG_VERSION_NUM >= 180000
-	// per_node_hook
-	elog(WARNING,"hooking: explain_per_node_hook");
-	ah_original_explain_per_node_hook = explain_per_node_hook;
-	explain_per_node_hook = ah_explain_per_node_hook;
-
-	// per_plan_hook
-	elog(WARNING,"hooking: explain_per_plan_hook");
-	ah_original_explain_per_plan_hook = explain_per_plan_hook;
-	explain_per_plan_hook = ah_explain_per_plan_hook;
-
-	// set_rel_pathlist_hook
-	elog(WARNING,"hooking: set_rel_pathlist_hook");
-	ah_original_set_rel_pathlist_hook = set_rel_pathlist_hook;
-	set_rel_pathlist_hook = ah_set_rel_pathlist_hook;
-
-#endif
-
-	// object_access_hook
-	elog(WARNING,"hooking: object_access_hook");
-	ah_original_object_access_hook = object_access_hook;
-	object_access_hook = ah_object_access_hook;
-
-	// object_access_hook_str
-	elog(WARNING,"hooking: object_access_hook_str");
-	ah_original_object_access_hook_str = object_access_hook_str;
-	object_access_hook_str = ah_object_access_hook_str;
-
-	// explain_get_index_name_hook
-	elog(WARNING,"hooking: explain_get_index_name_hook");
-	ah_original_explain_get_index_name_hook = explain_get_index_name_hook;
-	explain_get_index_name_hook = ah_explain_get_index_name_hook;
+	// all_hooks.enabled links the requested hooks from its assign hook
+	RegisterXactCallback(ah_enabled_xact_callback, NULL);
+	DefineCustomStringVariable("all_hooks.enabled",
+							   "Comma-separated list of hook groups to link in.",
+							   "Valid groups are planner, executor, utility, fmgr, plpgsql, "
+							   "auth, explain, object_access, emit_log, or all / none.",
+							   &ah_enabled_string,
+							   "all",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   ah_check_enabled,
+							   ah_assign_enabled,
+							   NULL);
+
+	DefineCustomStringVariable("all_hooks.trace_functions",
+							   "Functions routed through fmgr_hook, by name, schema.name or oid.",
+							   NULL,
+							   &ah_trace_functions,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   NULL,
+							   ah_assign_trace,
+							   NULL);
+
+	DefineCustomStringVariable("all_hooks.trace_schemas",
+							   "Schemas whose functions are routed through fmgr_hook.",
+							   NULL,
+							   &ah_trace_schemas,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   NULL,
+							   ah_assign_trace,
+							   NULL);
+
+	DefineCustomStringVariable("all_hooks.trace_languages",
+							   "Languages whose functions are routed through fmgr_hook.",
+							   NULL,
+							   &ah_trace_languages,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   NULL,
+							   ah_assign_trace,
+							   NULL);
+
+	DefineCustomRealVariable("all_hooks.sample_rate",
+							 "Fraction of top-level statements whose hooks record anything.",
+							 "The decision applies to every hook nested in the statement.",
+							 &ah_sample_rate,
+							 1.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("all_hooks.min_plan_cost",
+							 "Plan cost below which statements are not instrumented, 0 to instrument all.",
+							 NULL,
+							 &ah_min_plan_cost,
+							 0.0,
+							 0.0,
+							 DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("all_hooks.trace_directory",
+							   "Directory of the per-backend binary trace files, empty to disable.",
+							   NULL,
+							   &ah_trace_directory,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   NULL,
+							   ah_assign_trace_directory,
+							   NULL);
+
+	DefineCustomIntVariable("all_hooks.trace_file_size",
+							"Size of each binary trace file, allocated when tracing starts.",
+							NULL,
+							&ah_trace_file_size,
+							32,
+							1,
+							INT_MAX / 1024,
+							PGC_SUSET,
+							GUC_UNIT_MB,
+							NULL,
+							NULL,
+							NULL);
+
+	MarkGUCPrefixReserved("all_hooks");
+
+	RegisterXactCallback(ah_trace_xact_callback, NULL);
+	RegisterSubXactCallback(ah_trace_subxact_callback, NULL);
+
+	// forget the peaks of the queries an error ended
+	RegisterXactCallback(ah_memory_xact_callback, NULL);
+	RegisterSubXactCallback(ah_memory_subxact_callback, NULL);
 
 #if PG_VERSION_NUM >= 180000
-	// explain_validate_options_hook
-	elog(WARNING,"hooking: explain_validate_options_hook");
-	ah_original_explain_validate_option_hook = explain_validate_options_hook;
-	explain_validate_options_hook = ah_explain_validate_options_hook;
+	// EXPLAIN (HOOKS)
+	ah_explain_id = GetExplainExtensionId("all_hooks");
+	RegisterExtensionExplainOption("hooks", ah_explain_hooks_handler);
+	RegisterXactCallback(ah_explain_xact_callback, NULL);
 #endif
 
-	// emit_log_hook
-	elog(WARNING,"hooking: emit_log_hook");
-	ah_original_emit_log_hook = emit_log_hook;
-	emit_log_hook = ah_emit_log_hook;
+	// keep the traced functions cache in sync with the catalogs
+	CacheRegisterSyscacheCallback(PROCOID, ah_traced_functions_invalidate, (Datum) 0);
+	CacheRegisterSyscacheCallback(NAMESPACEOID, ah_traced_functions_invalidate, (Datum) 0);
+	CacheRegisterSyscacheCallback(LANGOID, ah_traced_functions_invalidate, (Datum) 0);
+
+	// and the shared plan cache, as the core plan cache does
+	CacheRegisterRelcacheCallback(ah_plan_cache_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(PROCOID, ah_plan_cache_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(TYPEOID, ah_plan_cache_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(OPEROID, ah_plan_cache_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(AMOPOPID, ah_plan_cache_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(FOREIGNSERVEROID, ah_plan_cache_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(FOREIGNDATAWRAPPEROID, ah_plan_cache_syscache_callback, (Datum) 0);
 }
 
 // Called with extension unload.
@@ -799,29 +8108,16 @@ void _PG_fini(void)
 {
 	// Return back the original hook value.
 
-	PLpgSQL_plugin **plugin_ptr;
-	plugin_ptr = (PLpgSQL_plugin **)find_rendezvous_variable("PLpgSQL_plugin");
-	*plugin_ptr = ah_original_plpgsql_plugin;
-	ah_original_plpgsql_plugin = NULL;
-
-	ClientAuthentication_hook = ah_original_client_authentication_hook;
-	ExecutorEnd_hook = ah_original_ExecutorEnd_hook;
-	planner_hook = ah_original_planner_hook;
-	ProcessUtility_hook = ah_original_ProcessUtility_hook;
-	ExecutorStart_hook = ah_original_ExecutorStart_hook;
-	ExecutorRun_hook = ah_original_ExecutorRun_hook;
-	ExecutorEnd_hook = ah_original_ExecutorEnd_hook;
-	ExecutorFinish_hook = ah_original_ExecutorFinish_hook;
-	ExecutorCheckPerms_hook = ah_original_ExecutorCheckPerms_hook;
-	emit_log_hook = ah_original_emit_log_hook;
-	fmgr_hook = ah_original_fmgr_hook;
-	check_password_hook = ah_original_check_password_hook;
+	for (int group = 0; group < AH_NUM_GROUPS; group++)
+		ah_switch_group(group, false);
+
 	shmem_startup_hook = ah_original_shmem_startup_hook;
+	shmem_request_hook = ah_original_shmem_request_hook;
+
+	UnregisterXactCallback(ah_trace_xact_callback, NULL);
+	UnregisterSubXactCallback(ah_trace_subxact_callback, NULL);
 #if PG_VERSION_NUM >= 180000
-	explain_per_plan_hook = ah_original_explain_per_plan_hook;
-	explain_per_node_hook = ah_original_explain_per_node_hook;
-	set_rel_pathlist_hook = ah_original_set_rel_pathlist_hook;
-	explain_get_index_name_hook = ah_original_explain_get_index_name_hook;
-	explain_validate_options_hook = ah_original_explain_validate_option_hook;
+	UnregisterXactCallback(ah_explain_xact_callback, NULL);
 #endif
+	ah_trace_close();
 }
@@ -0,0 +1,57 @@
+/*-------------------------------------------------------------------------
+ *
+ * all_hooks_trace.h
+ *
+ * Binary trace format written by all_hooks and read by all_hooks_trace2json.
+ *
+ * A trace file belongs to one backend.  It is allocated at its full size
+ * when the backend starts tracing and memory-mapped: a header, followed by
+ * "capacity" fixed-size records, of which the first "nrecords" are valid.
+ * Values are in the byte order of the server.  Any change to these structs
+ * must bump AH_TRACE_VERSION.
+ *
+ * Copyright (c) 2025, Franck Boudehen, Dalibo
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef ALL_HOOKS_TRACE_H
+#define ALL_HOOKS_TRACE_H
+
+#include <stdint.h>
+
+#define AH_TRACE_MAGIC		"AHTRACE"
+#define AH_TRACE_VERSION	1
+
+#define AH_TRACE_MAX_HOOKS	32
+#define AH_TRACE_NAME_LEN	32
+
+// record phases, as in the Chrome trace-event format
+#define AH_TRACE_BEGIN		'B'
+#define AH_TRACE_END		'E'
+
+typedef struct AHTraceHeader
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	header_size;	// sizeof(AHTraceHeader)
+	uint32_t	record_size;	// sizeof(AHTraceRecord)
+	int32_t		pid;
+	uint64_t	capacity;		// records allocated
+	uint64_t	nrecords;		// records written
+	int64_t		start_time;		// Unix epoch, in microseconds
+	char		hook_names[AH_TRACE_MAX_HOOKS][AH_TRACE_NAME_LEN];
+} AHTraceHeader;
+
+typedef struct AHTraceRecord
+{
+	uint64_t	ts;				// nanoseconds since start_time
+	uint64_t	queryid;
+	uint32_t	objid;			// function, relation... depending on the hook
+	int32_t		arg;			// line number for PL/pgSQL statements
+	uint16_t	hook;			// index in hook_names
+	uint8_t		phase;			// AH_TRACE_BEGIN or AH_TRACE_END
+	uint8_t		depth;			// nesting level, 0 for the outermost hook
+	uint32_t	reserved;
+} AHTraceRecord;
+
+#endif							/* ALL_HOOKS_TRACE_H */
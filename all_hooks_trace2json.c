@@ -0,0 +1,166 @@
+/*-------------------------------------------------------------------------
+ *
+ * all_hooks_trace2json
+ *
+ * Convert the binary trace files written by all_hooks into the Chrome
+ * trace-event JSON format, for chrome://tracing or Perfetto:
+ *
+ *		all_hooks_trace2json $PGDATA/trace/all_hooks_trace.*.bin > trace.json
+ *
+ * Each file becomes one process.  Timestamps are aligned on the earliest
+ * file, since each backend counts from the creation of its own file.
+ *
+ * Copyright (c) 2025, Franck Boudehen, Dalibo
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "all_hooks_trace.h"
+
+static const char *progname = "all_hooks_trace2json";
+
+static int
+read_header(const char *path, FILE *f, AHTraceHeader *header)
+{
+	if (fread(header, sizeof(AHTraceHeader), 1, f) != 1)
+	{
+		fprintf(stderr, "%s: could not read header of \"%s\"\n", progname, path);
+		return -1;
+	}
+	if (memcmp(header->magic, AH_TRACE_MAGIC, sizeof(AH_TRACE_MAGIC)) != 0)
+	{
+		fprintf(stderr, "%s: \"%s\" is not an all_hooks trace file\n", progname, path);
+		return -1;
+	}
+	if (header->version != AH_TRACE_VERSION ||
+		header->header_size != sizeof(AHTraceHeader) ||
+		header->record_size != sizeof(AHTraceRecord))
+	{
+		fprintf(stderr, "%s: \"%s\" has unsupported version %u\n",
+				progname, path, header->version);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+print_string(const char *str, size_t maxlen)
+{
+	putchar('"');
+	for (size_t i = 0; i < maxlen && str[i] != '\0'; i++)
+	{
+		unsigned char c = (unsigned char) str[i];
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static int
+convert(const char *path, int64_t origin, int *first)
+{
+	FILE	   *f;
+	AHTraceHeader header;
+	AHTraceRecord rec;
+	uint64_t	n;
+	double		offset;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "%s: could not open \"%s\": %s\n", progname, path, strerror(errno));
+		return -1;
+	}
+	if (read_header(path, f, &header) != 0)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	// microseconds, as expected by the trace viewers
+	offset = (double) (header.start_time - origin);
+
+	printf("%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+		   "\"args\":{\"name\":\"backend %d\"}}",
+		   *first ? "" : ",", header.pid, header.pid, header.pid);
+	*first = 0;
+
+	n = header.nrecords < header.capacity ? header.nrecords : header.capacity;
+	for (uint64_t i = 0; i < n; i++)
+	{
+		if (fread(&rec, sizeof(rec), 1, f) != 1)
+		{
+			fprintf(stderr, "%s: \"%s\" is truncated after %" PRIu64 " records\n",
+					progname, path, i);
+			break;
+		}
+		if (rec.phase != AH_TRACE_BEGIN && rec.phase != AH_TRACE_END)
+			continue;
+
+		printf(",\n{\"name\":");
+		if (rec.hook < AH_TRACE_MAX_HOOKS && header.hook_names[rec.hook][0] != '\0')
+			print_string(header.hook_names[rec.hook], AH_TRACE_NAME_LEN);
+		else
+			printf("\"hook %u\"", rec.hook);
+		printf(",\"cat\":\"all_hooks\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+			   "\"args\":{\"queryid\":\"%" PRId64 "\",\"objid\":%u,\"arg\":%d,\"depth\":%u}}",
+			   rec.phase, offset + rec.ts / 1000.0, header.pid, header.pid,
+			   (int64_t) rec.queryid, rec.objid, rec.arg, rec.depth);
+	}
+
+	if (header.nrecords >= header.capacity)
+		fprintf(stderr, "%s: \"%s\" is full, later hooks were not recorded\n",
+				progname, path);
+
+	fclose(f);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int64_t		origin = INT64_MAX;
+	int			first = 1;
+	int			status = 0;
+
+	if (argc < 2 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0)
+	{
+		printf("Usage: %s FILE... > trace.json\n", progname);
+		return argc < 2 ? 1 : 0;
+	}
+
+	// first pass for the common time origin
+	for (int i = 1; i < argc; i++)
+	{
+		FILE	   *f = fopen(argv[i], "rb");
+		AHTraceHeader header;
+
+		if (f == NULL)
+			continue;
+		if (fread(&header, sizeof(header), 1, f) == 1 &&
+			memcmp(header.magic, AH_TRACE_MAGIC, sizeof(AH_TRACE_MAGIC)) == 0 &&
+			header.start_time < origin)
+			origin = header.start_time;
+		fclose(f);
+	}
+	if (origin == INT64_MAX)
+		origin = 0;
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (int i = 1; i < argc; i++)
+		if (convert(argv[i], origin, &first) != 0)
+			status = 1;
+	printf("\n]}\n");
+
+	return status;
+}
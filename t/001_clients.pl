@@ -0,0 +1,86 @@
+# Rate limit and backoff of the client authentication hook, over TCP with
+# password authentication.  Unix socket connections are only counted.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('clients');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'all_hooks'
+listen_addresses = '127.0.0.1'
+all_hooks.auth_backoff = '1min'
+});
+$node->start;
+
+$node->safe_psql('postgres', q{
+CREATE EXTENSION all_hooks;
+CREATE ROLE regress_ah_client LOGIN PASSWORD 'secret';
+});
+
+# password over TCP for the test role, trust anywhere else
+unlink($node->data_dir . '/pg_hba.conf');
+$node->append_conf('pg_hba.conf', qq{
+host all regress_ah_client 127.0.0.1/32 scram-sha-256
+local all all trust
+host all all 127.0.0.1/32 trust
+});
+$node->reload;
+
+my $tcp = $node->connstr('postgres') . ' host=127.0.0.1 user=regress_ah_client';
+
+sub client_stats
+{
+	return $node->safe_psql('postgres', q{
+SELECT attempts, failures, rejected, backoff_until IS NOT NULL
+FROM all_hooks_clients()
+WHERE client_addr = '127.0.0.1' AND NOT privileged;
+});
+}
+
+# a failure closes the address, even for the right password
+$node->safe_psql('postgres', 'SELECT all_hooks_clients_reset()');
+$node->connect_fails("$tcp password=wrong", 'wrong password fails',
+	expected_stderr => qr/password authentication failed/);
+$node->connect_fails("$tcp password=secret", 'address in backoff is rejected',
+	expected_stderr => qr/too many connection attempts/);
+is(client_stats(), '2|1|1|t', 'failure and rejection counted');
+
+# the local connections of the checks above were never rejected
+is( $node->safe_psql('postgres', q{
+SELECT attempts > 0, rejected FROM all_hooks_clients() WHERE client_addr IS NULL;
+}),
+	't|0',
+	'Unix socket connections are not limited');
+
+# rate limit: a burst of two, then one token per ~16 minutes
+$node->append_conf('postgresql.conf', qq{
+all_hooks.auth_backoff = 0
+all_hooks.auth_rate = 0.001
+all_hooks.auth_burst = 2
+});
+$node->reload;
+$node->safe_psql('postgres', 'SELECT all_hooks_clients_reset()');
+
+$node->connect_ok("$tcp password=secret", 'first of the burst');
+$node->connect_ok("$tcp password=secret", 'second of the burst');
+$node->connect_fails("$tcp password=secret", 'over the rate is rejected',
+	expected_stderr => qr/too many connection attempts/);
+is(client_stats(), '3|0|1|f', 'rate rejection counted');
+
+# a superuser from the same address has its own bucket
+$node->connect_ok($node->connstr('postgres') . ' host=127.0.0.1',
+	'superuser is not locked out by the other logins');
+is( $node->safe_psql('postgres', q{
+SELECT attempts, rejected FROM all_hooks_clients()
+WHERE client_addr = '127.0.0.1' AND privileged;
+}),
+	'1|0',
+	'superuser counted apart');
+
+$node->stop;
+
+done_testing();
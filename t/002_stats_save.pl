@@ -0,0 +1,97 @@
+# Statistics saved by a clean shutdown: restored by the next start, ignored
+# when damaged or left by a crash.  The client limiter state is not restored.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+use Time::HiRes qw(usleep);
+
+my $node = PostgreSQL::Test::Cluster->new('stats_save');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'all_hooks'
+listen_addresses = '127.0.0.1'
+all_hooks.auth_backoff = '1min'
+});
+$node->start;
+
+$node->safe_psql('postgres', q{
+CREATE EXTENSION all_hooks;
+CREATE ROLE regress_ah_client LOGIN PASSWORD 'secret';
+CREATE TABLE ah_saved (id int);
+});
+
+unlink($node->data_dir . '/pg_hba.conf');
+$node->append_conf('pg_hba.conf', qq{
+host all regress_ah_client 127.0.0.1/32 scram-sha-256
+local all all trust
+host all all 127.0.0.1/32 trust
+});
+$node->reload;
+
+my $tcp = $node->connstr('postgres') . ' host=127.0.0.1 user=regress_ah_client';
+my $stat_file = $node->data_dir . '/pg_stat/all_hooks.stat';
+
+my $utility = q{
+SELECT sum(calls) FROM all_hooks_utility() WHERE command = 'CREATE TABLE';
+};
+my $client = q{
+SELECT failures, failures_in_row, backoff_until IS NOT NULL
+FROM all_hooks_clients()
+WHERE client_addr = '127.0.0.1' AND NOT privileged;
+};
+
+$node->connect_fails("$tcp password=wrong", 'wrong password fails',
+	expected_stderr => qr/password authentication failed/);
+is($node->safe_psql('postgres', $client), '1|1|t', 'client in backoff');
+
+# round trip
+$node->restart;
+ok(!-e $stat_file, 'statistics file removed once loaded');
+is($node->safe_psql('postgres', $utility), '1', 'utility statistics restored');
+is($node->safe_psql('postgres', $client), '1|0|f',
+	'client counters restored without the backoff');
+$node->connect_ok("$tcp password=secret", 'restart lifted the backoff');
+
+# a damaged file is ignored
+$node->stop;
+ok(-e $stat_file, 'clean shutdown wrote the statistics file');
+{
+	open(my $fh, '+<', $stat_file) or die "could not open $stat_file: $!";
+	binmode $fh;
+	seek($fh, -1, 2);
+	read($fh, my $byte, 1);
+	seek($fh, -1, 2);
+	print $fh chr(ord($byte) ^ 0xFF);
+	close($fh);
+}
+my $log_offset = -s $node->logfile;
+$node->start;
+like(substr(slurp_file($node->logfile), $log_offset),
+	qr/ignoring all_hooks statistics file .*: checksum mismatch/,
+	'damaged file reported');
+ok(!-e $stat_file, 'damaged file removed');
+is($node->safe_psql('postgres', $utility), '', 'damaged file not loaded');
+
+# a crash restart saves nothing, the statistics start empty
+$node->safe_psql('postgres', 'CREATE TABLE ah_crash (id int)');
+my $pid = $node->safe_psql('postgres', q{
+SELECT pid FROM pg_stat_activity WHERE backend_type = 'background writer';
+});
+$log_offset = -s $node->logfile;
+kill 'KILL', $pid;
+for (my $i = 0; $i < 10 * $PostgreSQL::Test::Utils::timeout_default; $i++)
+{
+	last if substr(slurp_file($node->logfile), $log_offset) =~ /reinitializing/;
+	usleep(100_000);
+}
+$node->poll_query_until('postgres', 'SELECT pg_is_in_recovery()', 'f')
+  or die 'timed out waiting for the crash restart';
+ok(!-e $stat_file, 'no statistics file after a crash');
+is($node->safe_psql('postgres', $utility), '', 'nothing restored after a crash');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,3 @@
+CREATE TEMP TABLE bench_ddl (i int);
+CREATE INDEX ON bench_ddl (i);
+DROP TABLE bench_ddl;
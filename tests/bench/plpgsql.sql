@@ -0,0 +1,2 @@
+SELECT bench_loop(100);
+SELECT retourner_un();
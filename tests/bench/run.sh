@@ -0,0 +1,130 @@
+#!/bin/bash
+#
+# Overhead of all_hooks, measured with pgbench.
+#
+# Runs the same workloads on a throw-away cluster with the library not
+# loaded, preloaded with every hook group on, then with each group on by
+# itself, and reports TPS and average latency against the unloaded run.
+#
+# usage: tests/bench/run.sh [output file, default bench_output.txt]
+#
+#   PG_CONFIG   pg_config of the installation to test (pg_config)
+#   DURATION    seconds per run (30)
+#   CLIENTS     pgbench clients (4)
+#   SCALE       pgbench scale factor (10)
+#   PGPORT      port of the temporary cluster (54329)
+#
+# Workloads (in tests/bench):
+#   select      primary key lookups
+#   function    SQL set-returning function fn()
+#   plpgsql     PL/pgSQL loop and call
+#   ddl         create / index / drop of a temporary table
+#   reconnect   primary key lookups with a new connection per transaction
+
+set -euo pipefail
+
+here=$(cd "$(dirname "$0")" && pwd)
+tests=$(dirname "$here")
+output=${1:-bench_output.txt}
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+bindir=$("$PG_CONFIG" --bindir)
+DURATION=${DURATION:-30}
+CLIENTS=${CLIENTS:-4}
+SCALE=${SCALE:-10}
+export PGPORT=${PGPORT:-54329}
+export PGDATABASE=bench
+
+groups="planner executor utility fmgr plpgsql auth explain object_access emit_log"
+workloads="select function plpgsql ddl reconnect"
+
+work=$(mktemp -d)
+export PGHOST=$work
+
+cleanup()
+{
+	"$bindir/pg_ctl" -D "$work/data" -m immediate stop >/dev/null 2>&1 || true
+	rm -rf "$work"
+}
+trap cleanup EXIT
+
+# $1: shared_preload_libraries, $2: all_hooks.enabled
+start()
+{
+	cat > "$work/data/bench.conf" <<CONF
+shared_preload_libraries = '$1'
+all_hooks.enabled = '$2'
+CONF
+	"$bindir/pg_ctl" -D "$work/data" -l "$work/server.log" -w start >/dev/null
+}
+
+stop()
+{
+	"$bindir/pg_ctl" -D "$work/data" -w stop >/dev/null
+}
+
+# $1: workload, prints "tps latency_ms"
+run()
+{
+	local script=$1
+	local opts=""
+
+	if [ "$1" = reconnect ]; then
+		script=select
+		opts="-C"
+	fi
+	"$bindir/pgbench" -n -T "$DURATION" -c "$CLIENTS" -j "$CLIENTS" $opts \
+		-D scale="$SCALE" -f "$here/$script.sql" 2>&1 |
+		awk '/^tps = / { tps = $3 } /^latency average = / { lat = $4 }
+			 END { printf "%s %s\n", tps, lat }'
+}
+
+"$bindir/initdb" -D "$work/data" -A trust >/dev/null
+cat >> "$work/data/postgresql.conf" <<CONF
+listen_addresses = ''
+unix_socket_directories = '$work'
+port = $PGPORT
+max_connections = $((CLIENTS + 20))
+all_hooks.trace_functions = 'fn, bench_loop, retourner_un'
+include = 'bench.conf'
+CONF
+
+start "" ""
+"$bindir/createdb" bench
+"$bindir/pgbench" -i -q -s "$SCALE" >/dev/null 2>&1
+"$bindir/psql" -q -X -v ON_ERROR_STOP=1 \
+	-f "$tests/sql_function.sql" \
+	-f "$tests/plpgsql_function.sql" \
+	-f "$here/setup.sql"
+stop
+
+declare -A base_tps base_lat
+
+{
+	printf "# %s, %ss per run, %s clients, scale %s\n" \
+		"$("$bindir/postgres" --version)" "$DURATION" "$CLIENTS" "$SCALE"
+	printf "%-16s %-10s %12s %12s %9s %9s\n" \
+		config workload tps latency_ms tps_pct lat_pct
+} | tee "$output"
+
+for config in unloaded all $groups; do
+	case $config in
+		unloaded) start "" "none" ;;
+		*) start all_hooks "$config" ;;
+	esac
+
+	for workload in $workloads; do
+		read -r tps lat < <(run "$workload")
+		if [ "$config" = unloaded ]; then
+			base_tps[$workload]=$tps
+			base_lat[$workload]=$lat
+		fi
+		awk -v c="$config" -v w="$workload" -v t="$tps" -v l="$lat" \
+			-v bt="${base_tps[$workload]}" -v bl="${base_lat[$workload]}" \
+			'BEGIN { printf "%-16s %-10s %12.1f %12.3f %+8.1f%% %+8.1f%%\n",
+					 c, w, t, l, (t - bt) * 100 / bt, (l - bl) * 100 / bl }' |
+			tee -a "$output"
+	done
+
+	stop
+done
@@ -0,0 +1,13 @@
+-- objects used by the benchmark workloads, besides fn() and retourner_un()
+
+CREATE OR REPLACE FUNCTION bench_loop(n int)
+RETURNS integer AS $$
+DECLARE
+    total integer := 0;
+BEGIN
+    FOR i IN 1..n LOOP
+        total := total + i % 7;
+    END LOOP;
+    RETURN total;
+END;
+$$ LANGUAGE plpgsql;
@@ -0,0 +1,68 @@
+--
+-- Events recorded by each hook in the shared ring buffer
+--
+CREATE EXTENSION all_hooks;
+
+-- start from an empty buffer
+SELECT count(*) >= 0 AS drained FROM all_hooks_events();
+
+-- planner and executor
+SELECT 1 AS one;
+SELECT hook FROM all_hooks_events()
+WHERE pid = pg_backend_pid()
+	AND hook IN ('planner_hook', 'ExecutorStart_hook', 'ExecutorRun_hook',
+				 'ExecutorFinish_hook', 'ExecutorEnd_hook')
+GROUP BY hook ORDER BY hook COLLATE "C";
+
+-- utility and object access
+CREATE TABLE ah_t (i int);
+SELECT hook FROM all_hooks_events()
+WHERE pid = pg_backend_pid()
+	AND hook IN ('ProcessUtility_hook', 'object_access_hook')
+GROUP BY hook ORDER BY hook COLLATE "C";
+
+-- fmgr and PL/pgSQL
+CREATE FUNCTION ah_one() RETURNS int LANGUAGE plpgsql AS $$
+BEGIN
+	RETURN 1;
+END;
+$$;
+SET all_hooks.trace_functions = 'ah_one';
+SELECT ah_one();
+SELECT hook FROM all_hooks_events()
+WHERE pid = pg_backend_pid()
+	AND hook IN ('fmgr_hook', 'needs_fmgr_hook', 'plpgsql_func_setup',
+				 'plpgsql_func_beg', 'plpgsql_func_end', 'plpgsql_stmt_beg',
+				 'plpgsql_stmt_end')
+GROUP BY hook ORDER BY hook COLLATE "C";
+-- a begin and an end per call
+SELECT ah_one();
+-- and untraced lookups, such as the int4 output function, are not recorded
+SELECT count(*) FILTER (WHERE hook = 'fmgr_hook') AS fmgr_events,
+	   count(*) FILTER (WHERE hook = 'needs_fmgr_hook'
+						AND objid <> 'ah_one'::regproc::oid) AS untraced_lookups
+FROM all_hooks_events()
+WHERE pid = pg_backend_pid();
+RESET all_hooks.trace_functions;
+
+-- emit_log, only called for messages going to the server log
+DO $$ BEGIN RAISE LOG 'all_hooks test'; END $$;
+SELECT count(*) > 0 AS logged FROM all_hooks_events()
+WHERE pid = pg_backend_pid() AND hook = 'emit_log_hook';
+
+-- check_password
+CREATE ROLE regress_ah_role PASSWORD 'secret';
+DROP ROLE regress_ah_role;
+SELECT count(*) > 0 AS checked FROM all_hooks_events()
+WHERE pid = pg_backend_pid() AND hook = 'check_password_hook';
+
+-- ClientAuthentication, recorded by the new backend
+\c -
+SELECT count(*) > 0 AS authenticated FROM all_hooks_events()
+WHERE hook = 'ClientAuthentication_hook';
+SELECT sum(attempts) > 0 AS attempts, sum(failures) AS failures,
+	   sum(rejected) AS rejected
+FROM all_hooks_clients();
+
+-- nothing was overwritten
+SELECT all_hooks_events_dropped() AS dropped;
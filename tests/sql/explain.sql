@@ -0,0 +1,24 @@
+--
+-- EXPLAIN (HOOKS), unrecognized before PostgreSQL 18 (explain_1.out)
+--
+CREATE TABLE ah_e (i int);
+INSERT INTO ah_e SELECT generate_series(1, 10);
+
+-- numbers replaced, the times vary from run to run
+CREATE FUNCTION ah_explain(query text) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+	ln text;
+BEGIN
+	FOR ln IN EXECUTE query
+	LOOP
+		RETURN NEXT regexp_replace(ln, '\m\d+\M', 'N', 'g');
+	END LOOP;
+END
+$$;
+
+SELECT ah_explain('EXPLAIN (ANALYZE, HOOKS, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF)
+SELECT count(*) FROM ah_e');
+
+DROP FUNCTION ah_explain(text);
+DROP TABLE ah_e;
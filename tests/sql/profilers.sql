@@ -0,0 +1,160 @@
+--
+-- Latency histograms, function and PL/pgSQL profilers, query statistics
+--
+SELECT all_hooks_stats_reset();
+SELECT 1 AS one;
+SELECT hook, calls > 0 AS called,
+	   p50_time <= p99_time AND p99_time <= max_time AS ordered
+FROM all_hooks_stats()
+WHERE hook IN ('planner_hook', 'ExecutorRun_hook')
+ORDER BY hook COLLATE "C";
+
+-- function profiler
+SELECT all_hooks_functions_reset();
+SET all_hooks.trace_functions = 'ah_one';
+SELECT ah_one() FROM generate_series(1, 3);
+SELECT funcname, language, calls, aborts, self_time <= total_time AS self_ok
+FROM all_hooks_function_stats WHERE funcname = 'ah_one';
+RESET all_hooks.trace_functions;
+
+-- PL/pgSQL line profiler
+CREATE FUNCTION ah_loop(n int) RETURNS int LANGUAGE plpgsql AS $$
+DECLARE
+	total int := 0;
+BEGIN
+	FOR i IN 1..n LOOP
+		total := total + i;
+	END LOOP;
+	RETURN total;
+END;
+$$;
+SELECT all_hooks_plpgsql_statements_reset();
+SELECT ah_loop(10);
+SELECT lineno, stmt_type, calls FROM all_hooks_plpgsql_stats
+WHERE funcname = 'ah_loop' ORDER BY lineno;
+
+-- query statistics
+INSERT INTO ah_t SELECT generate_series(1, 100);
+ANALYZE ah_t;
+SELECT all_hooks_queries_reset();
+SELECT count(*) FROM ah_t WHERE i > 90;
+SELECT count(*) FROM ah_t WHERE i > 90;
+SELECT count(*) FROM ah_t WHERE i > 90;
+SELECT calls, rows, plans FROM all_hooks_query_stats
+WHERE datname = current_database() AND calls = 3;
+
+-- planning phases, read from the function as the views join
+SELECT all_hooks_queries_reset();
+SELECT count(*) FROM ah_t a JOIN ah_t b USING (i) JOIN ah_t c USING (i);
+SELECT join_searches, geqo_searches, joinrels > 0 AS joinrels,
+       join_paths > 0 AS join_paths, upper_paths > 0 AS upper_paths
+FROM all_hooks_queries()
+WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+  AND join_searches > 0;
+
+-- row estimates
+SET all_hooks.track_estimates = on;
+SELECT all_hooks_estimates_reset();
+SELECT count(*) FROM ah_t WHERE i % 2 = 0;
+SELECT node_type, relation, executions, actual_rows FROM all_hooks_misestimates
+WHERE node_type = 'Seq Scan';
+RESET all_hooks.track_estimates;
+
+-- index advisor
+SET all_hooks.track_columns = on;
+SELECT all_hooks_columns_reset();
+CREATE TABLE ah_adv (id int, v int);
+INSERT INTO ah_adv SELECT i, i % 100 FROM generate_series(1, 10000) i;
+ANALYZE ah_adv;
+SELECT count(*) FROM ah_adv WHERE id = 42;
+SELECT relation, attname, eq_filters, range_filters, joins FROM all_hooks_column_stats
+WHERE relation = 'ah_adv'::regclass;
+SELECT relid, attname, filters, used, reduction > 50 AS cheaper, index_def
+FROM all_hooks_index_advice('SELECT * FROM ah_adv WHERE id = $1');
+RESET all_hooks.track_columns;
+DROP TABLE ah_adv;
+
+-- plan cache
+SET all_hooks.plan_cache = on;
+SELECT all_hooks_plan_cache_reset();
+SELECT count(*) FROM ah_t WHERE i < 10;
+SELECT count(*) FROM ah_t WHERE i < 10;
+SELECT hits, valid FROM all_hooks_plan_cache() WHERE query LIKE 'SELECT count(*) FROM ah_t%';
+ALTER TABLE ah_t SET (fillfactor = 100);
+SELECT hits, valid FROM all_hooks_plan_cache() WHERE query LIKE 'SELECT count(*) FROM ah_t%';
+RESET all_hooks.plan_cache;
+SELECT all_hooks_plan_cache_reset();
+
+-- utility statements
+SELECT all_hooks_utility_reset();
+CREATE TABLE ah_u (id int);
+CREATE INDEX ON ah_u (id);
+TRUNCATE ah_u;
+VACUUM ah_u;
+SELECT command, relation, calls, toplevel_calls, nested_calls, lock_wait_time
+FROM all_hooks_utility_stats
+WHERE datname = current_database()
+ORDER BY command;
+DROP TABLE ah_u;
+
+-- node statistics
+SET all_hooks.track_nodes = on;
+SET work_mem = '64kB';
+SELECT all_hooks_plan_nodes_reset();
+SELECT max(x) FROM (SELECT i AS x FROM generate_series(1, 100000) i ORDER BY i DESC OFFSET 0) s;
+SELECT node_type, spills, sort_methods LIKE 'external%' AS external,
+       work_mem_needed > 64 AS needs_more
+FROM all_hooks_spills;
+RESET work_mem;
+RESET all_hooks.track_nodes;
+
+-- parallel workers report to their leader instead of adding calls
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SET parallel_leader_participation = off;
+-- enough pages for a parallel scan, even once analyzed
+CREATE TABLE ah_p AS SELECT generate_series(1, 10000) AS i;
+ANALYZE ah_p;
+SELECT all_hooks_queries_reset();
+SELECT count(*) FROM ah_p;
+SELECT max(calls) AS calls, sum(parallel_workers) BETWEEN 1 AND 2 AS workers
+FROM all_hooks_queries()
+WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database());
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+RESET parallel_leader_participation;
+DROP TABLE ah_p;
+
+-- query memory
+SET all_hooks.track_memory = on;
+SELECT all_hooks_memory_reset();
+SELECT count(*) FROM (SELECT i FROM generate_series(1, 10000) i ORDER BY i DESC OFFSET 0) s;
+SELECT executions, p50_peak > 0 AS peak, max_peak >= p99_peak AS max,
+       max_peak >= max_final AS final
+FROM all_hooks_memory_stats
+WHERE datname = current_database() AND max_peak > 100;
+RESET all_hooks.track_memory;
+
+-- JIT
+SET jit = off;
+SELECT all_hooks_queries_reset();
+SELECT count(*) FROM ah_t;
+SELECT count(*) AS jitted FROM all_hooks_jit_stats;
+SELECT setting, suggested_value = current_value AS unchanged, reason
+FROM all_hooks_jit_suggestion();
+RESET jit;
+
+-- JIT forced, when the server has a JIT provider
+SET jit = on;
+SET jit_above_cost = 0;
+SELECT all_hooks_queries_reset();
+SELECT count(*) FROM ah_t;
+SELECT (count(*) > 0) = pg_jit_available() AS jitted_if_available,
+	   coalesce(bool_and(jit_calls > 0 AND mean_functions > 0), true) AS functions
+FROM all_hooks_jit_stats;
+RESET jit_above_cost;
+RESET jit;
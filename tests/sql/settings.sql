@@ -0,0 +1,30 @@
+--
+-- Hook selection, sampling and cost threshold
+--
+SET all_hooks.enabled = 'none';
+SELECT count(*) >= 0 AS drained FROM all_hooks_events();
+SELECT 1 AS one;
+SET all_hooks.enabled = 'all';
+SELECT count(*) AS executor_end FROM all_hooks_events()
+WHERE pid = pg_backend_pid() AND hook = 'ExecutorEnd_hook';
+
+SET all_hooks.enabled = 'planner, bogus';
+
+-- no statement sampled
+SET all_hooks.sample_rate = 0;
+SELECT all_hooks_stats_reset();
+SELECT 1 AS one;
+SELECT count(*) AS sampled FROM all_hooks_stats() WHERE hook = 'ExecutorRun_hook';
+RESET all_hooks.sample_rate;
+
+-- cheap plans are not instrumented
+SET all_hooks.min_plan_cost = 1e9;
+SELECT all_hooks_stats_reset();
+SELECT 1 AS one;
+SELECT count(*) AS instrumented FROM all_hooks_stats() WHERE hook = 'ExecutorRun_hook';
+RESET all_hooks.min_plan_cost;
+
+DROP TABLE ah_t;
+DROP FUNCTION ah_one();
+DROP FUNCTION ah_loop(int);
+DROP EXTENSION all_hooks;